@@ -33,6 +33,11 @@ PYBIND11_MODULE(chiapos, m)
 {
     m.doc() = "Chia Proof of Space";
 
+    // Flags for the DiskProver constructor
+    m.attr("MMAP_PLOT") = static_cast<int>(MMAP_PLOT);
+    m.attr("RESIDENT_C1") = static_cast<int>(RESIDENT_C1);
+    m.attr("RESIDENT_C3") = static_cast<int>(RESIDENT_C3);
+
     py::class_<DiskPlotter>(m, "DiskPlotter")
         .def(py::init<>())
         .def(
@@ -77,6 +82,8 @@ PYBIND11_MODULE(chiapos, m)
 
     py::class_<DiskProver>(m, "DiskProver")
         .def(py::init<const std::string &>())
+        .def(py::init<const std::string &, uint8_t>())
+        .def(py::init<const std::string &, uint8_t, uint64_t>())
         .def(
             "get_memo",
             [](DiskProver &dp) {
@@ -97,6 +104,8 @@ PYBIND11_MODULE(chiapos, m)
             })
         .def("get_size", [](DiskProver &dp) { return dp.GetSize(); })
         .def("get_filename", [](DiskProver &dp) { return dp.GetFilename(); })
+        .def("get_park_cache_hits", [](DiskProver &dp) { return dp.GetParkCacheHits(); })
+        .def("get_park_cache_misses", [](DiskProver &dp) { return dp.GetParkCacheMisses(); })
         .def(
             "get_qualities_for_challenge",
             [](DiskProver &dp, const py::bytes &challenge) {
@@ -101,6 +101,7 @@ ext_modules = [
             "src/b3/blake3.c",
             "src/b3/blake3_portable.c",
             "src/b3/blake3_dispatch.c",
+            "src/b3/blake3_single_block.c",
             "src/b3/blake3_avx2.c",
             "src/b3/blake3_avx512.c",
             "src/b3/blake3_sse41.c",
@@ -140,7 +140,8 @@ b17Phase3Results b17RunPhase3(
             tmp_dirname,
             filename + ".p3.t" + std::to_string(table_index + 1),
             0,
-            0);
+            0,
+            flags & TEMP_FILES_IN_MEMORY);
 
         bool should_read_entry = true;
         std::vector<uint64_t> left_new_pos(kCachedPositionsSize);
@@ -343,7 +344,8 @@ b17Phase3Results b17RunPhase3(
             tmp_dirname,
             filename + ".p3s.t" + std::to_string(table_index + 1),
             0,
-            0);
+            0,
+            flags & TEMP_FILES_IN_MEMORY);
 
         std::vector<uint8_t> park_deltas;
         std::vector<uint64_t> park_stubs;
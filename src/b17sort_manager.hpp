@@ -41,7 +41,8 @@ public:
         const std::string &tmp_dirname,
         const std::string &filename,
         uint32_t begin_bits,
-        uint64_t stripe_size)
+        uint64_t stripe_size,
+        bool in_memory = false)
     {
         this->memory_start = memory;
         this->memory_size = memory_size;
@@ -68,7 +69,7 @@ public:
                 fs::path(tmp_dirname) /
                 fs::path(filename + ".sort_bucket_" + bucket_number_padded.str() + ".tmp");
             fs::remove(bucket_filename);
-            this->bucket_files.push_back(FileDisk(bucket_filename));
+            this->bucket_files.push_back(FileDisk(bucket_filename, in_memory));
         }
         this->final_position_start = 0;
         this->final_position_end = 0;
@@ -175,9 +176,7 @@ public:
     {
         // Close and delete files in case we exit without doing the sort
         for (auto &fd : this->bucket_files) {
-            std::string filename = fd.GetFileName();
-            fd.Close();
-            fs::remove(fs::path(fd.GetFileName()));
+            fd.Remove();
         }
         delete[] this->prev_bucket_buf;
         delete[] this->entry_buf;
@@ -49,6 +49,13 @@ void blake3_hasher_finalize(const blake3_hasher *self, uint8_t *out,
 void blake3_hasher_finalize_seek(const blake3_hasher *self, uint64_t seek,
                                  uint8_t *out, size_t out_len);
 
+// Hashes num_inputs messages of block_len (<= BLAKE3_BLOCK_LEN) bytes each,
+// using the widest SIMD kernel available. blocks holds the messages back to
+// back, each zero-padded to BLAKE3_BLOCK_LEN bytes. A BLAKE3_OUT_LEN byte
+// digest per message is written to out.
+void blake3_hash_single_blocks(const uint8_t *blocks, size_t num_inputs,
+                               uint8_t block_len, uint8_t *out);
+
 #ifdef __cplusplus
 }
 #endif
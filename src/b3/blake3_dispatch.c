@@ -218,6 +218,41 @@ void blake3_hash_many(const uint8_t *const *inputs, size_t num_inputs,
                             out);
 }
 
+void blake3_hash_single_blocks(const uint8_t *blocks, size_t num_inputs,
+                               uint8_t block_len, uint8_t *out) {
+#if defined(IS_X86)
+  const enum cpu_feature features = get_cpu_features();
+#if !defined(BLAKE3_NO_AVX512)
+  if (features & AVX512F) {
+    blake3_hash_single_blocks_avx512(blocks, num_inputs, block_len, out);
+    return;
+  }
+#endif
+#if !defined(BLAKE3_NO_AVX2)
+  if (features & AVX2) {
+    blake3_hash_single_blocks_avx2(blocks, num_inputs, block_len, out);
+    return;
+  }
+#endif
+#endif
+
+  while (num_inputs > 0) {
+    uint32_t cv[8];
+    memcpy(cv, IV, BLAKE3_KEY_LEN);
+    blake3_compress_in_place(cv, blocks, block_len, 0,
+                             CHUNK_START | CHUNK_END | ROOT);
+    for (size_t i = 0; i < 8; i++) {
+      out[i * 4 + 0] = (uint8_t)(cv[i] >> 0);
+      out[i * 4 + 1] = (uint8_t)(cv[i] >> 8);
+      out[i * 4 + 2] = (uint8_t)(cv[i] >> 16);
+      out[i * 4 + 3] = (uint8_t)(cv[i] >> 24);
+    }
+    blocks += BLAKE3_BLOCK_LEN;
+    out += BLAKE3_OUT_LEN;
+    num_inputs -= 1;
+  }
+}
+
 // The dynamically detected SIMD degree of the current platform.
 size_t blake3_simd_degree(void) {
 #if defined(IS_X86)
@@ -203,6 +203,8 @@ void blake3_hash_many_avx2(const uint8_t *const *inputs, size_t num_inputs,
                            uint64_t counter, bool increment_counter,
                            uint8_t flags, uint8_t flags_start,
                            uint8_t flags_end, uint8_t *out);
+void blake3_hash_single_blocks_avx2(const uint8_t *blocks, size_t num_inputs,
+                                    uint8_t block_len, uint8_t *out);
 #endif
 #if !defined(BLAKE3_NO_AVX512)
 void blake3_compress_in_place_avx512(uint32_t cv[8],
@@ -220,6 +222,10 @@ void blake3_hash_many_avx512(const uint8_t *const *inputs, size_t num_inputs,
                              uint64_t counter, bool increment_counter,
                              uint8_t flags, uint8_t flags_start,
                              uint8_t flags_end, uint8_t *out);
+
+void blake3_hash_single_blocks_avx512(const uint8_t *blocks,
+                                      size_t num_inputs, uint8_t block_len,
+                                      uint8_t *out);
 #endif
 #endif
 
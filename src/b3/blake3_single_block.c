@@ -0,0 +1,197 @@
+#include "blake3_impl.h"
+
+// Multi-input hashing of messages that fit in a single BLAKE3 block (at most
+// BLAKE3_BLOCK_LEN bytes). blake3_hash_many() always compresses full
+// BLAKE3_BLOCK_LEN blocks, but the block length is mixed into the compression
+// state, so short messages need their own kernels. Each message is the root
+// of its own one-chunk tree, i.e. the output is identical to
+// blake3_hasher_update() + blake3_hasher_finalize() of a 32 byte digest.
+//
+// Inputs are laid out back to back, each zero-padded to BLAKE3_BLOCK_LEN
+// bytes. All inputs share the same block_len.
+
+#if defined(IS_X86)
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define TARGET_AVX2
+#define TARGET_AVX512
+#else
+#include <immintrin.h>
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#endif
+
+#define SINGLE_BLOCK_FLAGS (CHUNK_START | CHUNK_END | ROOT)
+
+// The G function and the round, written once for both vector widths.
+#define G(add, xor, rot16, rot12, rot8, rot7, a, b, c, d, mx, my) \
+  a = add(add(a, b), mx);                                         \
+  d = rot16(xor(d, a));                                           \
+  c = add(c, d);                                                  \
+  b = rot12(xor(b, c));                                           \
+  a = add(add(a, b), my);                                         \
+  d = rot8(xor(d, a));                                            \
+  c = add(c, d);                                                  \
+  b = rot7(xor(b, c))
+
+#define ROUND(add, xor, rot16, rot12, rot8, rot7, v, m, r)                     \
+  G(add, xor, rot16, rot12, rot8, rot7, v[0], v[4], v[8], v[12],               \
+    m[MSG_SCHEDULE[r][0]], m[MSG_SCHEDULE[r][1]]);                             \
+  G(add, xor, rot16, rot12, rot8, rot7, v[1], v[5], v[9], v[13],               \
+    m[MSG_SCHEDULE[r][2]], m[MSG_SCHEDULE[r][3]]);                             \
+  G(add, xor, rot16, rot12, rot8, rot7, v[2], v[6], v[10], v[14],              \
+    m[MSG_SCHEDULE[r][4]], m[MSG_SCHEDULE[r][5]]);                             \
+  G(add, xor, rot16, rot12, rot8, rot7, v[3], v[7], v[11], v[15],              \
+    m[MSG_SCHEDULE[r][6]], m[MSG_SCHEDULE[r][7]]);                             \
+  G(add, xor, rot16, rot12, rot8, rot7, v[0], v[5], v[10], v[15],              \
+    m[MSG_SCHEDULE[r][8]], m[MSG_SCHEDULE[r][9]]);                             \
+  G(add, xor, rot16, rot12, rot8, rot7, v[1], v[6], v[11], v[12],              \
+    m[MSG_SCHEDULE[r][10]], m[MSG_SCHEDULE[r][11]]);                           \
+  G(add, xor, rot16, rot12, rot8, rot7, v[2], v[7], v[8], v[13],               \
+    m[MSG_SCHEDULE[r][12]], m[MSG_SCHEDULE[r][13]]);                           \
+  G(add, xor, rot16, rot12, rot8, rot7, v[3], v[4], v[9], v[14],               \
+    m[MSG_SCHEDULE[r][14]], m[MSG_SCHEDULE[r][15]])
+
+#if !defined(BLAKE3_NO_AVX2)
+
+#define DEGREE_AVX2 8
+
+#define add_avx2(a, b) _mm256_add_epi32(a, b)
+#define xor_avx2(a, b) _mm256_xor_si256(a, b)
+#define ror_avx2(x, n) \
+  _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+#define rot16_avx2(x) ror_avx2(x, 16)
+#define rot12_avx2(x) ror_avx2(x, 12)
+#define rot8_avx2(x) ror_avx2(x, 8)
+#define rot7_avx2(x) ror_avx2(x, 7)
+
+TARGET_AVX2
+static void hash8_single_block_avx2(const uint8_t *blocks, uint8_t block_len,
+                                    uint8_t *out) {
+  // Lane i reads its message words from blocks + i * BLAKE3_BLOCK_LEN
+  const __m256i lanes = _mm256_setr_epi32(0, 16, 32, 48, 64, 80, 96, 112);
+  __m256i m[16];
+  for (size_t j = 0; j < 16; j++) {
+    m[j] = _mm256_i32gather_epi32((const int *)(blocks + 4 * j), lanes, 4);
+  }
+
+  __m256i v[16];
+  for (size_t j = 0; j < 8; j++) {
+    v[j] = _mm256_set1_epi32((int32_t)IV[j]);
+  }
+  for (size_t j = 0; j < 4; j++) {
+    v[8 + j] = _mm256_set1_epi32((int32_t)IV[j]);
+  }
+  v[12] = _mm256_setzero_si256();
+  v[13] = _mm256_setzero_si256();
+  v[14] = _mm256_set1_epi32(block_len);
+  v[15] = _mm256_set1_epi32(SINGLE_BLOCK_FLAGS);
+
+  for (size_t r = 0; r < 7; r++) {
+    ROUND(add_avx2, xor_avx2, rot16_avx2, rot12_avx2, rot8_avx2, rot7_avx2, v,
+          m, r);
+  }
+
+  uint32_t cv[8][DEGREE_AVX2];
+  for (size_t j = 0; j < 8; j++) {
+    _mm256_storeu_si256((__m256i *)cv[j], xor_avx2(v[j], v[j + 8]));
+  }
+  // x86 is little-endian, so the words can be copied out as they are
+  for (size_t lane = 0; lane < DEGREE_AVX2; lane++) {
+    for (size_t j = 0; j < 8; j++) {
+      memcpy(&out[lane * BLAKE3_OUT_LEN + j * 4], &cv[j][lane], 4);
+    }
+  }
+}
+
+void blake3_hash_single_blocks_avx2(const uint8_t *blocks, size_t num_inputs,
+                                    uint8_t block_len, uint8_t *out) {
+  while (num_inputs >= DEGREE_AVX2) {
+    hash8_single_block_avx2(blocks, block_len, out);
+    blocks += DEGREE_AVX2 * BLAKE3_BLOCK_LEN;
+    out += DEGREE_AVX2 * BLAKE3_OUT_LEN;
+    num_inputs -= DEGREE_AVX2;
+  }
+  if (num_inputs > 0) {
+    uint8_t tail[DEGREE_AVX2 * BLAKE3_BLOCK_LEN] = {0};
+    uint8_t tail_out[DEGREE_AVX2 * BLAKE3_OUT_LEN];
+    memcpy(tail, blocks, num_inputs * BLAKE3_BLOCK_LEN);
+    hash8_single_block_avx2(tail, block_len, tail_out);
+    memcpy(out, tail_out, num_inputs * BLAKE3_OUT_LEN);
+  }
+}
+
+#endif // !defined(BLAKE3_NO_AVX2)
+
+#if !defined(BLAKE3_NO_AVX512)
+
+#define DEGREE_AVX512 16
+
+#define add_avx512(a, b) _mm512_add_epi32(a, b)
+#define xor_avx512(a, b) _mm512_xor_si512(a, b)
+#define rot16_avx512(x) _mm512_ror_epi32(x, 16)
+#define rot12_avx512(x) _mm512_ror_epi32(x, 12)
+#define rot8_avx512(x) _mm512_ror_epi32(x, 8)
+#define rot7_avx512(x) _mm512_ror_epi32(x, 7)
+
+TARGET_AVX512
+static void hash16_single_block_avx512(const uint8_t *blocks,
+                                       uint8_t block_len, uint8_t *out) {
+  const __m512i lanes =
+      _mm512_setr_epi32(0, 16, 32, 48, 64, 80, 96, 112, 128, 144, 160, 176,
+                        192, 208, 224, 240);
+  __m512i m[16];
+  for (size_t j = 0; j < 16; j++) {
+    m[j] = _mm512_i32gather_epi32(lanes, (const void *)(blocks + 4 * j), 4);
+  }
+
+  __m512i v[16];
+  for (size_t j = 0; j < 8; j++) {
+    v[j] = _mm512_set1_epi32((int32_t)IV[j]);
+  }
+  for (size_t j = 0; j < 4; j++) {
+    v[8 + j] = _mm512_set1_epi32((int32_t)IV[j]);
+  }
+  v[12] = _mm512_setzero_si512();
+  v[13] = _mm512_setzero_si512();
+  v[14] = _mm512_set1_epi32(block_len);
+  v[15] = _mm512_set1_epi32(SINGLE_BLOCK_FLAGS);
+
+  for (size_t r = 0; r < 7; r++) {
+    ROUND(add_avx512, xor_avx512, rot16_avx512, rot12_avx512, rot8_avx512,
+          rot7_avx512, v, m, r);
+  }
+
+  uint32_t cv[8][DEGREE_AVX512];
+  for (size_t j = 0; j < 8; j++) {
+    _mm512_storeu_si512((void *)cv[j], xor_avx512(v[j], v[j + 8]));
+  }
+  for (size_t lane = 0; lane < DEGREE_AVX512; lane++) {
+    for (size_t j = 0; j < 8; j++) {
+      memcpy(&out[lane * BLAKE3_OUT_LEN + j * 4], &cv[j][lane], 4);
+    }
+  }
+}
+
+void blake3_hash_single_blocks_avx512(const uint8_t *blocks,
+                                      size_t num_inputs, uint8_t block_len,
+                                      uint8_t *out) {
+  while (num_inputs >= DEGREE_AVX512) {
+    hash16_single_block_avx512(blocks, block_len, out);
+    blocks += DEGREE_AVX512 * BLAKE3_BLOCK_LEN;
+    out += DEGREE_AVX512 * BLAKE3_OUT_LEN;
+    num_inputs -= DEGREE_AVX512;
+  }
+  if (num_inputs > 0) {
+    uint8_t tail[DEGREE_AVX512 * BLAKE3_BLOCK_LEN] = {0};
+    uint8_t tail_out[DEGREE_AVX512 * BLAKE3_OUT_LEN];
+    memcpy(tail, blocks, num_inputs * BLAKE3_BLOCK_LEN);
+    hash16_single_block_avx512(tail, block_len, tail_out);
+    memcpy(out, tail_out, num_inputs * BLAKE3_OUT_LEN);
+  }
+}
+
+#endif // !defined(BLAKE3_NO_AVX512)
+
+#endif // defined(IS_X86)
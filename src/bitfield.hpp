@@ -31,6 +31,22 @@ struct bitfield
         buffer_[bit / 64] |= uint64_t(1) << (bit % 64);
     }
 
+    // Like set(), but may be called by multiple threads at the same time
+    void set_atomic(int64_t const bit)
+    {
+        assert(bit / 64 < size_);
+        uint64_t const mask = uint64_t(1) << (bit % 64);
+        uint64_t* const word = &buffer_[bit / 64];
+        // Bits that are already set don't need the locked instruction
+#if defined(_MSC_VER)
+        if (*reinterpret_cast<volatile uint64_t*>(word) & mask) return;
+        _InterlockedOr64(reinterpret_cast<volatile int64_t*>(word), mask);
+#else
+        if (__atomic_load_n(word, __ATOMIC_RELAXED) & mask) return;
+        __atomic_fetch_or(word, mask, __ATOMIC_RELAXED);
+#endif
+    }
+
     bool get(int64_t const bit) const
     {
         assert(bit / 64 < size_);
@@ -44,6 +60,9 @@ struct bitfield
 
     int64_t size() const { return size_ * 64; }
 
+    // The bits, 64 per word, starting at the least significant bit of each word
+    uint64_t const* data() const { return buffer_.get(); }
+
     void swap(bitfield& rhs)
     {
         using std::swap;
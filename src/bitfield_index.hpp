@@ -15,49 +15,185 @@
 #pragma once
 
 #include <algorithm>
+#include <tuple>
+#include <vector>
 #include "bitfield.hpp"
 
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define BITFIELD_SIMD_POPCOUNT
+#if defined(_MSC_VER)
+#define BITFIELD_TARGET_AVX2
+#define BITFIELD_TARGET_AVX512
+#else
+#define BITFIELD_TARGET_AVX2 __attribute__((target("avx2")))
+#define BITFIELD_TARGET_AVX512 __attribute__((target("avx512f,avx512vpopcntdq")))
+#endif
+#endif
+
+// Implementations of the popcounts that build the index. All produce identical output.
+enum class popcount_kernel { scalar, avx2, avx512 };
+
+// rank9 index over a bitfield (Vigna, "Broadword Implementation of Rank/Select Queries").
+// Every block of kIndexBucket bits has two interleaved 64 bit words of counts: the number of
+// set bits before the block, and the number of set bits before each of the words 1 to 7 of the
+// block, in 9 bits each. Counting the set bits before a position then takes one popcount.
 struct bitfield_index
 {
-    // Cache the number of set bits every kIndexBucket bits.
-    // For a bitfield of size 2^32, this means a 32 MiB index
-    static inline const int64_t kIndexBucket = 1024;
+    // Number of bits of each block. For a bitfield of size 2^32, this means a 128 MiB index
+    static inline const int64_t kIndexBucket = 512;
 
-    bitfield_index(bitfield const& b) : bitfield_(b)
+    // Number of entries ahead that the batched lookup() prefetches
+    static inline const size_t kPrefetchDistance = 16;
+
+    bitfield_index(bitfield const& b, popcount_kernel const kernel = best_kernel())
+        : bitfield_(b)
     {
-        uint64_t counter = 0;
-        index_.reserve(bitfield_.size() / kIndexBucket);
+        int64_t const num_words = bitfield_.size() / 64;
+        int64_t const full_blocks = num_words / 8;
+        index_.resize(2 * ((num_words + 7) / 8));
 
-        for (int64_t idx = 0; idx < int64_t(bitfield_.size()); idx += kIndexBucket) {
-            index_.push_back(counter);
-            int64_t const left = std::min(int64_t(bitfield_.size()) - idx, kIndexBucket);
-            counter += bitfield_.count(idx, idx + left);
+        uint64_t counter = 0;
+        uint64_t word_counts[8];
+        for (int64_t block = 0; block < full_blocks; ++block) {
+            uint64_t const* words = bitfield_.data() + block * 8;
+            switch (kernel) {
+#if defined(BITFIELD_SIMD_POPCOUNT)
+                case popcount_kernel::avx512:
+                    count_words_avx512(words, word_counts);
+                    break;
+                case popcount_kernel::avx2:
+                    count_words_avx2(words, word_counts);
+                    break;
+#endif
+                default:
+                    count_words(words, 8, word_counts);
+            }
+            set_block(block, word_counts, counter);
+        }
+        if (full_blocks * 8 < num_words) {
+            // The words past the end of the bitfield count as empty
+            std::fill(word_counts, word_counts + 8, 0);
+            count_words(bitfield_.data() + full_blocks * 8, num_words - full_blocks * 8, word_counts);
+            set_block(full_blocks, word_counts, counter);
         }
     }
 
-    std::pair<uint64_t, uint64_t> lookup(uint64_t pos, uint64_t offset) const
+    // The fastest kernel this CPU supports
+    static popcount_kernel best_kernel()
     {
-        uint64_t const bucket = pos / kIndexBucket;
+#if defined(BITFIELD_SIMD_POPCOUNT)
+        if (Util::HaveAVX512VPOPCNTDQ()) return popcount_kernel::avx512;
+        if (Util::HaveAVX2()) return popcount_kernel::avx2;
+#endif
+        return popcount_kernel::scalar;
+    }
+
+    // Number of set bits before pos
+    uint64_t rank(uint64_t const pos) const
+    {
+        uint64_t const word = pos / 64;
+        uint64_t const* counts = index_.data() + 2 * (pos / kIndexBucket);
+        // For the first word of the block, t wraps around and the shift is 63, which selects the
+        // always zero top bit
+        uint64_t const t = (word % 8) - 1;
+        uint64_t const relative = (counts[1] >> ((t + (t >> 60 & 8)) * 9)) & 0x1FF;
+        uint64_t const mask = (uint64_t(1) << (pos % 64)) - 1;
+        return counts[0] + relative + Util::PopCount(bitfield_.data()[word] & mask);
+    }
 
-        assert(bucket < index_.size());
+    std::pair<uint64_t, uint64_t> lookup(uint64_t pos, uint64_t offset) const
+    {
+        assert(pos / kIndexBucket < index_.size() / 2);
         assert(pos < uint64_t(bitfield_.size()));
         assert(pos + offset < uint64_t(bitfield_.size()));
         assert(bitfield_.get(pos) && bitfield_.get(pos + offset));
 
-        uint64_t const base = index_[bucket];
-
-        int64_t const aligned_pos = pos & ~uint64_t(63);
-
-        uint64_t const aligned_pos_count = bitfield_.count(bucket * kIndexBucket, aligned_pos);
-        uint64_t const offset_count = aligned_pos_count + bitfield_.count(aligned_pos, pos + offset);
-        uint64_t const pos_count = aligned_pos_count + bitfield_.count(aligned_pos, pos);
+        uint64_t const pos_count = rank(pos);
+        uint64_t const offset_count = rank(pos + offset);
 
         assert(offset_count >= pos_count);
 
-        return { base + pos_count, offset_count - pos_count };
+        return { pos_count, offset_count - pos_count };
+    }
+
+    // Looks up num_entries positions and offsets, and replaces them with the results of
+    // lookup(). The index blocks and bitfield words of the entries kPrefetchDistance ahead are
+    // prefetched, so that the cache misses of the lookups overlap.
+    void lookup(uint64_t* pos, uint64_t* offset, size_t const num_entries) const
+    {
+        for (size_t i = 0; i < num_entries; ++i) {
+            if (i + kPrefetchDistance < num_entries) {
+                prefetch(pos[i + kPrefetchDistance]);
+                prefetch(pos[i + kPrefetchDistance] + offset[i + kPrefetchDistance]);
+            }
+            std::tie(pos[i], offset[i]) = lookup(pos[i], offset[i]);
+        }
     }
 private:
+    void prefetch(uint64_t const pos) const
+    {
+        void const* const counts = index_.data() + 2 * (pos / kIndexBucket);
+        void const* const word = bitfield_.data() + pos / 64;
+#if defined(_MSC_VER)
+        _mm_prefetch(static_cast<char const*>(counts), _MM_HINT_T0);
+        _mm_prefetch(static_cast<char const*>(word), _MM_HINT_T0);
+#else
+        __builtin_prefetch(counts);
+        __builtin_prefetch(word);
+#endif
+    }
+
+    // Stores the counts of the block, given the number of set bits of each of its words, and
+    // adds them to counter
+    void set_block(int64_t const block, uint64_t const* word_counts, uint64_t& counter)
+    {
+        uint64_t relative = 0;
+        uint64_t packed = 0;
+        for (int w = 0; w < 8; ++w) {
+            if (w > 0) packed |= relative << (9 * (w - 1));
+            relative += word_counts[w];
+        }
+        index_[2 * block] = counter;
+        index_[2 * block + 1] = packed;
+        counter += relative;
+    }
+
+    static void count_words(uint64_t const* words, int64_t const num_words, uint64_t* word_counts)
+    {
+        for (int64_t w = 0; w < num_words; ++w) {
+            word_counts[w] = Util::PopCount(words[w]);
+        }
+    }
+
+#if defined(BITFIELD_SIMD_POPCOUNT)
+    // Counts the bits of each byte with a 4 bit lookup table, and sums them up per word
+    BITFIELD_TARGET_AVX2
+    static void count_words_avx2(uint64_t const* words, uint64_t* word_counts)
+    {
+        __m256i const table = _mm256_setr_epi8(
+            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+        __m256i const low_mask = _mm256_set1_epi8(0x0f);
+        for (int i = 0; i < 8; i += 4) {
+            __m256i const v = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(words + i));
+            __m256i const lo = _mm256_and_si256(v, low_mask);
+            __m256i const hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+            __m256i const bytes = _mm256_add_epi8(
+                _mm256_shuffle_epi8(table, lo), _mm256_shuffle_epi8(table, hi));
+            _mm256_storeu_si256(
+                reinterpret_cast<__m256i*>(word_counts + i),
+                _mm256_sad_epu8(bytes, _mm256_setzero_si256()));
+        }
+    }
+
+    BITFIELD_TARGET_AVX512
+    static void count_words_avx512(uint64_t const* words, uint64_t* word_counts)
+    {
+        _mm512_storeu_si512(word_counts, _mm512_popcnt_epi64(_mm512_loadu_si512(words)));
+    }
+#endif
+
     bitfield const& bitfield_;
     std::vector<uint64_t> index_;
 };
-
@@ -22,9 +22,14 @@
 #include <bitset>
 #include <iostream>
 #include <map>
+#include <mutex>
 #include <utility>
 #include <vector>
 
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
 #include "b3/blake3.h"
 #include "bits.hpp"
 #include "chacha8.h"
@@ -54,7 +59,7 @@ const uint16_t kBC = kB * kC;
 static const uint8_t kVectorLens[] = {0, 0, 1, 2, 4, 4, 3, 2};
 
 uint16_t L_targets[2][kBC][kExtraBitsPow];
-bool initialized = false;
+std::once_flag tables_loaded;
 void load_tables()
 {
     for (uint8_t parity = 0; parity < 2; parity++) {
@@ -192,11 +197,49 @@ private:
     uint8_t *buf_{};
 };
 
-struct rmap_item {
-    uint16_t count : 4;
-    uint16_t pos : 12;
+// Metadata passed to and returned from the batched f functions. Values that fit in 128 bits
+// are stored in left. Longer values keep their first 128 bits in left and the rest in right,
+// the same split as PlotEntry::left_metadata / right_metadata.
+struct FxMetadata {
+    uint128_t left;
+    uint128_t right;
 };
 
+// Appends num_bits of metadata to a big-endian bit stream, see Util::AppendBits.
+inline void AppendMetadata(
+    uint8_t* buf,
+    uint32_t& bit_pos,
+    const FxMetadata& metadata,
+    uint32_t num_bits)
+{
+    if (num_bits <= 128) {
+        Util::AppendBits(buf, bit_pos, metadata.left, num_bits);
+    } else {
+        Util::AppendBits(buf, bit_pos, metadata.left, 128);
+        Util::AppendBits(buf, bit_pos, metadata.right, num_bits - 128);
+    }
+}
+
+// FindMatches keeps one rmap entry per y value of the right bucket. The low kRmapCountBits
+// bits hold the number of right entries with that y, the high bits the position of the first
+// one. Explicit packing (rather than bitfields) lets the SIMD kernels test the counts directly.
+const uint16_t kRmapCountBits = 4;
+const uint16_t kRmapCountMask = (1U << kRmapCountBits) - 1;
+
+// Implementations of the search loop of FindMatches. All produce identical output.
+enum class MatchKernel { scalar, avx2, avx512 };
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define FX_SIMD_MATCHES
+#if defined(_MSC_VER)
+#define FX_TARGET_AVX2
+#define FX_TARGET_AVX512
+#else
+#define FX_TARGET_AVX2 __attribute__((target("avx2")))
+#define FX_TARGET_AVX512 __attribute__((target("avx512f")))
+#endif
+#endif
+
 // Class to evaluate F2 .. F7.
 class FxCalculator {
 public:
@@ -207,15 +250,25 @@ public:
         this->k_ = k;
         this->table_index_ = table_index;
 
-        this->rmap.resize(kBC);
-        if (!initialized) {
-            initialized = true;
-            load_tables();
+        // One extra entry, since the SIMD kernels gather 4 bytes for each 2 byte entry
+        this->rmap.resize(kBC + 1);
+        // Provers may construct calculators on several threads at once
+        std::call_once(tables_loaded, load_tables);
+#if defined(FX_SIMD_MATCHES)
+        if (Util::HaveAVX512F()) {
+            this->match_kernel_ = MatchKernel::avx512;
+        } else if (Util::HaveAVX2()) {
+            this->match_kernel_ = MatchKernel::avx2;
         }
+#endif
     }
 
     inline ~FxCalculator() = default;
 
+    // Overrides the FindMatches implementation picked for this CPU. The kernel must be
+    // supported by the CPU.
+    inline void SetMatchKernel(MatchKernel kernel) { this->match_kernel_ = kernel; }
+
     // Disable copying
     FxCalculator(const FxCalculator&) = delete;
 
@@ -263,9 +316,59 @@ public:
         return std::make_pair(Bits(f, k_ + kExtraBits), c);
     }
 
+    // Evaluates the f function for n inputs at once. For input i, y1[i] is the k + kExtraBits
+    // bit y value of the left entry and L[i], R[i] are the metadata of the left and right
+    // entries. Writes f into f_out[i] and the metadata for the next table into c_out[i]. The
+    // results are identical to CalculateBucket(), but the inputs are hashed with the widest
+    // available SIMD kernel.
+    inline void CalculateBuckets(
+        uint32_t n,
+        const uint64_t* y1,
+        const FxMetadata* L,
+        const FxMetadata* R,
+        uint64_t* f_out,
+        FxMetadata* c_out)
+    {
+        const uint32_t y_size = k_ + kExtraBits;
+        const uint32_t metadata_size = kVectorLens[table_index_] * k_;
+        const uint32_t c_size = table_index_ < 7 ? kVectorLens[table_index_ + 1] * k_ : 0;
+        const uint32_t input_size = y_size + 2 * metadata_size;
+
+        // Extra bytes at the end make the 8 byte reads and writes below safe
+        blocks_.assign((size_t)n * BLAKE3_BLOCK_LEN + 16, 0);
+        hashes_.resize((size_t)n * BLAKE3_OUT_LEN + 16);
+
+        for (uint32_t i = 0; i < n; i++) {
+            uint8_t* block = blocks_.data() + (size_t)i * BLAKE3_BLOCK_LEN;
+            uint32_t bit_pos = 0;
+            Util::AppendBits(block, bit_pos, y1[i], y_size);
+            AppendMetadata(block, bit_pos, L[i], metadata_size);
+            AppendMetadata(block, bit_pos, R[i], metadata_size);
+        }
+
+        blake3_hash_single_blocks(blocks_.data(), n, cdiv(input_size, 8), hashes_.data());
+
+        for (uint32_t i = 0; i < n; i++) {
+            const uint8_t* hash = hashes_.data() + (size_t)i * BLAKE3_OUT_LEN;
+            f_out[i] = Util::EightBytesToInt(hash) >> (64 - y_size);
+
+            // For the first tables c is L + R, which follows y in the input. Afterwards it is
+            // taken from the hash, also right after the bits used for f.
+            const uint8_t* c_src =
+                table_index_ < 4 ? blocks_.data() + (size_t)i * BLAKE3_BLOCK_LEN : hash;
+            if (c_size <= 128) {
+                c_out[i].left = c_size ? Util::SliceInt128FromBytes(c_src, y_size, c_size) : 0;
+                c_out[i].right = 0;
+            } else {
+                c_out[i].left = Util::SliceInt128FromBytes(c_src, y_size, 128);
+                c_out[i].right = Util::SliceInt128FromBytes(c_src, y_size + 128, c_size - 128);
+            }
+        }
+    }
+
     // Given two buckets with entries (y values), computes which y values match, and returns a list
-    // of the pairs of indices into bucket_L and bucket_R. Indices l and r match iff:
-    //   let  yl = bucket_L[l].y,  yr = bucket_R[r].y
+    // of the pairs of indices into y_L and y_R. Indices l and r match iff:
+    //   let  yl = y_L[l],  yr = y_R[r]
     //
     //   For any 0 <= m < kExtraBitsPow:
     //   yl / kBC + 1 = yR / kBC   AND
@@ -274,55 +377,182 @@ public:
     //
     // Instead of doing the naive algorithm, which is an O(kExtraBitsPow * N^2) comparisons on
     // bucket length, we can store all the R values and lookup each of our 32 candidates to see if
-    // any R value matches. This function can be further optimized by removing the inner loop, and
-    // being more careful with memory allocation.
+    // any R value matches. The lookups of the candidates run on SIMD registers where available.
     inline int32_t FindMatches(
-        const std::vector<PlotEntry>& bucket_L,
-        const std::vector<PlotEntry>& bucket_R,
+        const uint64_t* y_L,
+        size_t size_L,
+        const uint64_t* y_R,
+        size_t size_R,
         uint16_t *idx_L,
         uint16_t *idx_R)
     {
-        int32_t idx_count = 0;
-        uint16_t parity = (bucket_L[0].y / kBC) % 2;
+        uint16_t parity = (y_L[0] / kBC) % 2;
 
         for (size_t yl : rmap_clean) {
-            this->rmap[yl].count = 0;
+            this->rmap[yl] = 0;
         }
         rmap_clean.clear();
 
-        uint64_t remove = (bucket_R[0].y / kBC) * kBC;
-        for (size_t pos_R = 0; pos_R < bucket_R.size(); pos_R++) {
-            uint64_t r_y = bucket_R[pos_R].y - remove;
+        uint64_t remove = (y_R[0] / kBC) * kBC;
+        for (size_t pos_R = 0; pos_R < size_R; pos_R++) {
+            uint64_t r_y = y_R[pos_R] - remove;
+            uint16_t item = rmap[r_y];
 
-            if (!rmap[r_y].count) {
-                rmap[r_y].pos = pos_R;
+            if (!(item & kRmapCountMask)) {
+                item = pos_R << kRmapCountBits;
             }
-            rmap[r_y].count++;
+            // The count wraps around, like a 4 bit field would
+            rmap[r_y] = (item & ~kRmapCountMask) | ((item + 1) & kRmapCountMask);
             rmap_clean.push_back(r_y);
         }
 
         uint64_t remove_y = remove - kBC;
-        for (size_t pos_L = 0; pos_L < bucket_L.size(); pos_L++) {
-            uint64_t r = bucket_L[pos_L].y - remove_y;
+        switch (match_kernel_) {
+#if defined(FX_SIMD_MATCHES)
+            case MatchKernel::avx512:
+                return SearchMatchesAVX512(y_L, size_L, remove_y, parity, idx_L, idx_R);
+            case MatchKernel::avx2:
+                return SearchMatchesAVX2(y_L, size_L, remove_y, parity, idx_L, idx_R);
+#endif
+            default:
+                return SearchMatches(y_L, size_L, remove_y, parity, idx_L, idx_R);
+        }
+    }
+
+    // Same as above, for buckets of PlotEntry.
+    inline int32_t FindMatches(
+        const std::vector<PlotEntry>& bucket_L,
+        const std::vector<PlotEntry>& bucket_R,
+        uint16_t *idx_L,
+        uint16_t *idx_R)
+    {
+        std::vector<uint64_t> y_L(bucket_L.size());
+        std::vector<uint64_t> y_R(bucket_R.size());
+        for (size_t i = 0; i < bucket_L.size(); i++) y_L[i] = bucket_L[i].y;
+        for (size_t i = 0; i < bucket_R.size(); i++) y_R[i] = bucket_R[i].y;
+        return FindMatches(y_L.data(), y_L.size(), y_R.data(), y_R.size(), idx_L, idx_R);
+    }
+
+private:
+    // Appends the matches of left entry pos_L with the right entries of an rmap item.
+    static inline int32_t AddMatches(
+        uint16_t pos_L,
+        uint16_t item,
+        uint16_t *idx_L,
+        uint16_t *idx_R,
+        int32_t idx_count)
+    {
+        uint16_t count = item & kRmapCountMask;
+        uint16_t pos_R = item >> kRmapCountBits;
+        for (uint16_t j = 0; j < count; j++) {
+            if(idx_L != nullptr) {
+                idx_L[idx_count]=pos_L;
+                idx_R[idx_count]=pos_R + j;
+            }
+            idx_count++;
+        }
+        return idx_count;
+    }
+
+    // Looks up the kExtraBitsPow candidate targets of every left entry in rmap.
+    inline int32_t SearchMatches(
+        const uint64_t* y_L,
+        size_t size_L,
+        uint64_t remove_y,
+        uint16_t parity,
+        uint16_t *idx_L,
+        uint16_t *idx_R) const
+    {
+        int32_t idx_count = 0;
+        for (size_t pos_L = 0; pos_L < size_L; pos_L++) {
+            uint64_t r = y_L[pos_L] - remove_y;
             for (uint8_t i = 0; i < kExtraBitsPow; i++) {
                 uint16_t r_target = L_targets[parity][r][i];
-                for (size_t j = 0; j < rmap[r_target].count; j++) {
-                    if(idx_L != nullptr) {
-                        idx_L[idx_count]=pos_L;
-                        idx_R[idx_count]=rmap[r_target].pos + j;
-                    }
-                    idx_count++;
-                }
+                idx_count = AddMatches(pos_L, rmap[r_target], idx_L, idx_R, idx_count);
             }
         }
         return idx_count;
     }
 
-private:
+#if defined(FX_SIMD_MATCHES)
+    // Most candidates have no right entry, so the SIMD kernels gather the rmap items of all
+    // candidates, and only walk the ones with a non-zero count. Gathers load 4 bytes at
+    // 2 * target, the low half of which is the item.
+    FX_TARGET_AVX2
+    inline int32_t SearchMatchesAVX2(
+        const uint64_t* y_L,
+        size_t size_L,
+        uint64_t remove_y,
+        uint16_t parity,
+        uint16_t *idx_L,
+        uint16_t *idx_R) const
+    {
+        const int* base = (const int*)rmap.data();
+        const __m256i count_mask = _mm256_set1_epi32(kRmapCountMask);
+        int32_t idx_count = 0;
+
+        for (size_t pos_L = 0; pos_L < size_L; pos_L++) {
+            const uint16_t* targets = L_targets[parity][y_L[pos_L] - remove_y];
+            uint64_t found = 0;
+            for (uint8_t i = 0; i < kExtraBitsPow; i += 8) {
+                __m256i t = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(targets + i)));
+                __m256i items = _mm256_i32gather_epi32(base, t, 2);
+                __m256i empty =
+                    _mm256_cmpeq_epi32(_mm256_and_si256(items, count_mask), _mm256_setzero_si256());
+                uint64_t bits = ~_mm256_movemask_ps(_mm256_castsi256_ps(empty)) & 0xff;
+                found |= bits << i;
+            }
+            for (; found != 0; found &= found - 1) {
+                uint16_t r_target = targets[Util::CountTrailingZeros(found)];
+                idx_count = AddMatches(pos_L, rmap[r_target], idx_L, idx_R, idx_count);
+            }
+        }
+        return idx_count;
+    }
+
+    FX_TARGET_AVX512
+    inline int32_t SearchMatchesAVX512(
+        const uint64_t* y_L,
+        size_t size_L,
+        uint64_t remove_y,
+        uint16_t parity,
+        uint16_t *idx_L,
+        uint16_t *idx_R) const
+    {
+        const void* base = rmap.data();
+        const __m512i count_mask = _mm512_set1_epi32(kRmapCountMask);
+        int32_t idx_count = 0;
+
+        for (size_t pos_L = 0; pos_L < size_L; pos_L++) {
+            const uint16_t* targets = L_targets[parity][y_L[pos_L] - remove_y];
+            uint64_t found = 0;
+            for (uint8_t i = 0; i < kExtraBitsPow; i += 16) {
+                // The masked forms avoid _mm512_undefined_epi32(), which trips
+                // -Wmaybe-uninitialized on some GCC versions
+                __m512i t = _mm512_maskz_cvtepu16_epi32(
+                    0xffff, _mm256_loadu_si256((const __m256i*)(targets + i)));
+                __m512i items =
+                    _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), 0xffff, t, base, 2);
+                uint64_t bits = _mm512_test_epi32_mask(items, count_mask);
+                found |= bits << i;
+            }
+            for (; found != 0; found &= found - 1) {
+                uint16_t r_target = targets[Util::CountTrailingZeros(found)];
+                idx_count = AddMatches(pos_L, rmap[r_target], idx_L, idx_R, idx_count);
+            }
+        }
+        return idx_count;
+    }
+#endif
+
     uint8_t k_{};
     uint8_t table_index_{};
-    std::vector<struct rmap_item> rmap;
+    MatchKernel match_kernel_ = MatchKernel::scalar;
+    std::vector<uint16_t> rmap;
     std::vector<uint16_t> rmap_clean;
+    // Scratch space for CalculateBuckets()
+    std::vector<uint8_t> blocks_;
+    std::vector<uint8_t> hashes_;
 };
 
 #endif  // SRC_CPP_CALCULATE_BUCKET_HPP_
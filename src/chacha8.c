@@ -54,7 +54,11 @@ void chacha8_keysetup(struct chacha8_ctx *x, const uint8_t *k, uint32_t kbits, c
     }
 }
 
-void chacha8_get_keystream(const struct chacha8_ctx *x, uint64_t pos, uint32_t n_blocks, uint8_t *c)
+static void chacha8_get_keystream_portable(
+    const struct chacha8_ctx *x,
+    uint64_t pos,
+    uint32_t n_blocks,
+    uint8_t *c)
 {
     uint32_t x0, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11, x12, x13, x14, x15;
     uint32_t j0, j1, j2, j3, j4, j5, j6, j7, j8, j9, j10, j11, j12, j13, j14, j15;
@@ -147,3 +151,243 @@ void chacha8_get_keystream(const struct chacha8_ctx *x, uint64_t pos, uint32_t n
         c += 64;
     }
 }
+
+#if defined(__x86_64__) || defined(_M_X64)
+
+/*
+ * Multi-block keystream generation. Each kernel computes W consecutive blocks at once, word i
+ * of all blocks in one vector register, and runs on CPUs reported by chacha8_simd_degree().
+ */
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define TARGET_AVX2
+#define TARGET_AVX512
+#else
+#include <cpuid.h>
+#include <immintrin.h>
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#endif
+
+#define QUARTERROUND_V(add, xor, rot16, rot12, rot8, rot7, a, b, c, d) \
+    a = add(a, b);                                                     \
+    d = rot16(xor(d, a));                                              \
+    c = add(c, d);                                                     \
+    b = rot12(xor(b, c));                                              \
+    a = add(a, b);                                                     \
+    d = rot8(xor(d, a));                                               \
+    c = add(c, d);                                                     \
+    b = rot7(xor(b, c))
+
+#define DOUBLEROUND_V(add, xor, rot16, rot12, rot8, rot7, v)                      \
+    QUARTERROUND_V(add, xor, rot16, rot12, rot8, rot7, v[0], v[4], v[8], v[12]);  \
+    QUARTERROUND_V(add, xor, rot16, rot12, rot8, rot7, v[1], v[5], v[9], v[13]);  \
+    QUARTERROUND_V(add, xor, rot16, rot12, rot8, rot7, v[2], v[6], v[10], v[14]); \
+    QUARTERROUND_V(add, xor, rot16, rot12, rot8, rot7, v[3], v[7], v[11], v[15]); \
+    QUARTERROUND_V(add, xor, rot16, rot12, rot8, rot7, v[0], v[5], v[10], v[15]); \
+    QUARTERROUND_V(add, xor, rot16, rot12, rot8, rot7, v[1], v[6], v[11], v[12]); \
+    QUARTERROUND_V(add, xor, rot16, rot12, rot8, rot7, v[2], v[7], v[8], v[13]);  \
+    QUARTERROUND_V(add, xor, rot16, rot12, rot8, rot7, v[3], v[4], v[9], v[14])
+
+/* Block counters of W consecutive blocks starting at pos, low and high words */
+#define SET_COUNTERS(W, pos, lo, hi)                   \
+    for (int lane = 0; lane < (W); lane++) {           \
+        (lo)[lane] = (uint32_t)((pos) + lane);         \
+        (hi)[lane] = (uint32_t)(((pos) + lane) >> 32); \
+    }
+
+/* Writes the W blocks out, transposing from one register per word to one block per lane */
+#define STORE_BLOCKS(W, words, c)                                             \
+    for (int lane = 0; lane < (W); lane++) {                                  \
+        for (int i = 0; i < 16; i++) {                                        \
+            U32TO8_LITTLE((c) + lane * 64 + i * 4, (words)[i][lane]);         \
+        }                                                                     \
+    }
+
+#define add_sse2(a, b) _mm_add_epi32(a, b)
+#define xor_sse2(a, b) _mm_xor_si128(a, b)
+#define rotl_sse2(v, n) _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+#define rot16_sse2(v) rotl_sse2(v, 16)
+#define rot12_sse2(v) rotl_sse2(v, 12)
+#define rot8_sse2(v) rotl_sse2(v, 8)
+#define rot7_sse2(v) rotl_sse2(v, 7)
+
+/* SSE2 is part of x86-64, so this kernel needs no CPU check */
+static void chacha8_blocks_sse2(const struct chacha8_ctx *x, uint64_t pos, uint8_t *c)
+{
+    __m128i v[16], j[16];
+    uint32_t lo[4], hi[4];
+    uint32_t words[16][4];
+    int i;
+
+    SET_COUNTERS(4, pos, lo, hi);
+    for (i = 0; i < 16; i++) {
+        j[i] = _mm_set1_epi32((int)x->input[i]);
+    }
+    j[12] = _mm_loadu_si128((const __m128i *)lo);
+    j[13] = _mm_loadu_si128((const __m128i *)hi);
+    for (i = 0; i < 16; i++) {
+        v[i] = j[i];
+    }
+    for (i = 8; i > 0; i -= 2) {
+        DOUBLEROUND_V(add_sse2, xor_sse2, rot16_sse2, rot12_sse2, rot8_sse2, rot7_sse2, v);
+    }
+    for (i = 0; i < 16; i++) {
+        _mm_storeu_si128((__m128i *)words[i], add_sse2(v[i], j[i]));
+    }
+    STORE_BLOCKS(4, words, c);
+}
+
+#define add_avx2(a, b) _mm256_add_epi32(a, b)
+#define xor_avx2(a, b) _mm256_xor_si256(a, b)
+#define rotl_avx2(v, n) _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n)))
+/* Rotations by whole bytes are a single byte shuffle */
+#define rot16_avx2(v)                  \
+    _mm256_shuffle_epi8(               \
+        v,                             \
+        _mm256_set_epi8(               \
+            13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2, \
+            13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2))
+#define rot8_avx2(v)                   \
+    _mm256_shuffle_epi8(               \
+        v,                             \
+        _mm256_set_epi8(               \
+            14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3, \
+            14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3))
+#define rot12_avx2(v) rotl_avx2(v, 12)
+#define rot7_avx2(v) rotl_avx2(v, 7)
+
+TARGET_AVX2
+static void chacha8_blocks_avx2(const struct chacha8_ctx *x, uint64_t pos, uint8_t *c)
+{
+    __m256i v[16], j[16];
+    uint32_t lo[8], hi[8];
+    uint32_t words[16][8];
+    int i;
+
+    SET_COUNTERS(8, pos, lo, hi);
+    for (i = 0; i < 16; i++) {
+        j[i] = _mm256_set1_epi32((int)x->input[i]);
+    }
+    j[12] = _mm256_loadu_si256((const __m256i *)lo);
+    j[13] = _mm256_loadu_si256((const __m256i *)hi);
+    for (i = 0; i < 16; i++) {
+        v[i] = j[i];
+    }
+    for (i = 8; i > 0; i -= 2) {
+        DOUBLEROUND_V(add_avx2, xor_avx2, rot16_avx2, rot12_avx2, rot8_avx2, rot7_avx2, v);
+    }
+    for (i = 0; i < 16; i++) {
+        _mm256_storeu_si256((__m256i *)words[i], add_avx2(v[i], j[i]));
+    }
+    STORE_BLOCKS(8, words, c);
+}
+
+#define add_avx512(a, b) _mm512_add_epi32(a, b)
+#define xor_avx512(a, b) _mm512_xor_si512(a, b)
+#define rot16_avx512(v) _mm512_rol_epi32(v, 16)
+#define rot12_avx512(v) _mm512_rol_epi32(v, 12)
+#define rot8_avx512(v) _mm512_rol_epi32(v, 8)
+#define rot7_avx512(v) _mm512_rol_epi32(v, 7)
+
+TARGET_AVX512
+static void chacha8_blocks_avx512(const struct chacha8_ctx *x, uint64_t pos, uint8_t *c)
+{
+    __m512i v[16], j[16];
+    uint32_t lo[16], hi[16];
+    uint32_t words[16][16];
+    int i;
+
+    SET_COUNTERS(16, pos, lo, hi);
+    for (i = 0; i < 16; i++) {
+        j[i] = _mm512_set1_epi32((int)x->input[i]);
+    }
+    j[12] = _mm512_loadu_si512((const void *)lo);
+    j[13] = _mm512_loadu_si512((const void *)hi);
+    for (i = 0; i < 16; i++) {
+        v[i] = j[i];
+    }
+    for (i = 8; i > 0; i -= 2) {
+        DOUBLEROUND_V(
+            add_avx512, xor_avx512, rot16_avx512, rot12_avx512, rot8_avx512, rot7_avx512, v);
+    }
+    for (i = 0; i < 16; i++) {
+        _mm512_storeu_si512((void *)words[i], add_avx512(v[i], j[i]));
+    }
+    STORE_BLOCKS(16, words, c);
+}
+
+static void chacha8_cpuid(uint32_t regs[4], uint32_t leaf)
+{
+#if defined(_MSC_VER)
+    __cpuidex((int *)regs, (int)leaf, 0);
+#else
+    __cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static uint64_t chacha8_xgetbv(void)
+{
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    uint32_t eax, edx;
+    __asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((uint64_t)edx << 32) | eax;
+#endif
+}
+
+/* Number of blocks the widest usable kernel computes at once, detected on first use */
+static uint32_t g_simd_degree = 0;
+
+static uint32_t chacha8_simd_degree(void)
+{
+    uint32_t regs[4];
+    uint32_t max_leaf;
+    uint32_t degree = 4;
+
+    if (g_simd_degree) {
+        return g_simd_degree;
+    }
+    chacha8_cpuid(regs, 0);
+    max_leaf = regs[0];
+    chacha8_cpuid(regs, 1);
+    /* OSXSAVE: the OS reports in XCR0 which register states it saves */
+    if (max_leaf >= 7 && (regs[2] & (1UL << 27))) {
+        uint64_t xcr0 = chacha8_xgetbv();
+        chacha8_cpuid(regs, 7);
+        if ((xcr0 & 0x6) == 0x6 && (regs[1] & (1UL << 5))) {
+            degree = 8;
+        }
+        if ((xcr0 & 0xe6) == 0xe6 && (regs[1] & (1UL << 16))) {
+            degree = 16;
+        }
+    }
+    g_simd_degree = degree;
+    return degree;
+}
+
+#endif /* defined(__x86_64__) || defined(_M_X64) */
+
+void chacha8_get_keystream(const struct chacha8_ctx *x, uint64_t pos, uint32_t n_blocks, uint8_t *c)
+{
+#if defined(__x86_64__) || defined(_M_X64)
+    uint32_t const degree = chacha8_simd_degree();
+
+    if (degree >= 16) {
+        for (; n_blocks >= 16; n_blocks -= 16, pos += 16, c += 16 * 64) {
+            chacha8_blocks_avx512(x, pos, c);
+        }
+    }
+    if (degree >= 8) {
+        for (; n_blocks >= 8; n_blocks -= 8, pos += 8, c += 8 * 64) {
+            chacha8_blocks_avx2(x, pos, c);
+        }
+    }
+    for (; n_blocks >= 4; n_blocks -= 4, pos += 4, c += 4 * 64) {
+        chacha8_blocks_sse2(x, pos, c);
+    }
+#endif
+    chacha8_get_keystream_portable(x, pos, n_blocks, c);
+}
@@ -83,6 +83,14 @@ int main(int argc, char *argv[]) try {
     string id = "022fb42c08c12de3a6af053880199806532e79515f94e83461612101f9412f9e";
     bool nobitfield = false;
     bool show_progress = false;
+    bool ram_temp = false;
+    bool io_uring = false;
+    bool direct_io = false;
+    bool packed_temp = false;
+    bool mmap_plot = false;
+    bool resident_c1 = false;
+    bool resident_c3 = false;
+    uint32_t park_cache_megabytes = 0;
     uint32_t buffmegabytes = 0;
 
     options.allow_unrecognised_options().add_options()(
@@ -102,10 +110,37 @@ int main(int argc, char *argv[]) try {
         cxxopts::value<uint32_t>(buffmegabytes))(
         "p, progress", "Display progress percentage during plotting",
         cxxopts::value<bool>(show_progress))(
+        "ramtemp", "Keep temporary files in memory instead of the temp directories",
+        cxxopts::value<bool>(ram_temp))(
+        "iouring", "Use io_uring for disk I/O where the kernel supports it",
+        cxxopts::value<bool>(io_uring))(
+        "directio", "Bypass the page cache with O_DIRECT for disk I/O",
+        cxxopts::value<bool>(direct_io))(
+        "packedtemp", "Store temporary sort entries bit-packed, to write less temporary data",
+        cxxopts::value<bool>(packed_temp))(
+        "mmap", "Map the plot file into memory to look up proofs",
+        cxxopts::value<bool>(mmap_plot))(
+        "residentc1", "Keep the C1 table of the plot in memory to look up proofs",
+        cxxopts::value<bool>(resident_c1))(
+        "residentc3", "Keep the C3 table of the plot in memory to look up proofs",
+        cxxopts::value<bool>(resident_c3))(
+        "parkcache", "Megabytes of decoded parks to keep in memory to look up proofs",
+        cxxopts::value<uint32_t>(park_cache_megabytes))(
         "help", "Print help");
 
     auto result = options.parse(argc, argv);
 
+    uint8_t prover_flags = 0;
+    if (mmap_plot) {
+        prover_flags = prover_flags | MMAP_PLOT;
+    }
+    if (resident_c1) {
+        prover_flags = prover_flags | RESIDENT_C1;
+    }
+    if (resident_c3) {
+        prover_flags = prover_flags | RESIDENT_C3;
+    }
+
     if (result.count("help") || argc < 2) {
         HelpAndQuit(options);
     }
@@ -142,6 +177,18 @@ int main(int argc, char *argv[]) try {
         if (show_progress) {
             phases_flags = phases_flags | SHOW_PROGRESS;
         }
+        if (ram_temp) {
+            phases_flags = phases_flags | TEMP_FILES_IN_MEMORY;
+        }
+        if (io_uring) {
+            phases_flags = phases_flags | USE_IO_URING;
+        }
+        if (direct_io) {
+            phases_flags = phases_flags | DIRECT_IO;
+        }
+        if (packed_temp) {
+            phases_flags = phases_flags | PACKED_TEMP_FILES;
+        }
         plotter.CreatePlotDisk(
                 tempdir,
                 tempdir2,
@@ -171,7 +218,7 @@ int main(int argc, char *argv[]) try {
         uint8_t challenge_bytes[32];
         HexToBytes(challenge, challenge_bytes);
 
-        DiskProver prover(filename);
+        DiskProver prover(filename, prover_flags, (uint64_t)park_cache_megabytes << 20);
         try {
             vector<LargeBits> qualities = prover.GetQualitiesForChallenge(challenge_bytes);
             for (uint32_t i = 0; i < qualities.size(); i++) {
@@ -240,7 +287,7 @@ int main(int argc, char *argv[]) try {
             iterations = std::stoi(argv[2]);
         }
 
-        DiskProver prover(filename);
+        DiskProver prover(filename, prover_flags, (uint64_t)park_cache_megabytes << 20);
         Verifier verifier = Verifier();
 
         uint32_t success = 0;
@@ -283,6 +330,10 @@ int main(int argc, char *argv[]) try {
         }
         std::cout << "Total success: " << success << "/" << iterations << ", "
                   << (success * 100 / static_cast<double>(iterations)) << "%." << std::endl;
+        if (park_cache_megabytes > 0) {
+            std::cout << "Park cache hits: " << prover.GetParkCacheHits()
+                      << ", misses: " << prover.GetParkCacheMisses() << std::endl;
+        }
         if (show_progress) { progress(4, 1, 1); }
     } else {
         cout << "Invalid operation. Use create/prove/verify/check" << endl;
@@ -16,9 +16,16 @@
 #define SRC_CPP_DISK_HPP_
 
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include <thread>
 #include <chrono>
@@ -33,8 +40,21 @@ using namespace std::chrono_literals; // for operator""min;
 
 #include "./bits.hpp"
 #include "./util.hpp"
+#include "./uring.hpp"
 #include "bitfield.hpp"
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(O_DIRECT)
+#define CHIAPOS_HAVE_DIRECT_IO 1
+#else
+#define CHIAPOS_HAVE_DIRECT_IO 0
+#endif
+
 constexpr uint64_t write_cache = 1024 * 1024;
 constexpr uint64_t read_ahead = 1024 * 1024;
 
@@ -98,16 +118,44 @@ void disk_log(fs::path const& filename, op_t const op, uint64_t offset, uint64_t
 #endif
 
 struct FileDisk {
-    explicit FileDisk(const fs::path &filename)
+    // An in_memory FileDisk keeps its contents in RAM instead of in the file. The filename is
+    // then only used to identify it.
+    explicit FileDisk(const fs::path &filename, bool in_memory = false)
     {
         filename_ = filename;
+        in_memory_ = in_memory;
+        if (!in_memory_ && IoUringEnabled()) {
+            uring_ = IoUring::Get();
+        }
+        direct_ = !in_memory_ && DirectIoEnabled();
         Open(writeFlag);
     }
 
+    // Selects io_uring instead of stdio for the FileDisks created afterwards. If the kernel
+    // doesn't support io_uring, they use stdio anyway. Returns whether io_uring is used.
+    static bool UseIoUring(bool enable)
+    {
+        IoUringEnabled() = enable && IoUring::Get() != nullptr;
+        return IoUringEnabled();
+    }
+
+    // Selects O_DIRECT for the FileDisks created afterwards, so that their reads and writes
+    // bypass the page cache. Returns whether O_DIRECT is supported.
+    static bool UseDirectIo(bool enable)
+    {
+        DirectIoEnabled() = enable && CHIAPOS_HAVE_DIRECT_IO;
+        return DirectIoEnabled();
+    }
+
     void Open(uint8_t flags = 0, size_t buf_size = (1<<22)) // 4MB buffer
     {
         // if the file is already open, don't do anything
-        if (f_) return;
+        if (f_ || fd_ >= 0 || in_memory_) return;
+
+        if (uring_ || direct_) {
+            OpenFileDescriptor(flags);
+            return;
+        }
 
         // Opens the file for reading and writing
         do {
@@ -146,6 +194,18 @@ struct FileDisk {
         filename_ = std::move(fd.filename_);
         f_ = fd.f_;
         fd.f_ = nullptr;
+        fd_ = fd.fd_;
+        fd.fd_ = -1;
+        uring_ = fd.uring_;
+        direct_ = fd.direct_;
+        direct_size_ = fd.direct_size_;
+        tail_block_offset_ = fd.tail_block_offset_;
+        tail_block_ = std::move(fd.tail_block_);
+        tail_block_dirty_ = fd.tail_block_dirty_;
+        fd.tail_block_dirty_ = false;
+        in_memory_ = fd.in_memory_;
+        memory_blocks_ = std::move(fd.memory_blocks_);
+        writeMax = fd.writeMax;
     }
 
     FileDisk(const FileDisk &) = delete;
@@ -153,6 +213,25 @@ struct FileDisk {
 
     void Close()
     {
+#ifndef _WIN32
+        if (fd_ >= 0) {
+            FlushTailBlock();
+            if (uring_) {
+                uring_->Drain(fd_);
+            }
+            // Writes of whole blocks may have left padding behind the end
+            struct stat st;
+            if (direct_ && ::fstat(fd_, &st) == 0 && uint64_t(st.st_size) > direct_size_) {
+                if (::ftruncate(fd_, direct_size_) != 0) {
+                    std::cout << "Could not truncate " << filename_ << ": " << ::strerror(errno)
+                              << std::endl;
+                }
+            }
+            ::close(fd_);
+            fd_ = -1;
+            return;
+        }
+#endif
         if (f_ == nullptr) return;
         ::fclose(f_);
         f_ = nullptr;
@@ -162,9 +241,44 @@ struct FileDisk {
 
     ~FileDisk() { Close(); }
 
+    // Closes and deletes the file, or frees the memory of an in_memory FileDisk
+    void Remove()
+    {
+        Close();
+        if (in_memory_) {
+            memory_blocks_.clear();
+            writeMax = 0;
+        } else {
+            fs::remove(filename_);
+        }
+    }
+
+    bool InMemory() const noexcept { return in_memory_; }
+
     void Read(uint64_t begin, uint8_t *memcache, uint64_t length)
     {
+        if (in_memory_) {
+            if (begin + length > writeMax) {
+                throw InvalidValueException(
+                    "Read of " + std::to_string(length) + " bytes at offset " +
+                    std::to_string(begin) + " past the end of " + filename_.string());
+            }
+            ReadMemory(begin, memcache, length);
+            return;
+        }
         Open(retryOpenFlag);
+        if (direct_) {
+            ReadDirect(begin, memcache, length);
+            return;
+        }
+        if (uring_) {
+            if (uring_->Read(fd_, begin, memcache, length) != length) {
+                throw InvalidValueException(
+                    "Read of " + std::to_string(length) + " bytes at offset " +
+                    std::to_string(begin) + " past the end of " + filename_.string());
+            }
+            return;
+        }
 #if ENABLE_LOGGING
         disk_log(filename_, op_t::read, begin, length);
 #endif
@@ -199,10 +313,25 @@ struct FileDisk {
 
     void Write(uint64_t begin, const uint8_t *memcache, uint64_t length)
     {
+        if (in_memory_) {
+            WriteMemory(begin, memcache, length);
+            writeMax = std::max(writeMax, begin + length);
+            return;
+        }
         Open(writeFlag | retryOpenFlag);
 #if ENABLE_LOGGING
         disk_log(filename_, op_t::write, begin, length);
 #endif
+        if (direct_) {
+            WriteDirect(begin, memcache, length);
+            writeMax = std::max(writeMax, begin + length);
+            return;
+        }
+        if (uring_) {
+            uring_->Write(fd_, begin, memcache, length);
+            writeMax = std::max(writeMax, begin + length);
+            return;
+        }
         // Seek and write from memcache
         uint64_t amtwritten;
         do {
@@ -252,11 +381,298 @@ struct FileDisk {
     void Truncate(uint64_t new_size)
     {
         Close();
+        if (in_memory_) {
+            TruncateMemory(new_size);
+            return;
+        }
         fs::resize_file(filename_, new_size);
+        direct_size_ = new_size;
+        tail_block_offset_ = UINT64_MAX;
     }
 
 private:
 
+    static bool& IoUringEnabled()
+    {
+        static bool enabled = false;
+        return enabled;
+    }
+
+    static bool& DirectIoEnabled()
+    {
+        static bool enabled = false;
+        return enabled;
+    }
+
+    // Opens fd_ the way Open() opens f_, for the io_uring and O_DIRECT modes
+    void OpenFileDescriptor(uint8_t flags)
+    {
+#ifndef _WIN32
+        while (true) {
+            int const open_flags = (flags & writeFlag) ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR;
+#if CHIAPOS_HAVE_DIRECT_IO
+            if (direct_) {
+                fd_ = ::open(filename_.c_str(), open_flags | O_DIRECT, 0644);
+                if (fd_ < 0 && errno == EINVAL) {
+                    // The file system doesn't support O_DIRECT. The reads and writes stay
+                    // aligned, but go through the page cache.
+                    fd_ = ::open(filename_.c_str(), open_flags, 0644);
+                }
+            } else
+#endif
+            {
+                fd_ = ::open(filename_.c_str(), open_flags, 0644);
+            }
+            if (fd_ >= 0) {
+                struct stat st;
+                direct_size_ = ::fstat(fd_, &st) == 0 ? st.st_size : 0;
+                tail_block_offset_ = UINT64_MAX;
+                return;
+            }
+            std::string error_message =
+                "Could not open " + filename_.string() + ": " + ::strerror(errno) + ".";
+            if (!(flags & retryOpenFlag)) {
+                throw InvalidValueException(error_message);
+            }
+            std::cout << error_message << " Retrying in five minutes." << std::endl;
+            std::this_thread::sleep_for(5min);
+        }
+#endif
+    }
+
+    // Buffer for the O_DIRECT reads and writes that aren't aligned. Each thread has its own.
+    static uint8_t* BounceBuffer()
+    {
+        thread_local Util::AlignedBuffer buffer = Util::AllocateAligned(kBounceBufferSize);
+        return buffer.get();
+    }
+
+    static bool IsAligned(uint64_t value) { return value % Util::kIoAlignment == 0; }
+
+    static bool IsAligned(const void* p) { return IsAligned(reinterpret_cast<uintptr_t>(p)); }
+
+    static uint64_t AlignDown(uint64_t value) { return value - value % Util::kIoAlignment; }
+
+    static uint64_t AlignUp(uint64_t value) { return AlignDown(value + Util::kIoAlignment - 1); }
+
+    // Writes whole blocks. Data, begin and length are aligned.
+    void WriteBlocks(uint64_t begin, const uint8_t *data, uint64_t length)
+    {
+#ifndef _WIN32
+        if (uring_) {
+            uring_->Write(fd_, begin, data, length);
+            return;
+        }
+        while (length > 0) {
+            ssize_t const written = ::pwrite(fd_, data, length, begin);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                throw InvalidValueException(
+                    "Could not write " + std::to_string(length) + " bytes at offset " +
+                    std::to_string(begin) + " to " + filename_.string() + ": " +
+                    ::strerror(errno));
+            }
+            begin += written;
+            data += written;
+            length -= written;
+        }
+#endif
+    }
+
+    // Reads whole blocks, and fills the part behind the end of the file with zeros. Data, begin
+    // and length are aligned.
+    void ReadBlocks(uint64_t begin, uint8_t *data, uint64_t length)
+    {
+#ifndef _WIN32
+        uint64_t read = 0;
+        if (uring_) {
+            read = uring_->Read(fd_, begin, data, length);
+        } else {
+            while (read < length) {
+                ssize_t const ret = ::pread(fd_, data + read, length - read, begin + read);
+                if (ret < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (ret < 0) {
+                    throw InvalidValueException(
+                        "Could not read " + std::to_string(length) + " bytes at offset " +
+                        std::to_string(begin) + " from " + filename_.string() + ": " +
+                        ::strerror(errno));
+                }
+                if (ret == 0) {
+                    break;
+                }
+                read += ret;
+            }
+        }
+        ::memset(data + read, 0, length - read);
+#endif
+    }
+
+    // Fills dst with the block at offset, as it is in the file
+    void LoadBlock(uint64_t offset, uint8_t *dst)
+    {
+        if (offset == tail_block_offset_) {
+            ::memcpy(dst, tail_block_.get(), Util::kIoAlignment);
+        } else if (offset >= direct_size_) {
+            ::memset(dst, 0, Util::kIoAlignment);
+        } else {
+            ReadBlocks(offset, dst, Util::kIoAlignment);
+        }
+    }
+
+    void FlushTailBlock()
+    {
+        if (!tail_block_dirty_) return;
+        tail_block_dirty_ = false;
+        WriteBlocks(tail_block_offset_, tail_block_.get(), Util::kIoAlignment);
+    }
+
+    // O_DIRECT only reads and writes whole, aligned blocks. The blocks at the edges of a write
+    // are read first. The last, partial block of a write is kept in memory instead, and is only
+    // written once the next write doesn't continue it, since the writes are mostly sequential.
+    void WriteDirect(uint64_t begin, const uint8_t *data, uint64_t length)
+    {
+        while (length > 0) {
+            if (IsAligned(begin) && IsAligned(data) && length >= Util::kIoAlignment) {
+                uint64_t const amount = AlignDown(length);
+                if (tail_block_offset_ >= begin && tail_block_offset_ < begin + amount) {
+                    // Overwritten as a whole
+                    tail_block_offset_ = UINT64_MAX;
+                    tail_block_dirty_ = false;
+                }
+                WriteBlocks(begin, data, amount);
+                direct_size_ = std::max(direct_size_, begin + amount);
+                begin += amount;
+                data += amount;
+                length -= amount;
+                continue;
+            }
+            uint8_t *const bounce = BounceBuffer();
+            uint64_t const block_begin = AlignDown(begin);
+            uint64_t const head = begin - block_begin;
+            uint64_t const amount = std::min(length, kBounceBufferSize - head);
+            uint64_t const block_end = AlignUp(begin + amount);
+            uint64_t const last_block = block_end - Util::kIoAlignment;
+            if (tail_block_offset_ < block_begin || tail_block_offset_ >= block_end) {
+                FlushTailBlock();
+            }
+
+            if (head != 0) {
+                LoadBlock(block_begin, bounce);
+            }
+            if (!IsAligned(begin + amount) && (head == 0 || last_block != block_begin)) {
+                LoadBlock(last_block, bounce + (last_block - block_begin));
+            }
+            ::memcpy(bounce + head, data, amount);
+
+            if (!tail_block_) {
+                tail_block_ = Util::AllocateAligned(Util::kIoAlignment);
+            }
+            ::memcpy(tail_block_.get(), bounce + (last_block - block_begin), Util::kIoAlignment);
+            tail_block_offset_ = last_block;
+            tail_block_dirty_ = !IsAligned(begin + amount);
+            uint64_t const write_end = tail_block_dirty_ ? last_block : block_end;
+            if (write_end > block_begin) {
+                WriteBlocks(block_begin, bounce, write_end - block_begin);
+            }
+            direct_size_ = std::max(direct_size_, begin + amount);
+
+            begin += amount;
+            data += amount;
+            length -= amount;
+        }
+    }
+
+    void ReadDirect(uint64_t begin, uint8_t *data, uint64_t length)
+    {
+        if (begin + length > direct_size_) {
+            throw InvalidValueException(
+                "Read of " + std::to_string(length) + " bytes at offset " + std::to_string(begin) +
+                " past the end of " + filename_.string());
+        }
+        FlushTailBlock();
+        while (length > 0) {
+            if (IsAligned(begin) && IsAligned(data) && length >= Util::kIoAlignment) {
+                // Straight into the caller's buffer
+                uint64_t const amount = AlignDown(length);
+                ReadBlocks(begin, data, amount);
+                begin += amount;
+                data += amount;
+                length -= amount;
+                continue;
+            }
+            uint8_t *const bounce = BounceBuffer();
+            uint64_t const block_begin = AlignDown(begin);
+            uint64_t const head = begin - block_begin;
+            uint64_t const amount = std::min(length, kBounceBufferSize - head);
+            ReadBlocks(block_begin, bounce, AlignUp(begin + amount) - block_begin);
+            ::memcpy(data, bounce + head, amount);
+            begin += amount;
+            data += amount;
+            length -= amount;
+        }
+    }
+
+    static const uint64_t kBounceBufferSize = 4 << 20;
+
+    // In memory, the contents are stored in blocks of this size, which are allocated as they
+    // are written to. Parts that were never written read as zeros, like a sparse file.
+    static const uint64_t kMemoryBlockSize = 1 << 22;
+
+    void ReadMemory(uint64_t begin, uint8_t *memcache, uint64_t length) const
+    {
+        while (length > 0) {
+            uint64_t const block = begin / kMemoryBlockSize;
+            uint64_t const offset = begin % kMemoryBlockSize;
+            uint64_t const amount = std::min(length, kMemoryBlockSize - offset);
+            if (block < memory_blocks_.size() && memory_blocks_[block]) {
+                ::memcpy(memcache, memory_blocks_[block].get() + offset, amount);
+            } else {
+                ::memset(memcache, 0, amount);
+            }
+            begin += amount;
+            memcache += amount;
+            length -= amount;
+        }
+    }
+
+    void WriteMemory(uint64_t begin, const uint8_t *memcache, uint64_t length)
+    {
+        while (length > 0) {
+            uint64_t const block = begin / kMemoryBlockSize;
+            uint64_t const offset = begin % kMemoryBlockSize;
+            uint64_t const amount = std::min(length, kMemoryBlockSize - offset);
+            if (block >= memory_blocks_.size()) {
+                memory_blocks_.resize(block + 1);
+            }
+            if (!memory_blocks_[block]) {
+                memory_blocks_[block].reset(new uint8_t[kMemoryBlockSize]());
+            }
+            ::memcpy(memory_blocks_[block].get() + offset, memcache, amount);
+            begin += amount;
+            memcache += amount;
+            length -= amount;
+        }
+    }
+
+    void TruncateMemory(uint64_t new_size)
+    {
+        uint64_t const num_blocks = (new_size + kMemoryBlockSize - 1) / kMemoryBlockSize;
+        if (memory_blocks_.size() > num_blocks) {
+            memory_blocks_.resize(num_blocks);
+            memory_blocks_.shrink_to_fit();
+        }
+        // Growing the file again has to expose zeros, as with a file
+        uint64_t const offset = new_size % kMemoryBlockSize;
+        if (offset != 0 && num_blocks <= memory_blocks_.size() && memory_blocks_[num_blocks - 1]) {
+            ::memset(memory_blocks_[num_blocks - 1].get() + offset, 0, kMemoryBlockSize - offset);
+        }
+        writeMax = new_size;
+    }
+
     uint64_t readPos = 0;
     uint64_t writePos = 0;
     uint64_t writeMax = 0;
@@ -264,14 +680,209 @@ private:
 
     fs::path filename_;
     FILE *f_ = nullptr;
+    // The file descriptor and the ring of the io_uring backend
+    int fd_ = -1;
+    IoUring* uring_ = nullptr;
+
+    // O_DIRECT mode. The file may be longer than direct_size_ by the padding of its last block
+    // while it's open.
+    bool direct_ = false;
+    uint64_t direct_size_ = 0;
+    // The last block of the latest unaligned write, and where it is in the file. If it's dirty,
+    // it's yet to be written.
+    uint64_t tail_block_offset_ = UINT64_MAX;
+    Util::AlignedBuffer tail_block_;
+    bool tail_block_dirty_ = false;
+
+    bool in_memory_ = false;
+    std::vector<std::unique_ptr<uint8_t[]>> memory_blocks_;
 
     static const uint8_t writeFlag = 0b01;
     static const uint8_t retryOpenFlag = 0b10;
 };
 
+// Writes buffers of write_cache bytes to FileDisks on background I/O threads, so that the
+// threads producing the data can go on while the disk catches up. Buffers come from a pool of
+// num_buffers buffers. When all of them are queued for writing, AcquireBuffer() blocks until
+// one is written, which keeps the memory bounded if the disk can't keep up.
+//
+// All writes to one FileDisk go through the same I/O thread, in the order they are submitted.
+// The FileDisk must not be used otherwise until Wait() returns for it.
+class WriteBehind {
+public:
+    struct Stats {
+        uint64_t bytes_submitted = 0;
+        uint64_t bytes_written = 0;
+        uint64_t writes = 0;
+        // Time producers spent waiting for a free buffer
+        double stall_seconds = 0;
+    };
+
+    WriteBehind(uint32_t const num_threads, uint32_t const num_buffers)
+        : available_buffers_(std::max<uint32_t>(num_buffers, 1))
+        , queues_(std::max<uint32_t>(num_threads, 1))
+    {
+        for (uint32_t i = 0; i < queues_.size(); i++) {
+            threads_.emplace_back(&WriteBehind::IoThread, this, i);
+        }
+    }
+
+    WriteBehind(const WriteBehind&) = delete;
+    WriteBehind& operator=(const WriteBehind&) = delete;
+
+    ~WriteBehind()
+    {
+        {
+            std::lock_guard<std::mutex> l(mutex_);
+            stop_ = true;
+        }
+        work_.notify_all();
+        for (auto& t : threads_) {
+            t.join();
+        }
+    }
+
+    // Returns an empty buffer of write_cache bytes, waiting for one to be written if the pool
+    // is used up
+    Util::AlignedBuffer AcquireBuffer()
+    {
+        std::unique_lock<std::mutex> l(mutex_);
+        if (available_buffers_ == 0) {
+            auto const start = std::chrono::steady_clock::now();
+            done_.wait(l, [&] { return available_buffers_ > 0 || error_; });
+            stats_.stall_seconds +=
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+        RethrowError();
+        available_buffers_--;
+        if (free_buffers_.empty()) {
+            return Util::AllocateAligned(write_cache);
+        }
+        Util::AlignedBuffer buffer = std::move(free_buffers_.back());
+        free_buffers_.pop_back();
+        return buffer;
+    }
+
+    // Queues length bytes of buffer to be written to disk at begin. The buffer goes back to
+    // the pool once it is written. It must be write_cache bytes large.
+    void Submit(FileDisk* disk, uint64_t begin, Util::AlignedBuffer buffer, uint64_t length)
+    {
+        {
+            std::lock_guard<std::mutex> l(mutex_);
+            RethrowError();
+            pending_[disk]++;
+            stats_.bytes_submitted += length;
+            queues_[QueueIndex(disk)].push_back(Job{disk, begin, std::move(buffer), length});
+        }
+        work_.notify_all();
+    }
+
+    // Waits until all writes to disk are done
+    void Wait(const FileDisk* disk)
+    {
+        std::unique_lock<std::mutex> l(mutex_);
+        done_.wait(l, [&] { return pending_.count(disk) == 0 || error_; });
+        RethrowError();
+    }
+
+    // Waits until all submitted writes are done
+    void Wait()
+    {
+        std::unique_lock<std::mutex> l(mutex_);
+        done_.wait(l, [&] { return pending_.empty() || error_; });
+        RethrowError();
+    }
+
+    Stats GetStats() const
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        return stats_;
+    }
+
+private:
+    struct Job {
+        FileDisk* disk;
+        uint64_t begin;
+        Util::AlignedBuffer buffer;
+        uint64_t length;
+    };
+
+    uint64_t QueueIndex(const FileDisk* disk) const
+    {
+        return std::hash<const FileDisk*>()(disk) % queues_.size();
+    }
+
+    void IoThread(uint32_t const queue_index)
+    {
+        std::deque<Job>& queue = queues_[queue_index];
+        std::unique_lock<std::mutex> l(mutex_);
+        while (true) {
+            work_.wait(l, [&] { return stop_ || !queue.empty(); });
+            if (queue.empty()) {
+                return;
+            }
+            Job job = std::move(queue.front());
+            queue.pop_front();
+
+            l.unlock();
+            std::exception_ptr error;
+            try {
+                job.disk->Write(job.begin, job.buffer.get(), job.length);
+            } catch (...) {
+                error = std::current_exception();
+            }
+            l.lock();
+
+            if (error && !error_) {
+                error_ = error;
+            }
+            if (!error) {
+                stats_.bytes_written += job.length;
+                stats_.writes++;
+            }
+            if (--pending_[job.disk] == 0) {
+                pending_.erase(job.disk);
+            }
+            free_buffers_.push_back(std::move(job.buffer));
+            available_buffers_++;
+            done_.notify_all();
+        }
+    }
+
+    // Errors of the I/O threads are reported to the producers. Must hold mutex_.
+    void RethrowError() const
+    {
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+    }
+
+    mutable std::mutex mutex_;
+    // Signals the I/O threads that there is a job, or that they should stop
+    std::condition_variable work_;
+    // Signals that a write finished
+    std::condition_variable done_;
+    bool stop_ = false;
+    std::exception_ptr error_;
+
+    // Buffers that may still be handed out, including ones that are yet to be allocated
+    uint32_t available_buffers_;
+    std::vector<Util::AlignedBuffer> free_buffers_;
+    // Number of queued or running writes for each disk
+    std::unordered_map<const FileDisk*, uint64_t> pending_;
+    std::vector<std::deque<Job>> queues_;
+    std::vector<std::thread> threads_;
+    Stats stats_;
+};
+
 struct BufferedDisk : Disk
 {
-    BufferedDisk(FileDisk* disk, uint64_t file_size) : disk_(disk), file_size_(file_size) {}
+    // If write_behind is set, full write buffers are handed to it instead of being written on
+    // the calling thread
+    BufferedDisk(FileDisk* disk, uint64_t file_size, WriteBehind* write_behind = nullptr)
+        : disk_(disk), file_size_(file_size), write_behind_(write_behind)
+    {
+    }
 
     uint8_t const* Read(uint64_t begin, uint64_t length) override
     {
@@ -297,6 +908,7 @@ struct BufferedDisk : Disk
             // discarded the first entry and start at some low offset but still
             // greater than 0
             read_buffer_start_ = begin;
+            WaitForWrites();
             uint64_t const amount_to_read = std::min(file_size_ - read_buffer_start_, read_ahead);
             disk_->Read(begin, read_buffer_.get(), amount_to_read);
             read_buffer_size_ = amount_to_read;
@@ -318,6 +930,7 @@ struct BufferedDisk : Disk
 
             // if we're going backwards, don't wipe out the cache. We assume
             // forward sequential access
+            WaitForWrites();
             disk_->Read(begin, temp, length);
             return temp;
         }
@@ -342,12 +955,14 @@ struct BufferedDisk : Disk
             return;
         }
 
+        WaitForWrites();
         disk_->Write(begin, memcache, length);
     }
 
     void Truncate(uint64_t const new_size) override
     {
         FlushCache();
+        WaitForWrites();
         disk_->Truncate(new_size);
         file_size_ = new_size;
         FreeMemory();
@@ -355,9 +970,11 @@ struct BufferedDisk : Disk
 
     std::string GetFileName() override { return disk_->GetFileName(); }
 
+    // Afterwards, no writes to the underlying disk are pending anymore
     void FreeMemory() override
     {
         FlushCache();
+        WaitForWrites();
 
         read_buffer_.reset();
         write_buffer_.reset();
@@ -369,16 +986,29 @@ struct BufferedDisk : Disk
     {
         if (write_buffer_size_ == 0) return;
 
-        disk_->Write(write_buffer_start_, write_buffer_.get(), write_buffer_size_);
+        if (write_behind_) {
+            Util::AlignedBuffer full_buffer = write_behind_->AcquireBuffer();
+            std::swap(full_buffer, write_buffer_);
+            write_behind_->Submit(disk_, write_buffer_start_, std::move(full_buffer), write_buffer_size_);
+        } else {
+            disk_->Write(write_buffer_start_, write_buffer_.get(), write_buffer_size_);
+        }
         write_buffer_size_ = 0;
     }
 
 private:
 
+    void WaitForWrites()
+    {
+        if (write_behind_) {
+            write_behind_->Wait(disk_);
+        }
+    }
+
     void NeedReadCache()
     {
         if (read_buffer_) return;
-        read_buffer_.reset(new uint8_t[read_ahead]);
+        read_buffer_ = Util::AllocateAligned(read_ahead);
         read_buffer_start_ = -1;
         read_buffer_size_ = 0;
     }
@@ -386,7 +1016,7 @@ private:
     void NeedWriteCache()
     {
         if (write_buffer_) return;
-        write_buffer_.reset(new uint8_t[write_cache]);
+        write_buffer_ = Util::AllocateAligned(write_cache);
         write_buffer_start_ = -1;
         write_buffer_size_ = 0;
     }
@@ -397,14 +1027,16 @@ private:
 
     // the file offset the read buffer was read from
     uint64_t read_buffer_start_ = -1;
-    std::unique_ptr<uint8_t[]> read_buffer_;
+    Util::AlignedBuffer read_buffer_;
     uint64_t read_buffer_size_ = 0;
 
     // the file offset the write buffer should be written back to
     // the write buffer is *only* for contiguous and sequential writes
     uint64_t write_buffer_start_ = -1;
-    std::unique_ptr<uint8_t[]> write_buffer_;
+    Util::AlignedBuffer write_buffer_;
     uint64_t write_buffer_size_ = 0;
+
+    WriteBehind* write_behind_ = nullptr;
 };
 
 struct FilteredDisk : Disk
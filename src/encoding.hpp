@@ -178,9 +178,16 @@ public:
         return ans;
     }
 
-    static size_t ANSEncodeDeltas(std::vector<unsigned char> deltas, double R, uint8_t *out)
+    // May be called by multiple threads at the same time
+    static size_t ANSEncodeDeltas(const std::vector<unsigned char> &deltas, double R, uint8_t *out)
     {
+        static std::mutex create_mutex;
+        std::unique_lock<std::mutex> create_lock(create_mutex, std::defer_lock);
         if (!tmCache.CTExists(R)) {
+            // Only one thread builds the table for R, the others wait for it
+            create_lock.lock();
+        }
+        if (create_lock.owns_lock() && !tmCache.CTExists(R)) {
             std::vector<short> nCount = Encoding::CreateNormalizedCount(R);
             unsigned maxSymbolValue = nCount.size() - 1;
             unsigned tableLog = 14;
@@ -197,7 +204,7 @@ public:
 
         FSE_CTable *ct = tmCache.CTGet(R);
         return FSE_compress_usingCTable(
-            out, deltas.size() * 8, static_cast<void *>(deltas.data()), deltas.size(), ct);
+            out, deltas.size() * 8, static_cast<const void *>(deltas.data()), deltas.size(), ct);
     }
 
     static void ANSFree(double R)
@@ -205,13 +212,17 @@ public:
         // Cache all entries, only free on close
     }
 
-    static std::vector<uint8_t> ANSDecodeDeltas(
-        const uint8_t *inp,
-        size_t inp_size,
-        int numDeltas,
-        double R)
+    // Returns the decoding table for R, which lives until the end of the process. May be called
+    // by multiple threads at the same time.
+    static const FSE_DTable *ANSGetDTable(double R)
     {
+        static std::mutex create_mutex;
+        std::unique_lock<std::mutex> create_lock(create_mutex, std::defer_lock);
         if (!tmCache.DTExists(R)) {
+            // Only one thread builds the table for R, the others wait for it
+            create_lock.lock();
+        }
+        if (create_lock.owns_lock() && !tmCache.DTExists(R)) {
             std::vector<short> nCount = Encoding::CreateNormalizedCount(R);
             unsigned maxSymbolValue = nCount.size() - 1;
             unsigned tableLog = 14;
@@ -224,8 +235,25 @@ public:
             tmCache.DTAssign(R, dt);
         }
 
-        FSE_DTable *dt = tmCache.DTGet(R);
+        return tmCache.DTGet(R);
+    }
 
+    static std::vector<uint8_t> ANSDecodeDeltas(
+        const uint8_t *inp,
+        size_t inp_size,
+        int numDeltas,
+        double R)
+    {
+        return ANSDecodeDeltas(inp, inp_size, numDeltas, ANSGetDTable(R));
+    }
+
+    // Decodes with a table from ANSGetDTable()
+    static std::vector<uint8_t> ANSDecodeDeltas(
+        const uint8_t *inp,
+        size_t inp_size,
+        int numDeltas,
+        const FSE_DTable *dt)
+    {
         std::vector<uint8_t> deltas(numDeltas);
         size_t err = FSE_decompress_usingDTable(&deltas[0], numDeltas, inp, inp_size, dt);
 
@@ -0,0 +1,144 @@
+// Copyright 2018 Chia Network Inc
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//    http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SRC_CPP_PARK_CACHE_HPP_
+#define SRC_CPP_PARK_CACHE_HPP_
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "util.hpp"
+
+// A park of the plot, after decoding. Which of the members are filled in depends on the table
+// the park is from.
+struct DecodedPark {
+    // Tables 1 to 6: the line point at the beginning of the park
+    uint128_t line_point = 0;
+    // Tables 1 to 6: the stubs of the park. Table 7: the entries of the park. Both as stored, and
+    // followed by 7 bytes of padding, so they can be sliced with Util::SliceInt64FromBytes().
+    std::vector<uint8_t> bits;
+    // Tables 1 to 6: the deltas between the line points. C3: the deltas between the f7 values of
+    // a C1 checkpoint.
+    std::vector<uint8_t> deltas;
+
+    uint64_t Size() const { return sizeof(DecodedPark) + bits.size() + deltas.size(); }
+};
+
+// Keeps recently decoded parks, keyed by a table and the index of the park in it, up to a
+// number of bytes. Once full, the least recently used parks are dropped. The parks are spread
+// over shards with their own lock, so threads that look up different parks rarely wait for
+// each other.
+class ParkCache {
+public:
+    explicit ParkCache(uint64_t const capacity) : shard_capacity_(capacity / kShards) {}
+
+    ParkCache(ParkCache const&) = delete;
+    ParkCache& operator=(ParkCache const&) = delete;
+
+    // Returns the park, or nullptr if it isn't in the cache
+    std::shared_ptr<const DecodedPark> Get(uint8_t const table_index, uint64_t const park_index)
+    {
+        uint64_t const key = Key(table_index, park_index);
+        Shard& shard = GetShard(key);
+        {
+            std::lock_guard<std::mutex> l(shard.mutex);
+            auto it = shard.parks.find(key);
+            if (it != shard.parks.end()) {
+                // Moves the park to the front, as the most recently used one
+                shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+                hits_++;
+                return it->second->second;
+            }
+        }
+        misses_++;
+        return nullptr;
+    }
+
+    // Adds a park, dropping the least recently used ones to make room. Parks larger than a
+    // shard are not kept. If the park is already there, the one in the cache is kept.
+    void Put(
+        uint8_t const table_index,
+        uint64_t const park_index,
+        std::shared_ptr<const DecodedPark> park)
+    {
+        uint64_t const size = park->Size();
+        if (size > shard_capacity_) {
+            return;
+        }
+        uint64_t const key = Key(table_index, park_index);
+        Shard& shard = GetShard(key);
+        std::lock_guard<std::mutex> l(shard.mutex);
+        if (shard.parks.count(key) != 0) {
+            return;
+        }
+        while (shard.size + size > shard_capacity_) {
+            shard.size -= shard.lru.back().second->Size();
+            shard.parks.erase(shard.lru.back().first);
+            shard.lru.pop_back();
+        }
+        shard.lru.emplace_front(key, std::move(park));
+        shard.parks[key] = shard.lru.begin();
+        shard.size += size;
+    }
+
+    uint64_t GetHits() const noexcept { return hits_; }
+
+    uint64_t GetMisses() const noexcept { return misses_; }
+
+    // Bytes taken by the parks in the cache
+    uint64_t GetSize()
+    {
+        uint64_t size = 0;
+        for (Shard& shard : shards_) {
+            std::lock_guard<std::mutex> l(shard.mutex);
+            size += shard.size;
+        }
+        return size;
+    }
+
+private:
+    static const uint32_t kShards = 16;
+
+    struct Shard {
+        std::mutex mutex;
+        // Most recently used first
+        std::list<std::pair<uint64_t, std::shared_ptr<const DecodedPark>>> lru;
+        std::unordered_map<uint64_t, decltype(lru)::iterator> parks;
+        uint64_t size = 0;
+    };
+
+    static uint64_t Key(uint8_t const table_index, uint64_t const park_index)
+    {
+        return ((uint64_t)table_index << 56) | park_index;
+    }
+
+    // Parks next to each other, which are often used together, end up in different shards
+    Shard& GetShard(uint64_t const key)
+    {
+        return shards_[((key * 0x9E3779B97F4A7C15ULL) >> 32) % kShards];
+    }
+
+    Shard shards_[kShards];
+    uint64_t const shard_capacity_;
+    std::atomic<uint64_t> hits_{0};
+    std::atomic<uint64_t> misses_{0};
+};
+
+#endif  // SRC_CPP_PARK_CACHE_HPP_
@@ -16,7 +16,6 @@
 #define SRC_CPP_PHASE1_HPP_
 
 #ifndef _WIN32
-#include <semaphore.h>
 #include <unistd.h>
 #endif
 
@@ -34,6 +33,8 @@
 #include <vector>
 #include <thread>
 #include <memory>
+#include <chrono>
+#include <condition_variable>
 #include <mutex>
 
 #include "chia_filesystem.hpp"
@@ -43,14 +44,24 @@
 #include "exceptions.hpp"
 #include "pos_constants.hpp"
 #include "sort_manager.hpp"
-#include "threading.hpp"
 #include "util.hpp"
 #include "progress.hpp"
 
+class Phase1CommitQueue;
+
+// Time a phase 1 thread spent blocked on other threads, in seconds
+struct Phase1WaitTimes {
+    double stripe_order = 0;    // Waiting for the previous stripe to start
+    double bucket_switch = 0;   // Waiting for earlier stripes before moving to the next sort bucket
+    double stripe_buffers = 0;  // Waiting for an earlier stripe of the thread to be committed
+
+    double Total() const { return stripe_order + bucket_switch + stripe_buffers; }
+};
+
 struct THREADDATA {
     int index;
-    Sem::type* mine;
-    Sem::type* theirs;
+    Phase1CommitQueue* commit_queue;
+    Phase1WaitTimes wait_times;
     uint64_t right_entry_size_bytes;
     uint8_t k;
     uint8_t table_index;
@@ -59,7 +70,6 @@ struct THREADDATA {
     uint8_t pos_size;
     uint64_t prevtableentries;
     uint32_t compressed_entry_size_bytes;
-    std::vector<FileDisk>* ptmp_1_disks;
 };
 
 struct GlobalData {
@@ -77,25 +87,70 @@ struct GlobalData {
 
 GlobalData globals;
 
-PlotEntry GetLeftEntry(
+// A left table entry as read from disk, before it is placed into a bucket.
+struct Phase1Entry {
+    uint64_t y;
+    uint64_t read_posoffset;  // The combined pos and offset that this entry points to
+    FxMetadata metadata;
+};
+
+// Entries of one y bucket of the left table, stored as parallel arrays. The arrays are only
+// cleared, never shrunk, so once they have grown to the largest bucket size the match loop
+// does not allocate.
+struct Phase1Bucket {
+    std::vector<uint64_t> y;
+    std::vector<uint64_t> pos;
+    std::vector<uint64_t> read_posoffset;
+    std::vector<FxMetadata> metadata;
+    std::vector<uint8_t> used;  // Whether the entry was used in the next table of matches
+
+    size_t size() const { return y.size(); }
+    bool empty() const { return y.empty(); }
+
+    void clear()
+    {
+        y.clear();
+        pos.clear();
+        read_posoffset.clear();
+        metadata.clear();
+        used.clear();
+    }
+
+    void push_back(const Phase1Entry& entry, uint64_t entry_pos)
+    {
+        y.push_back(entry.y);
+        pos.push_back(entry_pos);
+        read_posoffset.push_back(entry.read_posoffset);
+        metadata.push_back(entry.metadata);
+        used.push_back(false);
+    }
+};
+
+// A match whose right table entry has not been written yet. L_pos and R_pos are the positions
+// of the two matching entries in the left table, which are remapped to their positions after
+// dropping unused entries once those are known.
+struct Phase1Match {
+    uint64_t L_pos;
+    uint64_t R_pos;
+    uint64_t f;
+    FxMetadata c;
+};
+
+Phase1Entry GetLeftEntry(
     uint8_t const table_index,
     uint8_t const* const left_buf,
     uint8_t const k,
     uint8_t const metadata_size,
     uint8_t const pos_size)
 {
-    PlotEntry left_entry;
-    left_entry.y = 0;
-    left_entry.read_posoffset = 0;
-    left_entry.left_metadata = 0;
-    left_entry.right_metadata = 0;
+    Phase1Entry left_entry{};
 
     uint32_t const ysize = (table_index == 7) ? k : k + kExtraBits;
 
     if (table_index == 1) {
         // For table 1, we only have y and metadata
         left_entry.y = Util::SliceInt64FromBytes(left_buf, 0, k + kExtraBits);
-        left_entry.left_metadata =
+        left_entry.metadata.left =
             Util::SliceInt64FromBytes(left_buf, k + kExtraBits, metadata_size);
     } else {
         // For tables 2-6, we we also have pos and offset. We need to read this because
@@ -105,19 +160,179 @@ PlotEntry GetLeftEntry(
         left_entry.read_posoffset =
             Util::SliceInt64FromBytes(left_buf, ysize, pos_size + kOffsetSize);
         if (metadata_size <= 128) {
-            left_entry.left_metadata =
+            left_entry.metadata.left =
                 Util::SliceInt128FromBytes(left_buf, ysize + pos_size + kOffsetSize, metadata_size);
         } else {
             // Large metadatas that don't fit into 128 bits. (k > 32).
-            left_entry.left_metadata =
+            left_entry.metadata.left =
                 Util::SliceInt128FromBytes(left_buf, ysize + pos_size + kOffsetSize, 128);
-            left_entry.right_metadata = Util::SliceInt128FromBytes(
+            left_entry.metadata.right = Util::SliceInt128FromBytes(
                 left_buf, ysize + pos_size + kOffsetSize + 128, metadata_size - 128);
         }
     }
     return left_entry;
 }
 
+// The output of one stripe of the left table. The positions in the right table entries are
+// relative to the start of the stripe until the stripe is committed, since they depend on how
+// many left table entries the previous stripes kept.
+struct Phase1Stripe {
+    std::unique_ptr<uint8_t[]> left_writer_buf;
+    std::unique_ptr<uint8_t[]> right_writer_buf;
+    uint64_t left_writer_count = 0;
+    uint64_t right_writer_count = 0;
+    uint64_t stripe_start_correction = 0;
+    uint64_t matches = 0;
+    bool committed = true;
+};
+
+// Orders the stripes of one table, which are numbered by a ticket in left table order. Threads
+// compute their stripes in parallel and submit them to the queue, which corrects the positions
+// and writes them out in ticket order. Whichever thread submits the next stripe in order
+// commits it, along with any later stripes that are already waiting, so threads never wait for
+// their predecessor to finish writing.
+class Phase1CommitQueue {
+public:
+    Phase1CommitQueue(
+        uint32_t num_threads,
+        uint8_t k,
+        uint8_t table_index,
+        uint8_t pos_size,
+        uint64_t right_entry_size_bytes,
+        uint32_t compressed_entry_size_bytes,
+        std::vector<FileDisk>* ptmp_1_disks)
+        : k_(k),
+          table_index_(table_index),
+          pos_size_(pos_size),
+          right_entry_size_bytes_(right_entry_size_bytes),
+          compressed_entry_size_bytes_(compressed_entry_size_bytes),
+          ptmp_1_disks_(ptmp_1_disks),
+          // Each thread has at most two stripes in flight, so all submitted stripes fit
+          pending_(2 * num_threads, nullptr)
+    {
+    }
+
+    // Blocks until the stripe may start reading the left table, which is once the previous
+    // stripe has started. Reading the left table is not thread safe when the L sort manager
+    // moves on to its next bucket, so a stripe that needs the next bucket first waits until all
+    // earlier stripes are committed, and therefore done reading.
+    void BeginStripe(uint64_t ticket, uint64_t left_reader, Phase1WaitTimes& wait_times)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        Wait(lock, [&] { return next_start_ == ticket; }, wait_times.stripe_order);
+        if (globals.L_sort_manager->CloseToNewBucket(left_reader)) {
+            Wait(lock, [&] { return next_commit_ == ticket; }, wait_times.bucket_switch);
+            // No other stripe reads the left table until next_start_ moves on
+            lock.unlock();
+            globals.L_sort_manager->TriggerNewBucket(left_reader);
+            lock.lock();
+        }
+        next_start_++;
+        cv_.notify_all();
+    }
+
+    // Blocks until the buffers of the stripe can be reused
+    void WaitCommitted(const Phase1Stripe& stripe, Phase1WaitTimes& wait_times)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        Wait(lock, [&] { return stripe.committed; }, wait_times.stripe_buffers);
+    }
+
+    void Submit(uint64_t ticket, Phase1Stripe* stripe)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        stripe->committed = false;
+        pending_[ticket % pending_.size()] = stripe;
+        if (committing_) {
+            // The thread that is committing picks this stripe up when it gets to it
+            return;
+        }
+        committing_ = true;
+        Phase1Stripe* next;
+        while ((next = pending_[next_commit_ % pending_.size()]) != nullptr) {
+            pending_[next_commit_ % pending_.size()] = nullptr;
+            // Other threads keep submitting and starting stripes while this one writes
+            lock.unlock();
+            Commit(*next);
+            lock.lock();
+            next->committed = true;
+            next_commit_++;
+            cv_.notify_all();
+        }
+        committing_ = false;
+    }
+
+private:
+    template <typename Predicate>
+    void Wait(std::unique_lock<std::mutex>& lock, Predicate ready, double& blocked_seconds)
+    {
+        if (ready()) {
+            return;
+        }
+        auto const start = std::chrono::steady_clock::now();
+        cv_.wait(lock, ready);
+        blocked_seconds +=
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    void Commit(Phase1Stripe& stripe)
+    {
+        uint32_t const ysize = (table_index_ + 1 == 7) ? k_ : k_ + kExtraBits;
+        uint32_t const startbyte = ysize / 8;
+        uint32_t const endbyte = (ysize + pos_size_ + 7) / 8 - 1;
+        uint64_t const shiftamt = (8 - ((ysize + pos_size_) % 8)) % 8;
+        uint64_t const correction = (globals.left_writer_count - stripe.stripe_start_correction)
+                                    << shiftamt;
+
+        // Correct positions
+        for (uint32_t i = 0; i < stripe.right_writer_count; i++) {
+            uint64_t posaccum = 0;
+            uint8_t* entrybuf = stripe.right_writer_buf.get() + i * right_entry_size_bytes_;
+
+            for (uint32_t j = startbyte; j <= endbyte; j++) {
+                posaccum = (posaccum << 8) | (entrybuf[j]);
+            }
+            posaccum += correction;
+            for (uint32_t j = endbyte; j >= startbyte; --j) {
+                entrybuf[j] = posaccum & 0xff;
+                posaccum = posaccum >> 8;
+            }
+        }
+        if (table_index_ == 6) {
+            // Writes out the right table for table 7
+            (*ptmp_1_disks_)[table_index_ + 1].Write(
+                globals.right_writer,
+                stripe.right_writer_buf.get(),
+                stripe.right_writer_count * right_entry_size_bytes_);
+        }
+        globals.right_writer += stripe.right_writer_count * right_entry_size_bytes_;
+        globals.right_writer_count += stripe.right_writer_count;
+
+        (*ptmp_1_disks_)[table_index_].Write(
+            globals.left_writer,
+            stripe.left_writer_buf.get(),
+            stripe.left_writer_count * compressed_entry_size_bytes_);
+        globals.left_writer += stripe.left_writer_count * compressed_entry_size_bytes_;
+        globals.left_writer_count += stripe.left_writer_count;
+
+        globals.matches += stripe.matches;
+    }
+
+    uint8_t const k_;
+    uint8_t const table_index_;
+    uint8_t const pos_size_;
+    uint64_t const right_entry_size_bytes_;
+    uint32_t const compressed_entry_size_bytes_;
+    std::vector<FileDisk>* const ptmp_1_disks_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::vector<Phase1Stripe*> pending_;
+    uint64_t next_start_ = 0;
+    uint64_t next_commit_ = 0;
+    bool committing_ = false;
+};
+
 void* phase1_thread(THREADDATA* ptd)
 {
     uint64_t const right_entry_size_bytes = ptd->right_entry_size_bytes;
@@ -128,18 +343,52 @@ void* phase1_thread(THREADDATA* ptd)
     uint8_t const pos_size = ptd->pos_size;
     uint64_t const prevtableentries = ptd->prevtableentries;
     uint32_t const compressed_entry_size_bytes = ptd->compressed_entry_size_bytes;
-    std::vector<FileDisk>* ptmp_1_disks = ptd->ptmp_1_disks;
+    Phase1CommitQueue& commit_queue = *ptd->commit_queue;
 
     // Streams to read and right to tables. We will have handles to two tables. We will
     // read through the left table, compute matches, and evaluate f for matching entries,
     // writing results to the right table.
     uint64_t left_buf_entries = 5000 + (uint64_t)((1.1) * (globals.stripe_size));
     uint64_t right_buf_entries = 5000 + (uint64_t)((1.1) * (globals.stripe_size));
-    std::unique_ptr<uint8_t[]> right_writer_buf(new uint8_t[right_buf_entries * right_entry_size_bytes + 7]);
-    std::unique_ptr<uint8_t[]> left_writer_buf(new uint8_t[left_buf_entries * compressed_entry_size_bytes + 7]);
+
+    // Two sets of output buffers, so that the thread can compute its next stripe while the
+    // previous one waits to be committed
+    Phase1Stripe stripes[2];
+    for (Phase1Stripe& stripe : stripes) {
+        stripe.right_writer_buf.reset(new uint8_t[right_buf_entries * right_entry_size_bytes + 7]);
+        stripe.left_writer_buf.reset(new uint8_t[left_buf_entries * compressed_entry_size_bytes + 7]);
+    }
 
     FxCalculator f(k, table_index + 1);
 
+    // Layout of the right table entries: f (only k bits for table 7), pos, offset, and the
+    // metadata needed to compute the next f.
+    uint8_t const right_y_size = table_index + 1 == 7 ? k : k + kExtraBits;
+    uint8_t const c_size = table_index + 1 < 7 ? kVectorLens[table_index + 2] * k : 0;
+
+    SortManager::Writer R_sort_writer(*globals.R_sort_manager);
+
+    // Per thread buffers, reused across buckets and stripes. Matches of two buckets are
+    // bounded by the size of the index arrays.
+    uint32_t const max_matches = 10000;
+    std::unique_ptr<uint16_t[]> idx_L(new uint16_t[max_matches]);
+    std::unique_ptr<uint16_t[]> idx_R(new uint16_t[max_matches]);
+    std::unique_ptr<uint64_t[]> fx_y1(new uint64_t[max_matches]);
+    std::unique_ptr<FxMetadata[]> fx_L(new FxMetadata[max_matches]);
+    std::unique_ptr<FxMetadata[]> fx_R(new FxMetadata[max_matches]);
+    std::unique_ptr<uint64_t[]> fx_f(new uint64_t[max_matches]);
+    std::unique_ptr<FxMetadata[]> fx_c(new FxMetadata[max_matches]);
+
+    // This is a sliding window of entries, since things in bucket i can match with things in
+    // bucket
+    // i + 1. At the end of each bucket, we find matches between the two previous buckets.
+    Phase1Bucket bucket_L;
+    Phase1Bucket bucket_R;
+
+    // Two vectors to keep track of matches from the previous iteration and from this iteration.
+    std::vector<Phase1Match> current_entries_to_write;
+    std::vector<Phase1Match> future_entries_to_write;
+
     // Stores map of old positions to new positions (positions after dropping entries from L
     // table that did not match) Map ke
     uint16_t position_map_size = 2000;
@@ -154,7 +403,8 @@ void* phase1_thread(THREADDATA* ptd)
     uint64_t threadstripes = (totalstripes + globals.num_threads - 1) / globals.num_threads;
 
     for (uint64_t stripe = 0; stripe < threadstripes; stripe++) {
-        uint64_t pos = (stripe * globals.num_threads + ptd->index) * globals.stripe_size;
+        uint64_t const ticket = stripe * globals.num_threads + ptd->index;
+        uint64_t pos = ticket * globals.stripe_size;
         uint64_t const endpos = pos + globals.stripe_size + 1;  // one y value overlap
         uint64_t left_reader = pos * entry_size_bytes;
         uint64_t left_writer_count = 0;
@@ -163,11 +413,10 @@ void* phase1_thread(THREADDATA* ptd)
         uint64_t right_writer_count = 0;
         uint64_t matches = 0;  // Total matches
 
-        // This is a sliding window of entries, since things in bucket i can match with things in
-        // bucket
-        // i + 1. At the end of each bucket, we find matches between the two previous buckets.
-        std::vector<PlotEntry> bucket_L;
-        std::vector<PlotEntry> bucket_R;
+        bucket_L.clear();
+        bucket_R.clear();
+        current_entries_to_write.clear();
+        future_entries_to_write.clear();
 
         uint64_t bucket = 0;
         bool end_of_table = false;  // We finished all entries in the left table
@@ -180,19 +429,11 @@ void* phase1_thread(THREADDATA* ptd)
 
         bool bStripePregamePair = false;
         bool bStripeStartPair = false;
-        bool need_new_bucket = false;
-        bool first_thread = ptd->index % globals.num_threads == 0;
-        bool last_thread = ptd->index % globals.num_threads == globals.num_threads - 1;
 
         uint64_t L_position_base = 0;
         uint64_t R_position_base = 0;
         uint64_t newlpos = 0;
         uint64_t newrpos = 0;
-        std::vector<std::tuple<PlotEntry, PlotEntry, std::pair<Bits, Bits>>>
-            current_entries_to_write;
-        std::vector<std::tuple<PlotEntry, PlotEntry, std::pair<Bits, Bits>>>
-            future_entries_to_write;
-        std::vector<PlotEntry*> not_dropped;  // Pointers are stored to avoid copying entries
 
         if (pos == 0) {
             bMatch = true;
@@ -202,28 +443,24 @@ void* phase1_thread(THREADDATA* ptd)
             stripe_start_correction = 0;
         }
 
-        Sem::Wait(ptd->theirs);
-        need_new_bucket = globals.L_sort_manager->CloseToNewBucket(left_reader);
-        if (need_new_bucket) {
-            if (!first_thread) {
-                Sem::Wait(ptd->theirs);
-            }
-            globals.L_sort_manager->TriggerNewBucket(left_reader);
-        }
-        if (!last_thread) {
-            // Do not post if we are the last thread, because first thread has already
-            // waited for us to finish when it starts
-            Sem::Post(ptd->mine);
+        // The entries of the stripe that used these buffers before are committed now, so their
+        // right table entries can be handed over to the sort manager. The order of entries
+        // within the sort buckets does not matter, so this happens outside of the ordered
+        // commit.
+        Phase1Stripe& out = stripes[stripe % 2];
+        commit_queue.WaitCommitted(out, ptd->wait_times);
+        if (table_index < 6) {
+            R_sort_writer.Add(out.right_writer_buf.get(), out.right_writer_count);
         }
+        uint8_t* const left_writer_buf = out.left_writer_buf.get();
+        uint8_t* const right_writer_buf = out.right_writer_buf.get();
+
+        commit_queue.BeginStripe(ticket, left_reader, ptd->wait_times);
 
         while (pos < prevtableentries + 1) {
-            PlotEntry left_entry = PlotEntry();
+            Phase1Entry left_entry{};
             if (pos >= prevtableentries) {
                 end_of_table = true;
-                left_entry.y = 0;
-                left_entry.left_metadata = 0;
-                left_entry.right_metadata = 0;
-                left_entry.used = false;
             } else {
                 // Reads a left entry from disk
                 uint8_t* left_buf = globals.L_sort_manager->ReadEntry(left_reader);
@@ -232,10 +469,8 @@ void* phase1_thread(THREADDATA* ptd)
                 left_entry = GetLeftEntry(table_index, left_buf, k, metadata_size, pos_size);
             }
 
-            // This is not the pos that was read from disk,but the position of the entry we read,
-            // within L table.
-            left_entry.pos = pos;
-            left_entry.used = false;
+            // The entry is stored with pos, which is not the pos that was read from disk, but
+            // the position of the entry we read, within L table.
             uint64_t y_bucket = left_entry.y / kBC;
 
             if (!bMatch) {
@@ -257,60 +492,40 @@ void* phase1_thread(THREADDATA* ptd)
 
             // Keep reading left entries into bucket_L and R, until we run out of things
             if (y_bucket == bucket) {
-                bucket_L.emplace_back(left_entry);
+                bucket_L.push_back(left_entry, pos);
             } else if (y_bucket == bucket + 1) {
-                bucket_R.emplace_back(left_entry);
+                bucket_R.push_back(left_entry, pos);
             } else {
                 // cout << "matching! " << bucket << " and " << bucket + 1 << endl;
                 // This is reached when we have finished adding stuff to bucket_R and bucket_L,
                 // so now we can compare entries in both buckets to find matches. If two entries
                 // match, match, the result is written to the right table. However the writing
                 // happens in the next iteration of the loop, since we need to remap positions.
-                uint16_t idx_L[10000];
-                uint16_t idx_R[10000];
                 int32_t idx_count=0;
 
                 if (!bucket_L.empty()) {
-                    not_dropped.clear();
-
                     if (!bucket_R.empty()) {
                         // Compute all matches between the two buckets and save indeces.
-                        idx_count = f.FindMatches(bucket_L, bucket_R, idx_L, idx_R);
-                        if(idx_count >= 10000) {
+                        idx_count = f.FindMatches(
+                            bucket_L.y.data(),
+                            bucket_L.size(),
+                            bucket_R.y.data(),
+                            bucket_R.size(),
+                            idx_L.get(),
+                            idx_R.get());
+                        if(idx_count >= (int32_t)max_matches) {
                             std::cout << "sanity check: idx_count exceeded 10000!" << std::endl;
                             exit(0);
                         }
                         // We mark entries as used if they took part in a match.
                         for (int32_t i=0; i < idx_count; i++) {
-                            bucket_L[idx_L[i]].used = true;
+                            bucket_L.used[idx_L[i]] = true;
                             if (end_of_table) {
-                                bucket_R[idx_R[i]].used = true;
+                                bucket_R.used[idx_R[i]] = true;
                             }
                         }
                     }
 
-                    // Adds L_bucket entries that are used to not_dropped. They are used if they
-                    // either matched with something to the left (in the previous iteration), or
-                    // matched with something in bucket_R (in this iteration).
-                    for (size_t bucket_index = 0; bucket_index < bucket_L.size(); bucket_index++) {
-                        PlotEntry& L_entry = bucket_L[bucket_index];
-                        if (L_entry.used) {
-                            not_dropped.emplace_back(&bucket_L[bucket_index]);
-                        }
-                    }
-                    if (end_of_table) {
-                        // In the last two buckets, we will not get a chance to enter the next
-                        // iteration due to breaking from loop. Therefore to write the final
-                        // bucket in this iteration, we have to add the R entries to the
-                        // not_dropped list.
-                        for (size_t bucket_index = 0; bucket_index < bucket_R.size();
-                             bucket_index++) {
-                            PlotEntry& R_entry = bucket_R[bucket_index];
-                            if (R_entry.used) {
-                                not_dropped.emplace_back(&R_entry);
-                            }
-                        }
-                    }
                     // We keep maps from old positions to new positions. We only need two maps,
                     // one for L bucket and one for R bucket, and we cycle through them. Map
                     // keys are stored as positions % 2^10 for efficiency. Map values are stored
@@ -319,11 +534,14 @@ void* phase1_thread(THREADDATA* ptd)
                     L_position_base = R_position_base;
                     R_position_base = stripe_left_writer_count;
 
-                    for (PlotEntry*& entry : not_dropped) {
+                    // Keeps an entry that is used: either it matched with something to the left
+                    // (in the previous iteration), or with something in bucket_R (in this
+                    // iteration).
+                    auto keep_entry = [&](const Phase1Bucket& b, size_t index) {
                         // The new position for this entry = the total amount of thing written
                         // to L so far. Since we only write entries in not_dropped, about 14% of
                         // entries are dropped.
-                        R_position_map[entry->pos % position_map_size] =
+                        R_position_map[b.pos[index] % position_map_size] =
                             stripe_left_writer_count - R_position_base;
 
                         if (bStripeStartPair) {
@@ -335,7 +553,7 @@ void* phase1_thread(THREADDATA* ptd)
                                 throw InvalidStateException("Left writer count overrun");
                             }
                             uint8_t* tmp_buf =
-                                left_writer_buf.get() + left_writer_count * compressed_entry_size_bytes;
+                                left_writer_buf + left_writer_count * compressed_entry_size_bytes;
 
                             left_writer_count++;
                             // memset(tmp_buf, 0xff, compressed_entry_size_bytes);
@@ -343,46 +561,54 @@ void* phase1_thread(THREADDATA* ptd)
                             // Rewrite left entry with just pos and offset, to reduce working space
                             uint64_t new_left_entry;
                             if (table_index == 1)
-                                new_left_entry = entry->left_metadata;
+                                new_left_entry = b.metadata[index].left;
                             else
-                                new_left_entry = entry->read_posoffset;
+                                new_left_entry = b.read_posoffset[index];
                             new_left_entry <<= 64 - (table_index == 1 ? k : pos_size + kOffsetSize);
                             Util::IntToEightBytes(tmp_buf, new_left_entry);
                         }
                         stripe_left_writer_count++;
+                    };
+
+                    for (size_t bucket_index = 0; bucket_index < bucket_L.size(); bucket_index++) {
+                        if (bucket_L.used[bucket_index]) {
+                            keep_entry(bucket_L, bucket_index);
+                        }
+                    }
+                    if (end_of_table) {
+                        // In the last two buckets, we will not get a chance to enter the next
+                        // iteration due to breaking from loop. Therefore to write the final
+                        // bucket in this iteration, we have to keep the used R entries too.
+                        for (size_t bucket_index = 0; bucket_index < bucket_R.size();
+                             bucket_index++) {
+                            if (bucket_R.used[bucket_index]) {
+                                keep_entry(bucket_R, bucket_index);
+                            }
+                        }
                     }
 
-                    // Two vectors to keep track of things from previous iteration and from this
-                    // iteration.
-                    current_entries_to_write = std::move(future_entries_to_write);
+                    std::swap(current_entries_to_write, future_entries_to_write);
                     future_entries_to_write.clear();
 
                     for (int32_t i=0; i < idx_count; i++) {
-                        PlotEntry& L_entry = bucket_L[idx_L[i]];
-                        PlotEntry& R_entry = bucket_R[idx_R[i]];
-
                         if (bStripeStartPair)
                             matches++;
 
                         // Sets the R entry to used so that we don't drop in next iteration
-                        R_entry.used = true;
-                        // Computes the output pair (fx, new_metadata)
-                        if (metadata_size <= 128) {
-                            const std::pair<Bits, Bits>& f_output = f.CalculateBucket(
-                                Bits(L_entry.y, k + kExtraBits),
-                                Bits(L_entry.left_metadata, metadata_size),
-                                Bits(R_entry.left_metadata, metadata_size));
-                            future_entries_to_write.emplace_back(L_entry, R_entry, f_output);
-                        } else {
-                            // Metadata does not fit into 128 bits
-                            const std::pair<Bits, Bits>& f_output = f.CalculateBucket(
-                                Bits(L_entry.y, k + kExtraBits),
-                                Bits(L_entry.left_metadata, 128) +
-                                    Bits(L_entry.right_metadata, metadata_size - 128),
-                                Bits(R_entry.left_metadata, 128) +
-                                    Bits(R_entry.right_metadata, metadata_size - 128));
-                            future_entries_to_write.emplace_back(L_entry, R_entry, f_output);
-                        }
+                        bucket_R.used[idx_R[i]] = true;
+
+                        fx_y1[i] = bucket_L.y[idx_L[i]];
+                        fx_L[i] = bucket_L.metadata[idx_L[i]];
+                        fx_R[i] = bucket_R.metadata[idx_R[i]];
+                    }
+
+                    // Computes the output pairs (fx, new_metadata) of all matches in one batch
+                    f.CalculateBuckets(
+                        idx_count, fx_y1.get(), fx_L.get(), fx_R.get(), fx_f.get(), fx_c.get());
+
+                    for (int32_t i=0; i < idx_count; i++) {
+                        future_entries_to_write.push_back(
+                            {bucket_L.pos[idx_L[i]], bucket_R.pos[idx_R[i]], fx_f[i], fx_c[i]});
                     }
 
                     // At this point, future_entries_to_write contains the matches of buckets L
@@ -398,25 +624,19 @@ void* phase1_thread(THREADDATA* ptd)
                             future_entries_to_write.end());
                     }
                     for (size_t i = 0; i < current_entries_to_write.size(); i++) {
-                        const auto& [L_entry, R_entry, f_output] = current_entries_to_write[i];
-
-                        // We only need k instead of k + kExtraBits bits for the last table
-                        Bits new_entry = table_index + 1 == 7 ? std::get<0>(f_output).Slice(0, k)
-                                                              : std::get<0>(f_output);
+                        const Phase1Match& match = current_entries_to_write[i];
 
                         // Maps the new positions. If we hit end of pos, we must write things in
                         // both final_entries to write and current_entries_to_write, which are
                         // in both position maps.
                         if (!end_of_table || i < final_current_entry_size) {
                             newlpos =
-                                L_position_map[L_entry.pos % position_map_size] + L_position_base;
+                                L_position_map[match.L_pos % position_map_size] + L_position_base;
                         } else {
                             newlpos =
-                                R_position_map[L_entry.pos % position_map_size] + R_position_base;
+                                R_position_map[match.L_pos % position_map_size] + R_position_base;
                         }
-                        newrpos = R_position_map[R_entry.pos % position_map_size] + R_position_base;
-                        // Position in the previous table
-                        new_entry.AppendValue(newlpos, pos_size);
+                        newrpos = R_position_map[match.R_pos % position_map_size] + R_position_base;
 
                         // Offset for matching entry
                         if (newrpos - newlpos > (1U << kOffsetSize) * 97 / 100) {
@@ -424,18 +644,27 @@ void* phase1_thread(THREADDATA* ptd)
                                 "Offset too large: " + std::to_string(newrpos - newlpos));
                         }
 
-                        new_entry.AppendValue(newrpos - newlpos, kOffsetSize);
-                        // New metadata which will be used to compute the next f
-                        new_entry += std::get<1>(f_output);
-
                         if (right_writer_count >= right_buf_entries) {
                             throw InvalidStateException("Left writer count overrun");
                         }
 
                         if (bStripeStartPair) {
                             uint8_t* right_buf =
-                                right_writer_buf.get() + right_writer_count * right_entry_size_bytes;
-                            new_entry.ToBytes(right_buf);
+                                right_writer_buf + right_writer_count * right_entry_size_bytes;
+                            memset(right_buf, 0, right_entry_size_bytes);
+
+                            // We only need k instead of k + kExtraBits bits for the last table
+                            uint32_t bit_pos = 0;
+                            Util::AppendBits(
+                                right_buf,
+                                bit_pos,
+                                match.f >> (k + kExtraBits - right_y_size),
+                                right_y_size);
+                            // Position in the previous table
+                            Util::AppendBits(right_buf, bit_pos, newlpos, pos_size);
+                            Util::AppendBits(right_buf, bit_pos, newrpos - newlpos, kOffsetSize);
+                            // New metadata which will be used to compute the next f
+                            AppendMetadata(right_buf, bit_pos, match.c, c_size);
                             right_writer_count++;
                         }
                     }
@@ -461,16 +690,16 @@ void* phase1_thread(THREADDATA* ptd)
                 if (y_bucket == bucket + 2) {
                     // We saw a bucket that is 2 more than the current, so we just set L = R, and R
                     // = [entry]
-                    bucket_L = std::move(bucket_R);
+                    std::swap(bucket_L, bucket_R);
                     bucket_R.clear();
-                    bucket_R.emplace_back(std::move(left_entry));
+                    bucket_R.push_back(left_entry, pos);
                     ++bucket;
                 } else {
                     // We saw a bucket that >2 more than the current, so we just set L = [entry],
                     // and R = []
                     bucket = y_bucket;
                     bucket_L.clear();
-                    bucket_L.emplace_back(std::move(left_entry));
+                    bucket_L.push_back(left_entry, pos);
                     bucket_R.clear();
                 }
             }
@@ -478,59 +707,24 @@ void* phase1_thread(THREADDATA* ptd)
             ++pos;
         }
 
-        // If we needed new bucket, we already waited
-        // Do not wait if we are the first thread, since we are guaranteed that everything is written
-        if (!need_new_bucket && !first_thread) {
-            Sem::Wait(ptd->theirs);
-        }
-
-        uint32_t const ysize = (table_index + 1 == 7) ? k : k + kExtraBits;
-        uint32_t const startbyte = ysize / 8;
-        uint32_t const endbyte = (ysize + pos_size + 7) / 8 - 1;
-        uint64_t const shiftamt = (8 - ((ysize + pos_size) % 8)) % 8;
-        uint64_t const correction = (globals.left_writer_count - stripe_start_correction) << shiftamt;
-
-        // Correct positions
-        for (uint32_t i = 0; i < right_writer_count; i++) {
-            uint64_t posaccum = 0;
-            uint8_t* entrybuf = right_writer_buf.get() + i * right_entry_size_bytes;
-
-            for (uint32_t j = startbyte; j <= endbyte; j++) {
-                posaccum = (posaccum << 8) | (entrybuf[j]);
-            }
-            posaccum += correction;
-            for (uint32_t j = endbyte; j >= startbyte; --j) {
-                entrybuf[j] = posaccum & 0xff;
-                posaccum = posaccum >> 8;
-            }
-        }
+        out.left_writer_count = left_writer_count;
+        out.right_writer_count = right_writer_count;
+        out.stripe_start_correction = stripe_start_correction;
+        out.matches = matches;
+        commit_queue.Submit(ticket, &out);
+    }
+    for (Phase1Stripe& stripe : stripes) {
+        commit_queue.WaitCommitted(stripe, ptd->wait_times);
         if (table_index < 6) {
-            for (uint64_t i = 0; i < right_writer_count; i++) {
-                globals.R_sort_manager->AddToCache(right_writer_buf.get() + i * right_entry_size_bytes);
-            }
-        } else {
-            // Writes out the right table for table 7
-            (*ptmp_1_disks)[table_index + 1].Write(
-                globals.right_writer,
-                right_writer_buf.get(),
-                right_writer_count * right_entry_size_bytes);
+            R_sort_writer.Add(stripe.right_writer_buf.get(), stripe.right_writer_count);
         }
-        globals.right_writer += right_writer_count * right_entry_size_bytes;
-        globals.right_writer_count += right_writer_count;
-
-        (*ptmp_1_disks)[table_index].Write(
-            globals.left_writer, left_writer_buf.get(), left_writer_count * compressed_entry_size_bytes);
-        globals.left_writer += left_writer_count * compressed_entry_size_bytes;
-        globals.left_writer_count += left_writer_count;
-
-        globals.matches += matches;
-        Sem::Post(ptd->mine);
     }
+    R_sort_writer.Flush();
 
     return 0;
 }
 
-void* F1thread(int const index, uint8_t const k, const uint8_t* id, std::mutex* smm)
+void* F1thread(int const index, uint8_t const k, const uint8_t* id)
 {
     uint32_t const entry_size_bytes = 16;
     uint64_t const max_value = ((uint64_t)1 << (k));
@@ -541,6 +735,7 @@ void* F1thread(int const index, uint8_t const k, const uint8_t* id, std::mutex*
     F1Calculator f1(k, id);
 
     std::unique_ptr<uint8_t[]> right_writer_buf(new uint8_t[right_buf_entries * entry_size_bytes]);
+    SortManager::Writer writer(*globals.L_sort_manager);
 
     // Instead of computing f1(1), f1(2), etc, for each x, we compute them in batches
     // to increase CPU efficency.
@@ -567,17 +762,27 @@ void* F1thread(int const index, uint8_t const k, const uint8_t* id, std::mutex*
             x++;
         }
 
-        std::lock_guard<std::mutex> l(*smm);
-
         // Write it out
         for (uint32_t i = 0; i < right_writer_count; i++) {
-            globals.L_sort_manager->AddToCache(&(right_writer_buf[i * entry_size_bytes]));
+            writer.Add(&(right_writer_buf[i * entry_size_bytes]));
         }
     }
+    writer.Flush();
 
     return 0;
 }
 
+void PrintBucketWriteStats(const SortManager& sort_manager)
+{
+    WriteBehind::Stats const stats = sort_manager.WriteStats();
+    if (stats.writes == 0) {
+        return;
+    }
+    std::cout << "\tBucket writes: " << stats.bytes_written / (1024 * 1024) << " MiB in "
+              << stats.writes << " writes, producers blocked for " << stats.stall_seconds
+              << " seconds" << std::endl;
+}
+
 // This is Phase 1, or forward propagation. During this phase, all of the 7 tables,
 // and f functions, are evaluated. The result is an intermediate plot file, that is
 // several times larger than what the final file will be, but that has all of the
@@ -613,18 +818,23 @@ std::vector<uint64_t> RunPhase1(
         tmp_dirname,
         filename + ".p1.t1",
         0,
-        globals.stripe_size);
+        globals.stripe_size,
+        strategy_t::radix,
+        num_threads,
+        true,
+        flags & TEMP_FILES_IN_MEMORY,
+        // Represents f1, x
+        (flags & PACKED_TEMP_FILES) ? k + kExtraBits + k : 0);
 
     // These are used for sorting on disk. The sort on disk code needs to know how
     // many elements are in each bucket.
     std::vector<uint64_t> table_sizes = std::vector<uint64_t>(8, 0);
-    std::mutex sort_manager_mutex;
 
     {
         // Start of parallel execution
         std::vector<std::thread> threads;
         for (int i = 0; i < num_threads; i++) {
-            threads.emplace_back(F1thread, i, k, id, &sort_manager_mutex);
+            threads.emplace_back(F1thread, i, k, id);
         }
 
         for (auto& t : threads) {
@@ -636,6 +846,7 @@ std::vector<uint64_t> RunPhase1(
     uint64_t prevtableentries = 1ULL << k;
     f1_start_time.PrintElapsed("F1 complete, time:");
     globals.L_sort_manager->FlushCache();
+    PrintBucketWriteStats(*globals.L_sort_manager);
     table_sizes[1] = x + 1;
 
     // Store positions to previous tables, in k bits.
@@ -663,6 +874,12 @@ std::vector<uint64_t> RunPhase1(
             }
         }
 
+        // The right entries are f, pos, offset and the metadata of the next table, see
+        // phase1_thread(). Only table 7 has no metadata, and keeps k bits of f.
+        uint32_t const right_entry_bits =
+            (table_index + 1 == 7 ? k : k + kExtraBits) + pos_size + kOffsetSize +
+            (table_index + 1 < 7 ? kVectorLens[table_index + 2] * k : 0);
+
         std::cout << "Computing table " << int{table_index + 1} << std::endl;
         // Start of parallel execution
 
@@ -682,25 +899,32 @@ std::vector<uint64_t> RunPhase1(
             tmp_dirname,
             filename + ".p1.t" + std::to_string(table_index + 1),
             0,
-            globals.stripe_size);
+            globals.stripe_size,
+            strategy_t::radix,
+            num_threads,
+            true,
+            flags & TEMP_FILES_IN_MEMORY,
+            (flags & PACKED_TEMP_FILES) ? right_entry_bits : 0);
 
         globals.L_sort_manager->TriggerNewBucket(0);
 
         Timer computation_pass_timer;
 
         auto td = std::make_unique<THREADDATA[]>(num_threads);
-        auto mutex = std::make_unique<Sem::type[]>(num_threads);
+        Phase1CommitQueue commit_queue(
+            num_threads,
+            k,
+            table_index,
+            pos_size,
+            right_entry_size_bytes,
+            compressed_entry_size_bytes,
+            &tmp_1_disks);
 
         std::vector<std::thread> threads;
 
-        for (int i = 0; i < num_threads; i++) {
-            mutex[i] = Sem::Create();
-        }
-
         for (int i = 0; i < num_threads; i++) {
             td[i].index = i;
-            td[i].mine = &mutex[i];
-            td[i].theirs = &mutex[(num_threads + i - 1) % num_threads];
+            td[i].commit_queue = &commit_queue;
 
             td[i].prevtableentries = prevtableentries;
             td[i].right_entry_size_bytes = right_entry_size_bytes;
@@ -710,24 +934,25 @@ std::vector<uint64_t> RunPhase1(
             td[i].entry_size_bytes = entry_size_bytes;
             td[i].pos_size = pos_size;
             td[i].compressed_entry_size_bytes = compressed_entry_size_bytes;
-            td[i].ptmp_1_disks = &tmp_1_disks;
 
             threads.emplace_back(phase1_thread, &td[i]);
         }
-        Sem::Post(&mutex[num_threads - 1]);
 
         for (auto& t : threads) {
             t.join();
         }
 
-        for (int i = 0; i < num_threads; i++) {
-            Sem::Destroy(mutex[i]);
-        }
-
         // end of parallel execution
 
         // Total matches found in the left table
         std::cout << "\tTotal matches: " << globals.matches << std::endl;
+        for (int i = 0; i < num_threads; i++) {
+            Phase1WaitTimes const& wait_times = td[i].wait_times;
+            std::cout << "\tThread " << i << " blocked for " << wait_times.Total()
+                      << " seconds (stripe order " << wait_times.stripe_order
+                      << ", bucket switch " << wait_times.bucket_switch << ", stripe buffers "
+                      << wait_times.stripe_buffers << ")" << std::endl;
+        }
 
         table_sizes[table_index] = globals.left_writer_count;
         table_sizes[table_index + 1] = globals.right_writer_count;
@@ -738,6 +963,7 @@ std::vector<uint64_t> RunPhase1(
         globals.L_sort_manager.reset();
         if (table_index < 6) {
             globals.R_sort_manager->FlushCache();
+            PrintBucketWriteStats(*globals.R_sort_manager);
             globals.L_sort_manager = std::move(globals.R_sort_manager);
         } else {
             tmp_1_disks[table_index + 1].Truncate(globals.right_writer);
@@ -15,6 +15,9 @@
 #ifndef SRC_CPP_PHASE2_HPP_
 #define SRC_CPP_PHASE2_HPP_
 
+#include <future>
+#include <thread>
+
 #include "disk.hpp"
 #include "entry_sizes.hpp"
 #include "sort_manager.hpp"
@@ -36,6 +39,73 @@ struct Phase2Results
     std::vector<uint64_t> table_sizes;
 };
 
+// Number of entries each thread processes at a time, when scanning a table
+static constexpr int64_t kScanPartEntries = 1 << 16;
+
+// Number of entries whose positions are remapped with one batched bitfield_index lookup
+static constexpr size_t kLookupBatch = 256;
+
+// Scans the table on num_threads threads. The table is read in batches of num_threads parts of
+// kScanPartEntries entries, and func(entries, begin, end, thread_index) is called for each part,
+// where entries holds the entries [begin, end) of the table. The next batch is read while the
+// threads process the current one. If write_back is set, each batch is written back to the table
+// after it's processed, so func can rewrite the entries in place.
+template <typename Func>
+void ScanTable(
+    FileDisk& disk,
+    int64_t const table_size,
+    int16_t const entry_size,
+    uint32_t const num_threads,
+    bool const write_back,
+    Func func)
+{
+    int64_t const batch_entries = kScanPartEntries * num_threads;
+    // 7 bytes head-room for SliceInt64FromBytes()
+    Util::AlignedBuffer batches[2] = {
+        Util::AllocateAligned(batch_entries * entry_size + 7),
+        Util::AllocateAligned(batch_entries * entry_size + 7)};
+    auto const read_batch = [&](int64_t const begin, uint8_t* const buf) {
+        disk.Read(begin * entry_size, buf, std::min(batch_entries, table_size - begin) * entry_size);
+    };
+
+    if (table_size > 0) {
+        read_batch(0, batches[0].get());
+    }
+    int b = 0;
+    for (int64_t batch_begin = 0; batch_begin < table_size; batch_begin += batch_entries, b ^= 1) {
+        int64_t const batch_end = std::min(batch_begin + batch_entries, table_size);
+        uint8_t* const batch = batches[b].get();
+
+        std::future<void> next_read;
+        if (batch_end < table_size) {
+            next_read = std::async(std::launch::async, read_batch, batch_end, batches[b ^ 1].get());
+        }
+
+        std::vector<std::thread> threads;
+        for (uint32_t t = 1; t < num_threads; t++) {
+            int64_t const begin = batch_begin + t * kScanPartEntries;
+            if (begin >= batch_end) break;
+            threads.emplace_back(
+                func,
+                batch + (begin - batch_begin) * entry_size,
+                begin,
+                std::min(begin + kScanPartEntries, batch_end),
+                t);
+        }
+        func(batch, batch_begin, std::min(batch_begin + kScanPartEntries, batch_end), 0);
+        for (auto& t : threads) {
+            t.join();
+        }
+
+        if (next_read.valid()) {
+            next_read.get();
+        }
+        if (write_back) {
+            disk.Write(batch_begin * entry_size, batch, (batch_end - batch_begin) * entry_size);
+        }
+    }
+}
+
 // Backpropagate takes in as input, a file on which forward propagation has been done.
 // The purpose of backpropagate is to eliminate any dead entries that don't contribute
 // to final values in f7, to minimize disk usage. A sort on disk is applied to each table,
@@ -50,6 +120,7 @@ Phase2Results RunPhase2(
     uint64_t memory_size,
     uint32_t const num_buckets,
     uint32_t const log_num_buckets,
+    uint8_t const num_threads,
     uint8_t const flags)
 {
     // After pruning each table will have 0.865 * 2^k or fewer entries on
@@ -105,37 +176,36 @@ Phase2Results RunPhase2(
         int64_t const table_size = table_sizes[table_index];
         int16_t const entry_size = cdiv(k + kOffsetSize + (table_index == 7 ? k : 0), 8);
 
-        BufferedDisk disk(&tmp_1_disks[table_index], table_size * entry_size);
-
-        // read_index is the number of entries we've processed so far (in the
-        // current table) i.e. the index to the current entry. This is not used
-        // for table 7
-
-        int64_t read_cursor = 0;
-        for (int64_t read_index = 0; read_index < table_size; ++read_index, read_cursor += entry_size)
-        {
-            uint8_t const* entry = disk.Read(read_cursor, entry_size);
-
-            uint64_t entry_pos_offset = 0;
-            if (table_index == 7) {
-                // table 7 is special, we never drop anything, so just build
-                // next_bitfield
-                entry_pos_offset = Util::SliceInt64FromBytes(entry, k, pos_offset_size);
-            } else {
-                if (!current_bitfield.get(read_index))
-                {
-                    // This entry should be dropped.
-                    continue;
+        FileDisk& disk = tmp_1_disks[table_index];
+
+        // read_index is the index of the current entry in the current table.
+        // Each thread scans its own part of the table, and marks the entries
+        // of the next table its entries refer to.
+        ScanTable(disk, table_size, entry_size, num_threads, false,
+            [&](uint8_t const* entry, int64_t const begin, int64_t const end, uint32_t) {
+            for (int64_t read_index = begin; read_index < end; ++read_index, entry += entry_size)
+            {
+                uint64_t entry_pos_offset = 0;
+                if (table_index == 7) {
+                    // table 7 is special, we never drop anything, so just build
+                    // next_bitfield
+                    entry_pos_offset = Util::SliceInt64FromBytes(entry, k, pos_offset_size);
+                } else {
+                    if (!current_bitfield.get(read_index))
+                    {
+                        // This entry should be dropped.
+                        continue;
+                    }
+                    entry_pos_offset = Util::SliceInt64FromBytes(entry, 0, pos_offset_size);
                 }
-                entry_pos_offset = Util::SliceInt64FromBytes(entry, 0, pos_offset_size);
-            }
 
-            uint64_t entry_pos = entry_pos_offset >> kOffsetSize;
-            uint64_t entry_offset = entry_pos_offset & ((1U << kOffsetSize) - 1);
-            // mark the two matching entries as used (pos and pos+offset)
-            next_bitfield.set(entry_pos);
-            next_bitfield.set(entry_pos + entry_offset);
-        }
+                uint64_t entry_pos = entry_pos_offset >> kOffsetSize;
+                uint64_t entry_offset = entry_pos_offset & ((1U << kOffsetSize) - 1);
+                // mark the two matching entries as used (pos and pos+offset)
+                next_bitfield.set_atomic(entry_pos);
+                next_bitfield.set_atomic(entry_pos + entry_offset);
+            }
+        });
 
         std::cout << "scanned table " << table_index << std::endl;
         scan_timer.PrintElapsed("scanned time = ");
@@ -163,71 +233,114 @@ Phase2Results RunPhase2(
             filename + ".p2.t" + std::to_string(table_index),
             uint32_t(k),
             0,
-            strategy_t::quicksort_last);
+            strategy_t::radix,
+            num_threads,
+            false,
+            flags & TEMP_FILES_IN_MEMORY,
+            // sort_key, pos and offset
+            (flags & PACKED_TEMP_FILES) ? k + pos_offset_size : 0);
 
         // as we scan the table for the second time, we'll also need to remap
         // the positions and offsets based on the next_bitfield.
         bitfield_index const index(next_bitfield);
 
-        read_cursor = 0;
-        int64_t write_counter = 0;
-        for (int64_t read_index = 0; read_index < table_size; ++read_index, read_cursor += entry_size)
-        {
-            uint8_t const* entry = disk.Read(read_cursor, entry_size);
-
-            uint64_t entry_f7 = 0;
-            uint64_t entry_pos_offset;
-            if (table_index == 7) {
-                // table 7 is special, we never drop anything, so just build
-                // next_bitfield
-                entry_f7 = Util::SliceInt64FromBytes(entry, 0, k);
-                entry_pos_offset = Util::SliceInt64FromBytes(entry, k, pos_offset_size);
-            } else {
-                // skipping
-                if (!current_bitfield.get(read_index)) continue;
-
-                entry_pos_offset = Util::SliceInt64FromBytes(entry, 0, pos_offset_size);
-            }
-
-            uint64_t entry_pos = entry_pos_offset >> kOffsetSize;
-            uint64_t entry_offset = entry_pos_offset & ((1U << kOffsetSize) - 1);
-
-            // assemble the new entry and write it to the sort manager
-
-            // map the pos and offset to the new, compacted, positions and
-            // offsets
-            std::tie(entry_pos, entry_offset) = index.lookup(entry_pos, entry_offset);
-            entry_pos_offset = (entry_pos << kOffsetSize) | entry_offset;
+        // The write_counter of the first entry of each part is the number of
+        // entries kept before it
+        std::vector<int64_t> part_counters(table_size / kScanPartEntries + 1, 0);
+        for (size_t part = 1; part < part_counters.size(); part++) {
+            int64_t const part_begin = (part - 1) * kScanPartEntries;
+            part_counters[part] = part_counters[part - 1] +
+                                  (table_index == 7 ? kScanPartEntries
+                                                    : current_bitfield.count(
+                                                          part_begin, part_begin + kScanPartEntries));
+        }
+        int64_t const write_counter = table_index == 7
+            ? table_size
+            : current_bitfield.count(0, table_size);
+
+        // Entries are added to the sort manager through a writer per thread
+        std::vector<std::unique_ptr<SortManager::Writer>> writers;
+        for (uint32_t t = 0; t < num_threads; t++) {
+            writers.emplace_back(new SortManager::Writer(*sort_manager));
+        }
 
-            uint8_t bytes[16];
-            if (table_index == 7) {
-                // table 7 is already sorted by pos, so we just rewrite the
-                // pos and offset in-place
-                uint128_t new_entry = (uint128_t)entry_f7 << f7_shift;
-                new_entry |= (uint128_t)entry_pos_offset << t7_pos_offset_shift;
-                Util::IntTo16Bytes(bytes, new_entry);
+        ScanTable(disk, table_size, entry_size, num_threads, table_index == 7,
+            [&](uint8_t* entry, int64_t const begin, int64_t const end, uint32_t const t) {
+            int64_t part_write_counter = part_counters[begin / kScanPartEntries];
+
+            // The kept entries are collected in groups, whose positions and
+            // offsets are looked up at once
+            uint64_t entry_f7[kLookupBatch];
+            uint64_t entry_pos[kLookupBatch];
+            uint64_t entry_offset[kLookupBatch];
+            uint8_t* entry_buf[kLookupBatch];
+
+            int64_t read_index = begin;
+            while (read_index < end)
+            {
+                size_t num_kept = 0;
+                for (; read_index < end && num_kept < kLookupBatch; ++read_index, entry += entry_size)
+                {
+                    uint64_t entry_pos_offset;
+                    if (table_index == 7) {
+                        // table 7 is special, we never drop anything, so just build
+                        // next_bitfield
+                        entry_f7[num_kept] = Util::SliceInt64FromBytes(entry, 0, k);
+                        entry_pos_offset = Util::SliceInt64FromBytes(entry, k, pos_offset_size);
+                    } else {
+                        // skipping
+                        if (!current_bitfield.get(read_index)) continue;
+
+                        entry_pos_offset = Util::SliceInt64FromBytes(entry, 0, pos_offset_size);
+                    }
+
+                    entry_pos[num_kept] = entry_pos_offset >> kOffsetSize;
+                    entry_offset[num_kept] = entry_pos_offset & ((1U << kOffsetSize) - 1);
+                    entry_buf[num_kept] = entry;
+                    ++num_kept;
+                }
 
-                disk.Write(read_index * entry_size, bytes, entry_size);
-            }
-            else {
-                // The new entry is slightly different. Metadata is dropped, to
-                // save space, and the counter of the entry is written (sort_key). We
-                // use this instead of (y + pos + offset) since its smaller.
-                uint128_t new_entry = (uint128_t)write_counter << write_counter_shift;
-                new_entry |= (uint128_t)entry_pos_offset << pos_offset_shift;
-                Util::IntTo16Bytes(bytes, new_entry);
-
-                sort_manager->AddToCache(bytes);
+                // map the pos and offset to the new, compacted, positions and
+                // offsets
+                index.lookup(entry_pos, entry_offset, num_kept);
+
+                // assemble the new entries and write them to the sort manager
+                for (size_t i = 0; i < num_kept; ++i) {
+                    uint64_t const entry_pos_offset = (entry_pos[i] << kOffsetSize) | entry_offset[i];
+
+                    uint8_t bytes[16];
+                    if (table_index == 7) {
+                        // table 7 is already sorted by pos, so we just rewrite the
+                        // pos and offset in-place
+                        uint128_t new_entry = (uint128_t)entry_f7[i] << f7_shift;
+                        new_entry |= (uint128_t)entry_pos_offset << t7_pos_offset_shift;
+                        Util::IntTo16Bytes(bytes, new_entry);
+
+                        memcpy(entry_buf[i], bytes, entry_size);
+                    }
+                    else {
+                        // The new entry is slightly different. Metadata is dropped, to
+                        // save space, and the counter of the entry is written (sort_key). We
+                        // use this instead of (y + pos + offset) since its smaller.
+                        uint128_t new_entry = (uint128_t)part_write_counter << write_counter_shift;
+                        new_entry |= (uint128_t)entry_pos_offset << pos_offset_shift;
+                        Util::IntTo16Bytes(bytes, new_entry);
+
+                        writers[t]->Add(bytes);
+                    }
+                    ++part_write_counter;
+                }
             }
-            ++write_counter;
-        }
+        });
 
         if (table_index != 7) {
+            for (auto& writer : writers) {
+                writer->Flush();
+            }
             sort_manager->FlushCache();
             sort_timer.PrintElapsed("sort time = ");
 
             // clear disk caches
-            disk.FreeMemory();
             sort_manager->FreeMemory();
 
             output_files[table_index - 2] = std::move(sort_manager);
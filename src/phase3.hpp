@@ -15,6 +15,9 @@
 #ifndef SRC_CPP_PHASE3_HPP_
 #define SRC_CPP_PHASE3_HPP_
 
+#include <future>
+#include <thread>
+
 #include "encoding.hpp"
 #include "entry_sizes.hpp"
 #include "exceptions.hpp"
@@ -42,10 +45,8 @@ struct Phase3Results {
 // have many entries in each park, we can approximate how much space each park with take. Format
 // is: [2k bits of first_line_point]  [EPP-1 stubs] [Deltas size] [EPP-1 deltas]....
 // [first_line_point] ...
-void WriteParkToFile(
-    FileDisk &final_disk,
-    uint64_t table_start,
-    uint64_t park_index,
+// EncodePark() only encodes the park into the first park_size_bytes of park_buffer.
+void EncodePark(
     uint32_t park_size_bytes,
     uint128_t first_line_point,
     const std::vector<uint8_t> &park_deltas,
@@ -55,9 +56,6 @@ void WriteParkToFile(
     uint8_t *park_buffer,
     uint64_t const park_buffer_size)
 {
-    // Parks are fixed size, so we know where to start writing. The deltas will not go over
-    // into the next park.
-    uint64_t writer = table_start + park_index * park_size_bytes;
     uint8_t *index = park_buffer;
 
     first_line_point <<= 128 - 2 * k;
@@ -101,10 +99,223 @@ void WriteParkToFile(
             " bytes. Space: " + std::to_string(park_buffer_size));
     }
     memset(index, 0x00, park_size_bytes - (index - park_buffer));
+}
+
+void WriteParkToFile(
+    FileDisk &final_disk,
+    uint64_t table_start,
+    uint64_t park_index,
+    uint32_t park_size_bytes,
+    uint128_t first_line_point,
+    const std::vector<uint8_t> &park_deltas,
+    const std::vector<uint64_t> &park_stubs,
+    uint8_t k,
+    uint8_t table_index,
+    uint8_t *park_buffer,
+    uint64_t const park_buffer_size)
+{
+    EncodePark(
+        park_size_bytes,
+        first_line_point,
+        park_deltas,
+        park_stubs,
+        k,
+        table_index,
+        park_buffer,
+        park_buffer_size);
 
+    // Parks are fixed size, so we know where to start writing. The deltas will not go over
+    // into the next park.
+    uint64_t writer = table_start + park_index * park_size_bytes;
     final_disk.Write(writer, (uint8_t *)park_buffer, park_size_bytes);
 }
 
+// Number of parks the ParkWriter encodes at a time, per thread
+static constexpr uint32_t kParkWriterBatchParks = 128;
+
+// Number of batches of parks the ParkWriter can have in flight
+static constexpr uint32_t kParkWriterBatches = 2;
+
+// Encodes the parks of a table on the plotter's threads, and writes them to the final file in
+// order. Consecutive parks are collected into a batch, which is encoded into one buffer in the
+// background and written with a single write, after the batch before it. Add() only blocks
+// when all the batches are still in flight.
+class ParkWriter {
+public:
+    ParkWriter(
+        FileDisk &final_disk,
+        uint64_t const table_start,
+        uint32_t const park_size_bytes,
+        uint8_t const k,
+        uint8_t const table_index,
+        uint32_t const num_threads)
+        : final_disk_(final_disk)
+        , table_start_(table_start)
+        , park_size_bytes_(park_size_bytes)
+        , park_buffer_size_(
+              EntrySizes::CalculateLinePointSize(k) + EntrySizes::CalculateStubsSize(k) + 2 +
+              EntrySizes::CalculateMaxDeltasSize(k, 1))
+        , k_(k)
+        , table_index_(table_index)
+        , num_threads_(std::max(num_threads, 1U))
+        , batch_parks_(kParkWriterBatchParks * num_threads_)
+    {
+        for (Batch &batch : batches_) {
+            batch.parks.resize(batch_parks_);
+            batch.buffer.reset(new uint8_t[uint64_t(batch_parks_) * park_size_bytes_]);
+        }
+    }
+
+    ParkWriter(ParkWriter const &) = delete;
+    ParkWriter &operator=(ParkWriter const &) = delete;
+
+    ~ParkWriter()
+    {
+        // The batches in flight refer to this object
+        for (Batch &batch : batches_) {
+            if (batch.done.valid()) {
+                batch.done.wait();
+            }
+        }
+    }
+
+    // Adds the next park of the table
+    void Add(
+        uint128_t const first_line_point,
+        const std::vector<uint8_t> &park_deltas,
+        const std::vector<uint64_t> &park_stubs)
+    {
+        Batch &batch = batches_[current_];
+        Park &park = batch.parks[batch.num_parks++];
+        park.first_line_point = first_line_point;
+        park.deltas = park_deltas;
+        park.stubs = park_stubs;
+        if (batch.num_parks == batch_parks_) {
+            Submit();
+        }
+    }
+
+    // Writes the parks that were added, and waits for all the writes to finish
+    void Finish()
+    {
+        if (batches_[current_].num_parks > 0) {
+            Submit();
+        }
+        for (Batch &batch : batches_) {
+            if (batch.done.valid()) {
+                batch.done.get();
+            }
+        }
+    }
+
+private:
+    struct Park {
+        uint128_t first_line_point = 0;
+        std::vector<uint8_t> deltas;
+        std::vector<uint64_t> stubs;
+    };
+
+    struct Batch {
+        uint64_t first_park = 0;
+        uint32_t num_parks = 0;
+        std::vector<Park> parks;
+        std::unique_ptr<uint8_t[]> buffer;
+        std::shared_future<void> done;
+    };
+
+    void EncodeParks(Batch &batch, uint32_t const begin, uint32_t const end)
+    {
+        std::unique_ptr<uint8_t[]> park_buffer(new uint8_t[park_buffer_size_]);
+        for (uint32_t i = begin; i < end; i++) {
+            Park const &park = batch.parks[i];
+            EncodePark(
+                park_size_bytes_,
+                park.first_line_point,
+                park.deltas,
+                park.stubs,
+                k_,
+                table_index_,
+                park_buffer.get(),
+                park_buffer_size_);
+            memcpy(batch.buffer.get() + uint64_t(i) * park_size_bytes_, park_buffer.get(),
+                park_size_bytes_);
+        }
+    }
+
+    void Submit()
+    {
+        Batch &batch = batches_[current_];
+        batch.first_park = next_park_;
+        next_park_ += batch.num_parks;
+        std::shared_future<void> previous =
+            batches_[(current_ + kParkWriterBatches - 1) % kParkWriterBatches].done;
+
+        batch.done = std::async(std::launch::async, [this, &batch, previous] {
+            uint32_t const n = batch.num_parks;
+            std::vector<std::thread> threads;
+            for (uint32_t t = 1; t < num_threads_; t++) {
+                threads.emplace_back(
+                    &ParkWriter::EncodeParks, this, std::ref(batch), n * t / num_threads_,
+                    n * (t + 1) / num_threads_);
+            }
+            EncodeParks(batch, 0, n / num_threads_);
+            for (auto &th : threads) {
+                th.join();
+            }
+
+            if (previous.valid()) {
+                previous.get();
+            }
+            final_disk_.Write(
+                table_start_ + batch.first_park * park_size_bytes_,
+                batch.buffer.get(),
+                uint64_t(n) * park_size_bytes_);
+        }).share();
+
+        // Waits for the oldest batch, so it can be filled next
+        current_ = (current_ + 1) % kParkWriterBatches;
+        Batch &next = batches_[current_];
+        if (next.done.valid()) {
+            next.done.get();
+        }
+        next.num_parks = 0;
+    }
+
+    FileDisk &final_disk_;
+    uint64_t const table_start_;
+    uint32_t const park_size_bytes_;
+    uint64_t const park_buffer_size_;
+    uint8_t const k_;
+    uint8_t const table_index_;
+    uint32_t const num_threads_;
+    uint32_t const batch_parks_;
+
+    Batch batches_[kParkWriterBatches];
+    uint32_t current_ = 0;
+    uint64_t next_park_ = 0;
+};
+
+// Number of positions of the left table the first pass of RunPhase3 reads at a time, per thread
+static constexpr uint64_t kPhase3BatchPositions = 1 << 16;
+
+// A right entry in the format from backprop
+struct Phase3RightEntry {
+    uint64_t sort_key;
+    uint64_t pos;
+    uint64_t offset;
+};
+
+// The right entries that refer to the positions [first_pos, end_pos) of the left table, in the
+// first pass of RunPhase3
+struct Phase3Batch {
+    uint64_t first_pos = 0;
+    uint64_t end_pos = 0;
+    // The new positions of the left entries, starting at first_pos. Also has the kReadMinusWrite
+    // positions after end_pos, which the offsets of the entries may reach.
+    std::vector<uint64_t> new_pos;
+    std::vector<Phase3RightEntry> right_entries;
+};
+
 // Compresses the plot file tables into the final file. In order to do this, entries must be
 // reorganized from the (pos, offset) bucket sorting order, to a more free line_point sorting
 // order. In (pos, offset ordering), we store two pointers two the previous table, (x, y) which
@@ -128,6 +339,7 @@ Phase3Results RunPhase3(
     uint64_t memory_size,
     uint32_t num_buckets,
     uint32_t log_num_buckets,
+    uint8_t const num_threads,
     const uint8_t flags)
 {
     uint8_t const pos_size = k;
@@ -147,12 +359,16 @@ Phase3Results RunPhase3(
     std::unique_ptr<SortManager> L_sort_manager;
     std::unique_ptr<SortManager> R_sort_manager;
 
-    // These variables are used in the WriteParkToFile method. They are preallocatted here
-    // to save time.
-    uint64_t const park_buffer_size = EntrySizes::CalculateLinePointSize(k)
-        + EntrySizes::CalculateStubsSize(k) + 2
-        + EntrySizes::CalculateMaxDeltasSize(k, 1);
-    std::unique_ptr<uint8_t[]> park_buffer(new uint8_t[park_buffer_size]);
+    // The parks of a table are encoded and written in the background, which continues during
+    // the first pass of the next table, since that doesn't depend on them. This waits for the
+    // parks of table_index, and writes the pointer to the end of the table.
+    std::unique_ptr<ParkWriter> park_writer;
+    auto finish_parks = [&](int const table_index) {
+        park_writer->Finish();
+        park_writer.reset();
+        Util::IntToEightBytes(table_pointer_bytes, final_table_begin_pointers[table_index + 1]);
+        tmp2_disk.Write(header_size - 8 * (10 - table_index), table_pointer_bytes, 8);
+    };
 
     // Iterates through all tables, starting at 1, with L and R pointers.
     // For each table, R entries are rewritten with line points. Then, the right table is
@@ -205,151 +421,169 @@ Phase3Results RunPhase3(
             filename + ".p3.t" + std::to_string(table_index + 1),
             0,
             0,
-            strategy_t::quicksort_last);
-
-        bool should_read_entry = true;
-        std::vector<uint64_t> left_new_pos(kCachedPositionsSize);
-
-        uint64_t old_sort_keys[kReadMinusWrite][kMaxMatchesSingleEntry];
-        uint64_t old_offsets[kReadMinusWrite][kMaxMatchesSingleEntry];
-        uint16_t old_counters[kReadMinusWrite];
-        for (uint16_t &old_counter : old_counters) {
-            old_counter = 0;
-        }
-        bool end_of_right_table = false;
-        uint64_t current_pos = 0;
-        uint64_t end_of_table_pos = 0;
-        uint64_t greatest_pos = 0;
-
-        uint8_t const* left_entry_disk_buf = nullptr;
-
-        uint64_t entry_sort_key, entry_pos, entry_offset;
-        uint64_t cached_entry_sort_key = 0;
-        uint64_t cached_entry_pos = 0;
-        uint64_t cached_entry_offset = 0;
-
-        // Similar algorithm as Backprop, to read both L and R tables simultaneously
-        while (!end_of_right_table || (current_pos - end_of_table_pos <= kReadMinusWrite)) {
-            old_counters[current_pos % kReadMinusWrite] = 0;
-
-            if (end_of_right_table || current_pos <= greatest_pos) {
-                while (!end_of_right_table) {
-                    if (should_read_entry) {
-                        if (right_reader_count == res2.table_sizes[table_index + 1]) {
-                            end_of_right_table = true;
-                            end_of_table_pos = current_pos;
-                            right_disk.FreeMemory();
-                            break;
-                        }
-                        // The right entries are in the format from backprop, (sort_key, pos,
-                        // offset)
-                        uint8_t const* right_entry_buf = right_disk.Read(right_reader, p2_entry_size_bytes);
-                        right_reader += p2_entry_size_bytes;
-                        right_reader_count++;
-
-                        entry_sort_key =
-                            Util::SliceInt64FromBytes(right_entry_buf, 0, right_sort_key_size);
-                        entry_pos = Util::SliceInt64FromBytes(
-                            right_entry_buf, right_sort_key_size, pos_size);
-                        entry_offset = Util::SliceInt64FromBytes(
-                            right_entry_buf, right_sort_key_size + pos_size, kOffsetSize);
-                    } else if (cached_entry_pos == current_pos) {
-                        entry_sort_key = cached_entry_sort_key;
-                        entry_pos = cached_entry_pos;
-                        entry_offset = cached_entry_offset;
-                    } else {
-                        break;
-                    }
-
-                    should_read_entry = true;
-
-                    if (entry_pos + entry_offset > greatest_pos) {
-                        greatest_pos = entry_pos + entry_offset;
-                    }
-                    if (entry_pos == current_pos) {
-                        uint64_t const old_write_pos = entry_pos % kReadMinusWrite;
-                        old_sort_keys[old_write_pos][old_counters[old_write_pos]] = entry_sort_key;
-                        old_offsets[old_write_pos][old_counters[old_write_pos]] =
-                            (entry_pos + entry_offset);
-                        ++old_counters[old_write_pos];
-                    } else {
-                        should_read_entry = false;
-                        cached_entry_sort_key = entry_sort_key;
-                        cached_entry_pos = entry_pos;
-                        cached_entry_offset = entry_offset;
-                        break;
-                    }
-                }
-
-                if (left_reader_count < res2.table_sizes[table_index]) {
-                    // The left entries are in the new format: (sort_key, new_pos), except for table
-                    // 1: (y, x).
-
-                    // TODO: unify these cases once SortManager implements
-                    // the ReadDisk interface
-                    if (table_index == 1) {
-                        left_entry_disk_buf = left_disk.Read(left_reader, left_entry_size_bytes);
-                        left_reader += left_entry_size_bytes;
-                    } else {
-                        left_entry_disk_buf = L_sort_manager->ReadEntry(left_reader);
-                        left_reader += new_pos_entry_size_bytes;
-                    }
-                    left_reader_count++;
+            strategy_t::radix,
+            num_threads,
+            true,
+            flags & TEMP_FILES_IN_MEMORY,
+            // line_point, sort_key
+            (flags & PACKED_TEMP_FILES) ? line_point_size + right_sort_key_size : 0);
+
+        uint64_t const left_table_size = res2.table_sizes[table_index];
+        uint64_t const right_table_size = res2.table_sizes[table_index + 1];
+        uint64_t const batch_positions = kPhase3BatchPositions * num_threads;
+
+        // The right entry that was read last, but belongs to the next batch
+        bool have_pending_entry = false;
+        Phase3RightEntry pending_entry;
+
+        // Reads the positions of the next batch after prev: the new positions of the left
+        // entries and the right entries that refer to them. Similar algorithm as Backprop, to
+        // read both L and R tables simultaneously
+        auto const read_batch = [&](Phase3Batch& batch, Phase3Batch const& prev) {
+            batch.first_pos = prev.end_pos;
+            batch.end_pos = prev.end_pos + batch_positions;
+
+            // The new positions the previous batch read ahead
+            batch.new_pos.assign(
+                prev.new_pos.begin() +
+                    std::min<uint64_t>(prev.new_pos.size(), prev.end_pos - prev.first_pos),
+                prev.new_pos.end());
+            while (batch.new_pos.size() < batch_positions + kReadMinusWrite &&
+                   left_reader_count < left_table_size) {
+                // The left entries are in the new format: (sort_key, new_pos), except for table
+                // 1: (y, x).
+
+                // TODO: unify these cases once SortManager implements
+                // the ReadDisk interface
+                uint8_t const* left_entry_disk_buf;
+                if (table_index == 1) {
+                    left_entry_disk_buf = left_disk.Read(left_reader, left_entry_size_bytes);
+                    left_reader += left_entry_size_bytes;
+                } else {
+                    left_entry_disk_buf = L_sort_manager->ReadEntry(left_reader);
+                    left_reader += new_pos_entry_size_bytes;
                 }
+                left_reader_count++;
 
                 // We read the "new_pos" from the L table, which for table 1 is just x. For
                 // other tables, the new_pos
                 if (table_index == 1) {
                     // Only k bits, since this is x
-                    left_new_pos[current_pos % kCachedPositionsSize] =
-                        Util::SliceInt64FromBytes(left_entry_disk_buf, 0, k);
+                    batch.new_pos.push_back(Util::SliceInt64FromBytes(left_entry_disk_buf, 0, k));
                 } else {
                     // k+1 bits in case it overflows
-                    left_new_pos[current_pos % kCachedPositionsSize] =
-                        Util::SliceInt64FromBytes(left_entry_disk_buf, right_sort_key_size, k);
+                    batch.new_pos.push_back(
+                        Util::SliceInt64FromBytes(left_entry_disk_buf, right_sort_key_size, k));
                 }
             }
 
-            uint64_t const write_pointer_pos = current_pos - kReadMinusWrite + 1;
-
-            // Rewrites each right entry as (line_point, sort_key)
-            if (current_pos + 1 >= kReadMinusWrite) {
-                uint64_t left_new_pos_1 = left_new_pos[write_pointer_pos % kCachedPositionsSize];
-                for (uint32_t counter = 0;
-                     counter < old_counters[write_pointer_pos % kReadMinusWrite];
-                     counter++) {
-                    uint64_t left_new_pos_2 = left_new_pos
-                        [old_offsets[write_pointer_pos % kReadMinusWrite][counter] %
-                         kCachedPositionsSize];
-
-                    // A line point is an encoding of two k bit values into one 2k bit value.
-                    uint128_t line_point =
-                        Encoding::SquareToLinePoint(left_new_pos_1, left_new_pos_2);
-
-                    if (left_new_pos_1 > ((uint64_t)1 << k) ||
-                        left_new_pos_2 > ((uint64_t)1 << k)) {
-                        std::cout << "left or right positions too large" << std::endl;
-                        std::cout << (line_point > ((uint128_t)1 << (2 * k)));
-                        if ((line_point > ((uint128_t)1 << (2 * k)))) {
-                            std::cout << "L, R: " << left_new_pos_1 << " " << left_new_pos_2
-                                      << std::endl;
-                            std::cout << "Line point: " << line_point << std::endl;
-                            abort();
-                        }
+            batch.right_entries.clear();
+            while (true) {
+                if (!have_pending_entry) {
+                    if (right_reader_count == right_table_size) {
+                        right_disk.FreeMemory();
+                        break;
                     }
-                    Bits to_write = Bits(line_point, line_point_size);
-                    to_write.AppendValue(
-                        old_sort_keys[write_pointer_pos % kReadMinusWrite][counter],
-                        right_sort_key_size);
+                    // The right entries are in the format from backprop, (sort_key, pos,
+                    // offset)
+                    uint8_t const* right_entry_buf = right_disk.Read(right_reader, p2_entry_size_bytes);
+                    right_reader += p2_entry_size_bytes;
+                    right_reader_count++;
+
+                    pending_entry.sort_key =
+                        Util::SliceInt64FromBytes(right_entry_buf, 0, right_sort_key_size);
+                    pending_entry.pos =
+                        Util::SliceInt64FromBytes(right_entry_buf, right_sort_key_size, pos_size);
+                    pending_entry.offset = Util::SliceInt64FromBytes(
+                        right_entry_buf, right_sort_key_size + pos_size, kOffsetSize);
+                    have_pending_entry = true;
+                }
+                if (pending_entry.pos >= batch.end_pos) {
+                    break;
+                }
+                batch.right_entries.push_back(pending_entry);
+                have_pending_entry = false;
+            }
+        };
+
+        // Each thread adds its entries to R_sort_manager through its own writer
+        std::vector<std::unique_ptr<SortManager::Writer>> writers;
+        for (uint32_t t = 0; t < num_threads; t++) {
+            writers.emplace_back(new SortManager::Writer(*R_sort_manager));
+        }
 
-                    R_sort_manager->AddToCache(to_write);
-                    total_r_entries++;
+        // Rewrites each right entry as (line_point, sort_key). The threads take consecutive
+        // ranges of the batch's right entries. All the positions the offsets of a batch reach
+        // are in the batch, since it reads kReadMinusWrite positions ahead.
+        auto const rewrite_entries = [&](Phase3Batch const& batch, uint32_t const t) {
+            uint64_t const num_entries = batch.right_entries.size();
+            for (uint64_t i = num_entries * t / num_threads; i < num_entries * (t + 1) / num_threads;
+                 i++) {
+                Phase3RightEntry const& entry = batch.right_entries[i];
+                uint64_t left_new_pos_1 = batch.new_pos[entry.pos - batch.first_pos];
+                uint64_t left_new_pos_2 =
+                    batch.new_pos[entry.pos + entry.offset - batch.first_pos];
+
+                // A line point is an encoding of two k bit values into one 2k bit value.
+                uint128_t line_point = Encoding::SquareToLinePoint(left_new_pos_1, left_new_pos_2);
+
+                if (left_new_pos_1 > ((uint64_t)1 << k) || left_new_pos_2 > ((uint64_t)1 << k)) {
+                    std::cout << "left or right positions too large" << std::endl;
+                    std::cout << (line_point > ((uint128_t)1 << (2 * k)));
+                    if ((line_point > ((uint128_t)1 << (2 * k)))) {
+                        std::cout << "L, R: " << left_new_pos_1 << " " << left_new_pos_2
+                                  << std::endl;
+                        std::cout << "Line point: " << line_point << std::endl;
+                        abort();
+                    }
                 }
+                // 7 bytes head-room for AppendBits()
+                uint8_t to_write[32] = {};
+                uint32_t bit_pos = 0;
+                Util::AppendBits(to_write, bit_pos, line_point, line_point_size);
+                Util::AppendBits(to_write, bit_pos, entry.sort_key, right_sort_key_size);
+
+                writers[t]->Add(to_write);
             }
-            current_pos += 1;
+        };
+
+        // The next batch is read while the threads rewrite the current one
+        Phase3Batch batches[2];
+        read_batch(batches[0], batches[1]);
+        for (int b = 0;; b ^= 1) {
+            Phase3Batch const& batch = batches[b];
+            bool const last_batch = right_reader_count == right_table_size && !have_pending_entry;
+
+            std::future<void> next_read;
+            if (!last_batch) {
+                next_read = std::async(
+                    std::launch::async, read_batch, std::ref(batches[b ^ 1]), std::cref(batch));
+            }
+
+            std::vector<std::thread> threads;
+            for (uint32_t t = 1; t < num_threads; t++) {
+                threads.emplace_back(rewrite_entries, std::cref(batch), t);
+            }
+            rewrite_entries(batch, 0);
+            for (auto& t : threads) {
+                t.join();
+            }
+            total_r_entries += batch.right_entries.size();
+
+            if (last_batch) {
+                break;
+            }
+            next_read.get();
+        }
+        for (auto& writer : writers) {
+            writer->Flush();
         }
         computation_pass_1_timer.PrintElapsed("\tFirst computation pass time:");
 
+        if (park_writer) {
+            finish_parks(table_index - 1);
+        }
+
         // Remove no longer needed file
         left_disk.Truncate(0);
 
@@ -361,7 +595,6 @@ Phase3Results RunPhase3(
 
         right_reader = 0;
         right_reader_count = 0;
-        uint64_t final_table_writer = final_table_begin_pointers[table_index];
 
         final_entries_written = 0;
 
@@ -390,13 +623,25 @@ Phase3Results RunPhase3(
             filename + ".p3s.t" + std::to_string(table_index + 1),
             0,
             0,
-            strategy_t::quicksort_last);
+            strategy_t::radix,
+            num_threads,
+            true,
+            flags & TEMP_FILES_IN_MEMORY,
+            // sort_key, new_pos
+            (flags & PACKED_TEMP_FILES) ? right_sort_key_size + k + (table_index == 6 ? 1 : 0) : 0);
 
         std::vector<uint8_t> park_deltas;
         std::vector<uint64_t> park_stubs;
         uint128_t checkpoint_line_point = 0;
         uint128_t last_line_point = 0;
         uint64_t park_index = 0;
+        park_writer = std::make_unique<ParkWriter>(
+            tmp2_disk,
+            final_table_begin_pointers[table_index],
+            park_size_bytes,
+            k,
+            table_index,
+            num_threads);
 
         uint8_t *right_reader_entry_buf;
 
@@ -428,18 +673,7 @@ Phase3Results RunPhase3(
             // Every EPP entries, writes a park
             if (index % kEntriesPerPark == 0) {
                 if (index != 0) {
-                    WriteParkToFile(
-                        tmp2_disk,
-                        final_table_begin_pointers[table_index],
-                        park_index,
-                        park_size_bytes,
-                        checkpoint_line_point,
-                        park_deltas,
-                        park_stubs,
-                        k,
-                        table_index,
-                        park_buffer.get(),
-                        park_buffer_size);
+                    park_writer->Add(checkpoint_line_point, park_deltas, park_stubs);
                     park_index += 1;
                     final_entries_written += (park_stubs.size() + 1);
                 }
@@ -475,18 +709,7 @@ Phase3Results RunPhase3(
 
         if (park_deltas.size() > 0) {
             // Since we don't have a perfect multiple of EPP entries, this writes the last ones
-            WriteParkToFile(
-                tmp2_disk,
-                final_table_begin_pointers[table_index],
-                park_index,
-                park_size_bytes,
-                checkpoint_line_point,
-                park_deltas,
-                park_stubs,
-                k,
-                table_index,
-                park_buffer.get(),
-                park_buffer_size);
+            park_writer->Add(checkpoint_line_point, park_deltas, park_stubs);
             final_entries_written += (park_stubs.size() + 1);
         }
 
@@ -496,20 +719,15 @@ Phase3Results RunPhase3(
         final_table_begin_pointers[table_index + 1] =
             final_table_begin_pointers[table_index] + (park_index + 1) * park_size_bytes;
 
-        final_table_writer = header_size - 8 * (10 - table_index);
-        Util::IntToEightBytes(table_pointer_bytes, final_table_begin_pointers[table_index + 1]);
-        tmp2_disk.Write(final_table_writer, (table_pointer_bytes), 8);
-        final_table_writer += 8;
-
         table_timer.PrintElapsed("Total compress table time:");
 
         left_disk.FreeMemory();
         right_disk.FreeMemory();
         if (flags & SHOW_PROGRESS) { progress(3, table_index, 6); }
     }
+    finish_parks(6);
 
     L_sort_manager->FreeMemory();
-    park_buffer.reset();
 
     // These results will be used to write table P7 and the checkpoint tables in phase 4.
     return Phase3Results{
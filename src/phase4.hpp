@@ -15,6 +15,9 @@
 #ifndef SRC_CPP_PHASE4_HPP_
 #define SRC_CPP_PHASE4_HPP_
 
+#include <future>
+#include <thread>
+
 #include "disk.hpp"
 #include "encoding.hpp"
 #include "entry_sizes.hpp"
@@ -23,6 +26,22 @@
 #include "util.hpp"
 #include "progress.hpp"
 
+// Number of table 7 entries RunPhase4 reads at a time. It is a multiple of both
+// kCheckpoint1Interval and kEntriesPerPark, so the C3 entries and P7 parks of a chunk only
+// depend on the entries of that chunk.
+static constexpr uint64_t kPhase4ChunkEntries = 128 * kCheckpoint1Interval;
+static_assert(
+    kPhase4ChunkEntries % kEntriesPerPark == 0,
+    "phase 4 chunks must consist of whole P7 parks");
+
+// A chunk of table 7 entries in RunPhase4, starting at first_position
+struct Phase4Chunk {
+    uint64_t first_position = 0;
+    uint64_t num_entries = 0;
+    std::vector<uint64_t> y;
+    std::vector<uint64_t> new_pos;
+};
+
 // Writes the checkpoint tables. The purpose of these tables, is to store a list of ~2^k values
 // of size k (the proof of space outputs from table 7), in a way where they can be looked up for
 // proofs, but also efficiently. To do this, we assume table 7 is sorted by f7, and we write the
@@ -39,8 +58,13 @@
 // C1 (checkpoint values)
 // C2 (checkpoint values into)
 // C3 (deltas of f7s between C1 checkpoints)
+
+// Table 7 is read in chunks of kPhase4ChunkEntries. While the next chunk is read, the P7 parks
+// and C3 entries of the current one are encoded by num_threads threads, and written to the
+// final file.
 void RunPhase4(uint8_t k, uint8_t pos_size, FileDisk &tmp2_disk, Phase3Results &res,
-               const uint8_t flags, const int max_phase4_progress_updates)
+               uint32_t const num_threads, const uint8_t flags,
+               const int max_phase4_progress_updates)
 {
     uint32_t P7_park_size = Util::ByteAlign((k + 1) * kEntriesPerPark) / 8;
     uint64_t number_of_p7_parks =
@@ -64,100 +88,176 @@ void RunPhase4(uint8_t k, uint8_t pos_size, FileDisk &tmp2_disk, Phase3Results &
 
     uint64_t plot_file_reader = 0;
     uint64_t final_file_writer_1 = begin_byte_C1;
-    uint64_t final_file_writer_2 = begin_byte_C3;
-    uint64_t final_file_writer_3 = res.final_table_begin_pointers[7];
 
-    uint64_t prev_y = 0;
     std::vector<Bits> C2;
-    uint64_t num_C1_entries = 0;
-    std::vector<uint8_t> deltas_to_write;
     uint32_t right_entry_size_bytes = res.right_entry_size_bits / 8;
+    uint32_t const C1_entry_size = Util::ByteAlign(k) / 8;
+    uint32_t const threads = std::max(num_threads, 1U);
+
+    auto C1_entry_buf = new uint8_t[C1_entry_size];
 
-    uint8_t *right_entry_buf;
-    auto C1_entry_buf = new uint8_t[Util::ByteAlign(k) / 8];
-    auto C3_entry_buf = new uint8_t[size_C3];
-    auto P7_entry_buf = new uint8_t[P7_park_size];
+    uint64_t const chunk_parks = kPhase4ChunkEntries / kEntriesPerPark;
+    uint64_t const chunk_C1_entries = kPhase4ChunkEntries / kCheckpoint1Interval;
+    std::unique_ptr<uint8_t[]> P7_buf(new uint8_t[chunk_parks * P7_park_size]);
+    std::unique_ptr<uint8_t[]> C1_buf(new uint8_t[chunk_C1_entries * C1_entry_size]);
+    std::unique_ptr<uint8_t[]> C3_buf(new uint8_t[chunk_C1_entries * size_C3]);
 
     std::cout << "\tStarting to write C1 and C3 tables" << std::endl;
 
-    ParkBits to_write_p7;
-    const int progress_update_increment = res.final_entries_written / max_phase4_progress_updates;
+    uint64_t const progress_update_increment = std::max<uint64_t>(
+        res.final_entries_written / max_phase4_progress_updates, 1);
+    uint64_t next_progress_update = 0;
 
     // We read each table7 entry, which is sorted by f7, but we don't need f7 anymore. Instead,
     // we will just store pos6, and the deltas in table C3, and checkpoints in tables C1 and C2.
-    for (uint64_t f7_position = 0; f7_position < res.final_entries_written; f7_position++) {
-        right_entry_buf = res.table7_sm->ReadEntry(plot_file_reader);
-
-        plot_file_reader += right_entry_size_bytes;
-        uint64_t entry_y = Util::SliceInt64FromBytes(right_entry_buf, 0, k);
-        uint64_t entry_new_pos = Util::SliceInt64FromBytes(right_entry_buf, k, pos_size);
-
-        Bits entry_y_bits = Bits(entry_y, k);
-
-        if (f7_position % kEntriesPerPark == 0 && f7_position > 0) {
-            memset(P7_entry_buf, 0, P7_park_size);
-            to_write_p7.ToBytes(P7_entry_buf);
-            tmp2_disk.Write(final_file_writer_3, (P7_entry_buf), P7_park_size);
-            final_file_writer_3 += P7_park_size;
-            to_write_p7 = ParkBits();
+    auto read_chunk = [&](Phase4Chunk &chunk, uint64_t const first_position) {
+        chunk.first_position = first_position;
+        chunk.num_entries =
+            std::min(kPhase4ChunkEntries, res.final_entries_written - first_position);
+        chunk.y.resize(chunk.num_entries);
+        chunk.new_pos.resize(chunk.num_entries);
+        for (uint64_t i = 0; i < chunk.num_entries; i++) {
+            uint8_t const *right_entry_buf = res.table7_sm->ReadEntry(plot_file_reader);
+            plot_file_reader += right_entry_size_bytes;
+            chunk.y[i] = Util::SliceInt64FromBytes(right_entry_buf, 0, k);
+            chunk.new_pos[i] = Util::SliceInt64FromBytes(right_entry_buf, k, pos_size);
+        }
+    };
+
+    // Encodes the P7 parks [park_begin, park_end) and the C3 entries of the C1 checkpoints
+    // [C1_begin, C1_end) of the chunk. C3 entries without deltas are left empty.
+    auto encode_chunk = [&](
+        Phase4Chunk const &chunk,
+        uint64_t const park_begin,
+        uint64_t const park_end,
+        uint64_t const C1_begin,
+        uint64_t const C1_end) {
+        // 7 bytes head-room for AppendBits()
+        std::unique_ptr<uint8_t[]> park_buf(new uint8_t[P7_park_size + 7]);
+        for (uint64_t park = park_begin; park < park_end; park++) {
+            uint64_t const begin = park * kEntriesPerPark;
+            uint64_t const end = std::min(begin + kEntriesPerPark, chunk.num_entries);
+            memset(park_buf.get(), 0, P7_park_size + 7);
+            uint32_t bit_pos = 0;
+            for (uint64_t i = begin; i < end; i++) {
+                Util::AppendBits(park_buf.get(), bit_pos, chunk.new_pos[i], k + 1);
+            }
+            memcpy(P7_buf.get() + park * P7_park_size, park_buf.get(), P7_park_size);
         }
 
-        to_write_p7 += ParkBits(entry_new_pos, k + 1);
-
-        if (f7_position % kCheckpoint1Interval == 0) {
-            entry_y_bits.ToBytes(C1_entry_buf);
-            tmp2_disk.Write(final_file_writer_1, (C1_entry_buf), Util::ByteAlign(k) / 8);
-            final_file_writer_1 += Util::ByteAlign(k) / 8;
-            if (num_C1_entries > 0) {
-                final_file_writer_2 = begin_byte_C3 + (num_C1_entries - 1) * size_C3;
-                size_t num_bytes =
-                    Encoding::ANSEncodeDeltas(deltas_to_write, kC3R, C3_entry_buf + 2) + 2;
+        std::vector<uint8_t> deltas;
+        std::unique_ptr<uint8_t[]> C3_entry_buf(new uint8_t[kCheckpoint1Interval * 8 + 2]);
+        for (uint64_t c = C1_begin; c < C1_end; c++) {
+            uint64_t const begin = c * kCheckpoint1Interval;
+            uint64_t const end = std::min(begin + kCheckpoint1Interval, chunk.num_entries);
+            deltas.clear();
+            for (uint64_t i = begin + 1; i < end; i++) {
+                deltas.push_back(chunk.y[i] - chunk.y[i - 1]);
+            }
+            uint8_t *C3_entry = C3_buf.get() + c * size_C3;
+            memset(C3_entry, 0, size_C3);
+            if (deltas.empty()) {
+                continue;
+            }
+            size_t num_bytes = Encoding::ANSEncodeDeltas(deltas, kC3R, C3_entry_buf.get() + 2);
 
-                // We need to be careful because deltas are variable sized, and they need to fit
-                assert(size_C3 * 8 > num_bytes);
+            // We need to be careful because deltas are variable sized, and they need to fit
+            if (num_bytes + 2 > size_C3) {
+                throw InvalidStateException(
+                    "Overflowed C3 entry, writing " + std::to_string(num_bytes + 2) +
+                    " bytes. Space: " + std::to_string(size_C3));
+            }
 
-                // Write the size
-                Util::IntToTwoBytes(C3_entry_buf, num_bytes - 2);
+            // Write the size
+            Util::IntToTwoBytes(C3_entry_buf.get(), num_bytes);
+            memcpy(C3_entry, C3_entry_buf.get(), num_bytes + 2);
+        }
+    };
+
+    auto write_chunk = [&](Phase4Chunk const &chunk) {
+        uint64_t const num_parks = cdiv(chunk.num_entries, kEntriesPerPark);
+        uint64_t const num_C1_entries = cdiv(chunk.num_entries, kCheckpoint1Interval);
+
+        std::vector<std::thread> workers;
+        for (uint32_t t = 1; t < threads; t++) {
+            workers.emplace_back(
+                encode_chunk,
+                std::cref(chunk),
+                num_parks * t / threads,
+                num_parks * (t + 1) / threads,
+                num_C1_entries * t / threads,
+                num_C1_entries * (t + 1) / threads);
+        }
+        encode_chunk(chunk, 0, num_parks / threads, 0, num_C1_entries / threads);
+        for (auto &w : workers) {
+            w.join();
+        }
 
-                tmp2_disk.Write(final_file_writer_2, (C3_entry_buf), num_bytes);
-                final_file_writer_2 += num_bytes;
-            }
-            prev_y = entry_y;
-            if (f7_position % (kCheckpoint1Interval * kCheckpoint2Interval) == 0) {
-                C2.emplace_back(std::move(entry_y_bits));
+        for (uint64_t c = 0; c < num_C1_entries; c++) {
+            Bits(chunk.y[c * kCheckpoint1Interval], k).ToBytes(C1_buf.get() + c * C1_entry_size);
+        }
+        uint64_t const first_park = chunk.first_position / kEntriesPerPark;
+        uint64_t const first_C1_entry = chunk.first_position / kCheckpoint1Interval;
+        tmp2_disk.Write(
+            res.final_table_begin_pointers[7] + first_park * P7_park_size,
+            P7_buf.get(),
+            num_parks * P7_park_size);
+        tmp2_disk.Write(
+            begin_byte_C1 + first_C1_entry * C1_entry_size,
+            C1_buf.get(),
+            num_C1_entries * C1_entry_size);
+
+        // Only the last C3 entry of the table can be without deltas, it isn't written
+        uint64_t num_C3_entries = num_C1_entries;
+        if (chunk.num_entries % kCheckpoint1Interval == 1) {
+            num_C3_entries--;
+        }
+        tmp2_disk.Write(
+            begin_byte_C3 + first_C1_entry * size_C3, C3_buf.get(), num_C3_entries * size_C3);
+    };
+
+    Phase4Chunk chunks[2];
+    std::future<void> pending_write;
+    for (uint64_t position = 0, current = 0; position < res.final_entries_written;
+         position += kPhase4ChunkEntries, current ^= 1) {
+        Phase4Chunk &chunk = chunks[current];
+        read_chunk(chunk, position);
+        uint64_t const chunk_end = position + chunk.num_entries;
+
+        for (uint64_t i = cdiv(position, kCheckpoint1Interval * kCheckpoint2Interval) *
+                          kCheckpoint1Interval * kCheckpoint2Interval;
+             i < chunk_end;
+             i += kCheckpoint1Interval * kCheckpoint2Interval) {
+            C2.emplace_back(chunk.y[i - position], k);
+        }
+        if (flags & SHOW_PROGRESS) {
+            for (; next_progress_update < chunk_end;
+                 next_progress_update += progress_update_increment) {
+                progress(4, next_progress_update, res.final_entries_written);
             }
-            deltas_to_write.clear();
-            ++num_C1_entries;
-        } else {
-            deltas_to_write.push_back(entry_y - prev_y);
-            prev_y = entry_y;
         }
-        if (flags & SHOW_PROGRESS && f7_position % progress_update_increment == 0) {
-            progress(4, f7_position, res.final_entries_written);
+
+        // The previous chunk has to be written before its buffers are reused
+        if (pending_write.valid()) {
+            pending_write.get();
         }
+        pending_write = std::async(std::launch::async, write_chunk, std::cref(chunk));
+    }
+    if (pending_write.valid()) {
+        pending_write.get();
     }
     Encoding::ANSFree(kC3R);
     res.table7_sm.reset();
 
-    // Writes the final park to disk
-    memset(P7_entry_buf, 0, P7_park_size);
-    to_write_p7.ToBytes(P7_entry_buf);
-
-    tmp2_disk.Write(final_file_writer_3, (P7_entry_buf), P7_park_size);
-    final_file_writer_3 += P7_park_size;
-
-    if (!deltas_to_write.empty()) {
-        size_t num_bytes = Encoding::ANSEncodeDeltas(deltas_to_write, kC3R, C3_entry_buf + 2);
-        memset(C3_entry_buf + num_bytes + 2, 0, size_C3 - (num_bytes + 2));
-        final_file_writer_2 = begin_byte_C3 + (num_C1_entries - 1) * size_C3;
-
-        // Write the size
-        Util::IntToTwoBytes(C3_entry_buf, num_bytes);
-
-        tmp2_disk.Write(final_file_writer_2, (C3_entry_buf), size_C3);
-        final_file_writer_2 += size_C3;
-        Encoding::ANSFree(kC3R);
+    if (res.final_entries_written == 0) {
+        // Writes the empty park
+        memset(P7_buf.get(), 0, P7_park_size);
+        tmp2_disk.Write(res.final_table_begin_pointers[7], P7_buf.get(), P7_park_size);
     }
+    final_file_writer_1 += total_C1_entries * C1_entry_size;
+    P7_buf.reset();
+    C1_buf.reset();
+    C3_buf.reset();
 
     Bits(0, Util::ByteAlign(k)).ToBytes(C1_entry_buf);
     tmp2_disk.Write(final_file_writer_1, (C1_entry_buf), Util::ByteAlign(k) / 8);
@@ -175,9 +275,7 @@ void RunPhase4(uint8_t k, uint8_t pos_size, FileDisk &tmp2_disk, Phase3Results &
     final_file_writer_1 += Util::ByteAlign(k) / 8;
     std::cout << "\tFinished writing C2 table" << std::endl;
 
-    delete[] C3_entry_buf;
     delete[] C1_entry_buf;
-    delete[] P7_entry_buf;
 
     final_file_writer_1 = res.header_size - 8 * 3;
     uint8_t table_pointer_bytes[8];
@@ -22,6 +22,14 @@
 enum phase_flags : uint8_t {
     ENABLE_BITFIELD = 1 << 0,
     SHOW_PROGRESS = 1 << 1,
+    // Keep the temporary files in RAM instead of the temp directories
+    TEMP_FILES_IN_MEMORY = 1 << 2,
+    // Read and write the files on disk through io_uring, where the kernel supports it
+    USE_IO_URING = 1 << 3,
+    // Open the files on disk with O_DIRECT, bypassing the page cache
+    DIRECT_IO = 1 << 4,
+    // Store the entries of the sort buckets bit-packed, instead of in whole bytes
+    PACKED_TEMP_FILES = 1 << 5,
 };
 
 #endif  // SRC_CPP_PHASES_HPP
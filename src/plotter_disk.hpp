@@ -56,7 +56,8 @@ public:
     // This method creates a plot on disk with the filename. Many temporary files
     // (filename + ".table1.tmp", filename + ".p2.t3.sort_bucket_4.tmp", etc.) are created
     // and their total size will be larger than the final plot file. Temp files are deleted at the
-    // end of the process.
+    // end of the process. With TEMP_FILES_IN_MEMORY in phases_flags, the temporary files are kept
+    // in RAM instead, and only the final plot file is written to disk.
     void CreatePlotDisk(
         std::string tmp_dirname,
         std::string tmp2_dirname,
@@ -106,8 +107,9 @@ public:
             throw InsufficientMemoryException("Please provide at least 10MiB of ram");
         }
 
-        // Subtract some ram to account for dynamic allocation through the code
-        uint64_t thread_memory = num_threads * (2 * (stripe_size + 5000)) *
+        // Subtract some ram to account for dynamic allocation through the code. Each phase 1
+        // thread has two stripes in flight, with a left and a right buffer each.
+        uint64_t thread_memory = num_threads * (4 * (stripe_size + 5000)) *
                                  EntrySizes::GetMaxEntrySize(k, 4, true) / (1024 * 1024);
         uint64_t sub_mbytes = (5 + (int)std::min(buf_megabytes * 0.05, (double)50) + thread_memory);
         if (sub_mbytes > buf_megabytes) {
@@ -162,7 +164,27 @@ public:
         std::cout << "Plot size is: " << static_cast<int>(k) << std::endl;
         std::cout << "Buffer size is: " << buf_megabytes << "MiB" << std::endl;
         std::cout << "Using " << num_buckets << " buckets" << std::endl;
+        bool const temp_in_memory = phases_flags & TEMP_FILES_IN_MEMORY;
+
         std::cout << "Final Directory is: " << final_dirname << std::endl;
+        if (temp_in_memory) {
+            std::cout << "Temporary files are kept in memory" << std::endl;
+        }
+        if (FileDisk::UseIoUring(phases_flags & USE_IO_URING)) {
+            std::cout << "Using io_uring for disk I/O"
+                      << (IoUring::Get()->RegisteredBuffers() ? " with registered buffers" : "")
+                      << std::endl;
+        } else if (phases_flags & USE_IO_URING) {
+            std::cout << "io_uring is not supported, using stdio for disk I/O" << std::endl;
+        }
+        if (FileDisk::UseDirectIo(phases_flags & DIRECT_IO)) {
+            std::cout << "Using O_DIRECT for disk I/O" << std::endl;
+        } else if (phases_flags & DIRECT_IO) {
+            std::cout << "O_DIRECT is not supported, using the page cache" << std::endl;
+        }
+        if (phases_flags & PACKED_TEMP_FILES) {
+            std::cout << "Sort buckets are stored bit-packed" << std::endl;
+        }
         std::cout << "Using " << (int)num_threads << " threads of stripe size " << stripe_size
                   << std::endl;
         std::cout << "Process ID is: " << ::getpid() << std::endl;
@@ -182,11 +204,11 @@ public:
         fs::path final_filename = fs::path(final_dirname) / fs::path(filename);
 
         // Check if the paths exist
-        if (!fs::exists(tmp_dirname)) {
+        if (!temp_in_memory && !fs::exists(tmp_dirname)) {
             throw InvalidValueException("Temp directory " + tmp_dirname + " does not exist");
         }
 
-        if (!fs::exists(tmp2_dirname)) {
+        if (!temp_in_memory && !fs::exists(tmp2_dirname)) {
             throw InvalidValueException("Temp2 directory " + tmp2_dirname + " does not exist");
         }
 
@@ -206,9 +228,9 @@ public:
             // Scope for FileDisk
             std::vector<FileDisk> tmp_1_disks;
             for (auto const& fname : tmp_1_filenames)
-                tmp_1_disks.emplace_back(fname);
+                tmp_1_disks.emplace_back(fname, temp_in_memory);
 
-            FileDisk tmp2_disk(tmp_2_filename);
+            FileDisk tmp2_disk(tmp_2_filename, temp_in_memory);
 
             assert(id_len == kIdLen);
 
@@ -305,6 +327,7 @@ public:
                     memory_size,
                     num_buckets,
                     log_num_buckets,
+                    num_threads,
                     phases_flags);
                 p2.PrintElapsed("Time for phase 2 =");
 
@@ -326,6 +349,7 @@ public:
                     memory_size,
                     num_buckets,
                     log_num_buckets,
+                    num_threads,
                     phases_flags);
                 p3.PrintElapsed("Time for phase 3 =");
 
@@ -333,7 +357,7 @@ public:
                       << "Starting phase 4/4: Write Checkpoint tables into " << tmp_2_filename
                       << " ... " << Timer::GetNow();
                 Timer p4;
-                RunPhase4(k, k + 1, tmp2_disk, res, phases_flags, 16);
+                RunPhase4(k, k + 1, tmp2_disk, res, num_threads, phases_flags, 16);
                 p4.PrintElapsed("Time for phase 4 =");
                 finalsize = res.final_table_begin_pointers[11];
             }
@@ -356,6 +380,25 @@ public:
                              (1024 * 1024 * 1024)
                       << " GiB" << std::endl;
             all_phases.PrintElapsed("Total time =");
+
+            if (temp_in_memory) {
+                // The plot only exists in memory so far, so write it out next to the final
+                // file. It is renamed to the final file below.
+                Timer copy;
+                fs::remove(final_2_filename);
+                FileDisk final_2_disk(final_2_filename);
+                uint64_t const plot_size = tmp2_disk.GetWriteMax();
+                uint64_t const copy_buf_size = 1 << 22;
+                std::unique_ptr<uint8_t[]> copy_buf(new uint8_t[copy_buf_size]);
+                for (uint64_t pos = 0; pos < plot_size; pos += copy_buf_size) {
+                    uint64_t const length = std::min(copy_buf_size, plot_size - pos);
+                    tmp2_disk.Read(pos, copy_buf.get(), length);
+                    final_2_disk.Write(pos, copy_buf.get(), length);
+                }
+                tmp2_disk.Remove();
+                std::cout << "Wrote final file from memory to " << final_2_filename << std::endl;
+                copy.PrintElapsed("Copy time =");
+            }
         }
 
         std::cin.tie(prevstr);
@@ -365,12 +408,13 @@ public:
             fs::remove(p);
         }
 
-        bool bCopied = false;
+        // Temporary files in memory have already been written to final_2_filename
+        bool bCopied = temp_in_memory;
         bool bRenamed = false;
         Timer copy;
         do {
             std::error_code ec;
-            if (tmp_2_filename.parent_path() == final_filename.parent_path()) {
+            if (!temp_in_memory && tmp_2_filename.parent_path() == final_filename.parent_path()) {
                 fs::rename(tmp_2_filename, final_filename, ec);
                 if (ec.value() != 0) {
                     std::cout << "Could not rename " << tmp_2_filename << " to " << final_filename
@@ -16,16 +16,19 @@
 #define SRC_CPP_PROVER_DISK_HPP_
 
 #ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #endif
 #include <stdio.h>
 
 #include <algorithm>  // std::min
 #include <fstream>
-#include <future>
 #include <iostream>
-#include <mutex>
+#include <memory>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -33,6 +36,8 @@
 #include "calculate_bucket.hpp"
 #include "encoding.hpp"
 #include "entry_sizes.hpp"
+#include "park_cache.hpp"
+#include "thread_pool.hpp"
 #include "util.hpp"
 
 struct plot_header {
@@ -43,14 +48,31 @@ struct plot_header {
     uint8_t fmt_desc[50];
 };
 
+enum prover_flags : uint8_t {
+    // Map the plot file into memory once, and read the tables from the mapping instead of
+    // opening a stream for every lookup. Not supported on Windows, where it is ignored.
+    MMAP_PLOT = 1 << 0,
+    // Keep the C1 table in memory, instead of reading it for every lookup. Costs 8 bytes per
+    // kCheckpoint1Interval entries of table 7.
+    RESIDENT_C1 = 1 << 1,
+    // Keep the encoded C3 deltas in memory, so a lookup only reads the P7 park. Costs about
+    // 0.25 bytes per entry of table 7.
+    RESIDENT_C3 = 1 << 2,
+};
 
 // The DiskProver, given a correctly formatted plot file, can efficiently generate valid proofs
-// of space, for a given challenge.
+// of space, for a given challenge. Everything the lookups use is set up by the constructor, and
+// only read afterwards, so any number of threads may look up proofs at the same time. Each
+// lookup reads the plot through its own Reader.
 class DiskProver {
 public:
     // The constructor opens the file, and reads the contents of the file header. The table pointers
-    // will be used to find and seek to all seven tables, at the time of proving.
-    explicit DiskProver(const std::string& filename)
+    // will be used to find and seek to all seven tables, at the time of proving. With a
+    // park_cache_size, up to that many bytes of decoded parks are kept for later lookups.
+    explicit DiskProver(
+        const std::string& filename,
+        uint8_t const flags = 0,
+        uint64_t const park_cache_size = 0)
     {
         struct plot_header header{};
         this->filename = filename;
@@ -117,11 +139,33 @@ public:
         }
 
         delete[] c2_buf;
+
+        for (int i = 0; i < 6; i++) {
+            park_dtables[i] = Encoding::ANSGetDTable(kRValues[i]);
+        }
+        C3_dtable = Encoding::ANSGetDTable(kC3R);
+
+        if (flags & MMAP_PLOT) {
+            MapFile();
+        }
+        if (flags & (RESIDENT_C1 | RESIDENT_C3)) {
+            LoadResidentTables(flags);
+        }
+        if (park_cache_size > 0) {
+            park_cache.reset(new ParkCache(park_cache_size));
+        }
     }
 
+    DiskProver(DiskProver const&) = delete;
+    DiskProver& operator=(DiskProver const&) = delete;
+
     ~DiskProver()
     {
-        std::lock_guard<std::mutex> l(_mtx);
+#ifndef _WIN32
+        if (mapping != nullptr) {
+            munmap(mapping, mapping_size);
+        }
+#endif
         delete[] this->memo;
         for (int i = 0; i < 6; i++) {
             Encoding::ANSFree(kRValues[i]);
@@ -137,23 +181,31 @@ public:
 
     std::string GetFilename() const noexcept { return filename; }
 
+    // Bytes of memory used by the tables kept in memory with RESIDENT_C1 and RESIDENT_C3
+    uint64_t GetResidentSize() const noexcept
+    {
+        return C1.size() * sizeof(uint64_t) + C3.size() + C3_offsets.size() * sizeof(uint64_t);
+    }
+
     uint8_t GetSize() const noexcept { return k; }
 
+    // Lookups of parks that were, and were not, in the park cache
+    uint64_t GetParkCacheHits() const noexcept { return park_cache ? park_cache->GetHits() : 0; }
+
+    uint64_t GetParkCacheMisses() const noexcept
+    {
+        return park_cache ? park_cache->GetMisses() : 0;
+    }
+
     // Given a challenge, returns a quality string, which is sha256(challenge + 2 adjecent x
     // values), from the 64 value proof. Note that this is more efficient than fetching all 64 x
     // values, which are in different parts of the disk.
-    std::vector<LargeBits> GetQualitiesForChallenge(const uint8_t* challenge)
+    std::vector<LargeBits> GetQualitiesForChallenge(const uint8_t* challenge) const
     {
         std::vector<LargeBits> qualities;
 
-        std::lock_guard<std::mutex> l(_mtx);
-
         {
-            std::ifstream disk_file(filename, std::ios::in | std::ios::binary);
-
-            if (!disk_file.is_open()) {
-                throw std::invalid_argument("Invalid file " + filename);
-            }
+            Reader disk_file(*this);
 
             // This tells us how many f7 outputs (and therefore proofs) we have for this
             // challenge. The expected value is one proof.
@@ -201,17 +253,12 @@ public:
     // Given a challenge, and an index, returns a proof of space. This assumes GetQualities was
     // called, and there are actually proofs present. The index represents which proof to fetch,
     // if there are multiple.
-    LargeBits GetFullProof(const uint8_t* challenge, uint32_t index)
+    LargeBits GetFullProof(const uint8_t* challenge, uint32_t index) const
     {
         LargeBits full_proof;
 
-        std::lock_guard<std::mutex> l(_mtx);
         {
-            std::ifstream disk_file(filename, std::ios::in | std::ios::binary);
-
-            if (!disk_file.is_open()) {
-                throw std::invalid_argument("Invalid file " + filename);
-            }
+            Reader disk_file(*this);
 
             std::vector<uint64_t> p7_entries = GetP7Entries(disk_file, challenge);
             if (p7_entries.empty() || index >= p7_entries.size()) {
@@ -219,7 +266,7 @@ public:
             }
 
             // Gets the 64 leaf x values, concatenated together into a k*64 bit string.
-            std::vector<Bits> xs = GetInputs(p7_entries[index], 6);
+            std::vector<Bits> xs = GetInputs(disk_file, p7_entries[index]);
 
             // Sorts them according to proof ordering, where
             // f1(x0) m= f1(x1), f2(x0, x1) m= f2(x2, x3), etc. On disk, they are not stored in
@@ -234,7 +281,6 @@ public:
     }
 
 private:
-    mutable std::mutex _mtx;
     std::string filename;
     uint32_t memo_size;
     uint8_t* memo;
@@ -242,6 +288,94 @@ private:
     uint8_t k;
     std::vector<uint64_t> table_begin_pointers;
     std::vector<uint64_t> C2;
+    // The tables to decode the deltas of the parks of tables 1 to 6, and of C3
+    const FSE_DTable* park_dtables[6]{};
+    const FSE_DTable* C3_dtable = nullptr;
+    // The values of all C1 entries, with RESIDENT_C1
+    std::vector<uint64_t> C1;
+    // The encoded deltas of all C3 entries, back to back, with RESIDENT_C3
+    std::vector<uint8_t> C3;
+    std::vector<uint64_t> C3_offsets;
+    // The whole plot file, with MMAP_PLOT
+    uint8_t* mapping = nullptr;
+    uint64_t mapping_size = 0;
+    // The recently decoded parks, if the cache is enabled
+    std::unique_ptr<ParkCache> park_cache;
+    // The table that C3 entries are kept as in the park cache, the index of its table pointer
+    static const uint8_t kC3ParkTable = 10;
+
+    // Reads parts of the plot file during a lookup. Without a mapping, a stream is opened for
+    // the lookup, and the parts are read into the caller's buffers.
+    class Reader {
+    public:
+        explicit Reader(DiskProver const& prover)
+            : mapping_(prover.mapping), mapping_size_(prover.mapping_size)
+        {
+            if (mapping_ == nullptr) {
+                disk_file_.open(prover.filename, std::ios::in | std::ios::binary);
+                if (!disk_file_.is_open()) {
+                    throw std::invalid_argument("Invalid file " + prover.filename);
+                }
+            }
+        }
+
+        // Returns the size bytes at offset in the plot file. These are read into buffer, or,
+        // if the file is mapped, the result points into the mapping and buffer is not used.
+        const uint8_t* Read(uint64_t offset, uint8_t* buffer, uint64_t size)
+        {
+            if (mapping_ == nullptr) {
+                SafeSeek(disk_file_, offset);
+                SafeRead(disk_file_, buffer, size);
+                return buffer;
+            }
+            if (offset > mapping_size_ || size > mapping_size_ - offset) {
+                throw std::runtime_error(
+                    "reading size " + std::to_string(size) + " at position " +
+                    std::to_string(offset) + " past the end of the plot");
+            }
+            return mapping_ + offset;
+        }
+
+    private:
+        const uint8_t* mapping_;
+        uint64_t mapping_size_;
+        std::ifstream disk_file_;
+    };
+
+    // Maps the plot file. Lookups read single parks at random places in the file, so
+    // read-ahead is turned off, except for the checkpoint tables, which every lookup uses.
+    void MapFile()
+    {
+#ifndef _WIN32
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::invalid_argument("Invalid file " + filename);
+        }
+        struct stat st {};
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw std::runtime_error("Could not stat " + filename);
+        }
+        void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED) {
+            throw std::runtime_error("Could not map " + filename);
+        }
+        mapping = static_cast<uint8_t*>(addr);
+        mapping_size = st.st_size;
+
+        madvise(mapping, mapping_size, MADV_RANDOM);
+        uint64_t const page_size = sysconf(_SC_PAGESIZE);
+        uint64_t const checkpoints_begin = table_begin_pointers[8] / page_size * page_size;
+        if (table_begin_pointers[10] > checkpoints_begin &&
+            table_begin_pointers[10] <= mapping_size) {
+            madvise(
+                mapping + checkpoints_begin,
+                table_begin_pointers[10] - checkpoints_begin,
+                MADV_WILLNEED);
+        }
+#endif
+    }
 
     // Using this method instead of simply seeking will prevent segfaults that would arise when
     // continuing the process of looking up qualities.
@@ -279,91 +413,342 @@ private:
     // The entry at index "position" is read. First, the park index is calculated, then
     // the park is read, and finally, entry deltas are added up to the position that we
     // are looking for.
-    uint128_t ReadLinePoint(std::ifstream& disk_file, uint8_t table_index, uint64_t position)
+    uint128_t ReadLinePoint(Reader& disk_file, uint8_t table_index, uint64_t position) const
+    {
+        return ReadLinePoints(disk_file, table_index, {position})[0];
+    }
+
+    // Reads the line points at the given positions of a table. Every park is read once, parks
+    // next to each other with a single read, in file order. The parks are then decoded on the
+    // prover's thread pool. Parks in the park cache are neither read nor decoded.
+    std::vector<uint128_t> ReadLinePoints(
+        Reader& disk_file,
+        uint8_t table_index,
+        std::vector<uint64_t> const& positions) const
     {
-        uint64_t park_index = position / kEntriesPerPark;
-        uint32_t park_size_bits = EntrySizes::CalculateParkSize(k, table_index) * 8;
+        uint32_t park_size_bytes = EntrySizes::CalculateParkSize(k, table_index);
+
+        std::vector<uint32_t> order(positions.size());
+        for (uint32_t i = 0; i < order.size(); i++) {
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            return positions[a] < positions[b];
+        });
+
+        // The parks to read, and which of the positions are in each of them
+        std::vector<uint64_t> parks;
+        std::vector<std::vector<uint32_t>> park_positions;
+        for (uint32_t i : order) {
+            uint64_t const park_index = positions[i] / kEntriesPerPark;
+            if (parks.empty() || parks.back() != park_index) {
+                parks.push_back(park_index);
+                park_positions.emplace_back();
+            }
+            park_positions.back().push_back(i);
+        }
+
+        std::vector<std::shared_ptr<const DecodedPark>> cached(parks.size());
+        if (park_cache) {
+            for (size_t j = 0; j < parks.size(); j++) {
+                cached[j] = park_cache->Get(table_index, parks[j]);
+            }
+        }
 
-        SafeSeek(disk_file, table_begin_pointers[table_index] + (park_size_bits / 8) * park_index);
+        std::vector<uint8_t> parks_buf(parks.size() * park_size_bytes);
+        std::vector<const uint8_t*> park_data(parks.size());
+        for (size_t first = 0; first < parks.size();) {
+            if (cached[first]) {
+                first++;
+                continue;
+            }
+            size_t end = first + 1;
+            while (end < parks.size() && !cached[end] && parks[end] == parks[end - 1] + 1) {
+                end++;
+            }
+            const uint8_t* data = disk_file.Read(
+                table_begin_pointers[table_index] + park_size_bytes * parks[first],
+                parks_buf.data() + first * park_size_bytes,
+                (end - first) * park_size_bytes);
+            for (size_t j = first; j < end; j++) {
+                park_data[j] = data + (j - first) * park_size_bytes;
+            }
+            first = end;
+        }
+
+        std::vector<uint128_t> line_points(positions.size());
+        GetThreadPool().ParallelFor(parks.size(), [&](uint64_t j) {
+            std::shared_ptr<const DecodedPark> park = cached[j];
+            if (!park) {
+                park = DecodePark(park_data[j], table_index);
+                if (park_cache) {
+                    park_cache->Put(table_index, parks[j], park);
+                }
+            }
+            std::vector<uint32_t> entries;
+            std::vector<uint128_t> park_line_points(park_positions[j].size());
+            for (uint32_t i : park_positions[j]) {
+                entries.push_back(positions[i] % kEntriesPerPark);
+            }
+            GetLinePoints(*park, entries.data(), entries.size(), park_line_points.data());
+            for (size_t e = 0; e < entries.size(); e++) {
+                line_points[park_positions[j][e]] = park_line_points[e];
+            }
+        });
+        return line_points;
+    }
+
+    // Decodes a park of table_index: the line point at its beginning, and the deltas. The stubs
+    // are kept as they are.
+    std::shared_ptr<const DecodedPark> DecodePark(const uint8_t* park, uint8_t table_index) const
+    {
+        auto decoded = std::make_shared<DecodedPark>();
 
-        // This is the checkpoint at the beginning of the park
+        // This is the checkpoint at the beginning of the park. Its parts are followed by the
+        // rest of the park, so they can be sliced without padding.
         uint16_t line_point_size = EntrySizes::CalculateLinePointSize(k);
-        auto* line_point_bin = new uint8_t[line_point_size + 7];
-        SafeRead(disk_file, line_point_bin, line_point_size);
-        uint128_t line_point = Util::SliceInt128FromBytes(line_point_bin, 0, k * 2);
+        decoded->line_point = Util::SliceInt128FromBytes(park, 0, k * 2);
 
         // Reads EPP stubs
-        uint32_t stubs_size_bits = EntrySizes::CalculateStubsSize(k) * 8;
-        auto* stubs_bin = new uint8_t[stubs_size_bits / 8 + 7];
-        SafeRead(disk_file, stubs_bin, stubs_size_bits / 8);
+        const uint8_t* stubs_bin = park + line_point_size;
+        uint32_t stubs_size = EntrySizes::CalculateStubsSize(k);
+        decoded->bits.resize(stubs_size + 7);
+        memcpy(decoded->bits.data(), stubs_bin, stubs_size);
 
         // Reads EPP deltas
         uint32_t max_deltas_size_bits = EntrySizes::CalculateMaxDeltasSize(k, table_index) * 8;
-        auto* deltas_bin = new uint8_t[max_deltas_size_bits / 8];
 
         // Reads the size of the encoded deltas object
         uint16_t encoded_deltas_size = 0;
-        SafeRead(disk_file, (uint8_t*)&encoded_deltas_size, sizeof(uint16_t));
+        memcpy(&encoded_deltas_size, stubs_bin + stubs_size, sizeof(uint16_t));
+        const uint8_t* deltas_bin = stubs_bin + stubs_size + sizeof(uint16_t);
 
         if (encoded_deltas_size * 8 > max_deltas_size_bits) {
             throw std::invalid_argument("Invalid size for deltas: " + std::to_string(encoded_deltas_size));
         }
 
-        std::vector<uint8_t> deltas;
-
         if (0x8000 & encoded_deltas_size) {
             // Uncompressed
             encoded_deltas_size &= 0x7fff;
-            deltas.resize(encoded_deltas_size);
-            SafeRead(disk_file, deltas.data(), encoded_deltas_size);
+            decoded->deltas.assign(deltas_bin, deltas_bin + encoded_deltas_size);
         } else {
             // Compressed
-            SafeRead(disk_file, deltas_bin, encoded_deltas_size);
-
             // Decodes the deltas
-            double R = kRValues[table_index - 1];
-            deltas =
-                Encoding::ANSDecodeDeltas(deltas_bin, encoded_deltas_size, kEntriesPerPark - 1, R);
+            decoded->deltas = Encoding::ANSDecodeDeltas(
+                deltas_bin, encoded_deltas_size, kEntriesPerPark - 1, park_dtables[table_index - 1]);
         }
+        return decoded;
+    }
 
-        uint32_t start_bit = 0;
+    // Gets the line points of the given entries of a decoded park, which must be in ascending
+    // order. The stubs and deltas are added up in a single pass for all of the entries.
+    void GetLinePoints(
+        DecodedPark const& park,
+        const uint32_t* entries,
+        size_t num_entries,
+        uint128_t* line_points) const
+    {
         uint8_t stub_size = k - kStubMinusBits;
+        uint32_t i = 0;
+        uint32_t start_bit = 0;
         uint64_t sum_deltas = 0;
         uint64_t sum_stubs = 0;
-        for (uint32_t i = 0;
-             i < std::min((uint32_t)(position % kEntriesPerPark), (uint32_t)deltas.size());
-             i++) {
-            uint64_t stub = Util::EightBytesToInt(stubs_bin + start_bit / 8);
-            stub <<= start_bit % 8;
-            stub >>= 64 - stub_size;
+        for (size_t e = 0; e < num_entries; e++) {
+            for (; i < std::min(entries[e], (uint32_t)park.deltas.size()); i++) {
+                sum_stubs += Util::SliceInt64FromBytes(park.bits.data(), start_bit, stub_size);
+                start_bit += stub_size;
+                sum_deltas += park.deltas[i];
+            }
+
+            uint128_t big_delta = ((uint128_t)sum_deltas << stub_size) + sum_stubs;
+            line_points[e] = park.line_point + big_delta;
+        }
+    }
+
+    // The threads that decode parks, shared by all provers
+    static ThreadPool& GetThreadPool()
+    {
+        static ThreadPool pool(std::max(std::thread::hardware_concurrency(), 2U) - 1);
+        return pool;
+    }
+
+    // Number of C1 entries, including the final entry of zero
+    uint64_t GetNumC1Entries() const
+    {
+        return (table_begin_pointers[9] - table_begin_pointers[8]) / (Util::ByteAlign(k) / 8);
+    }
+
+    // The k bit value of a C1 entry
+    uint64_t C1Value(const uint8_t* entry) const
+    {
+        uint32_t const entry_size = Util::ByteAlign(k) / 8;
+        uint64_t value = 0;
+        for (uint32_t i = 0; i < entry_size; i++) {
+            value = (value << 8) | entry[i];
+        }
+        return value >> (entry_size * 8 - k);
+    }
+
+    // Reads the values of count C1 entries, starting at c1_index
+    std::vector<uint64_t> ReadC1Entries(Reader& disk_file, uint64_t c1_index, uint64_t count) const
+    {
+        uint32_t const c1_entry_size = Util::ByteAlign(k) / 8;
+        std::vector<uint8_t> buf(count * c1_entry_size);
+        const uint8_t* entries = disk_file.Read(
+            table_begin_pointers[8] + c1_index * c1_entry_size, buf.data(), buf.size());
+        std::vector<uint64_t> values(count);
+        for (uint64_t i = 0; i < count; i++) {
+            values[i] = C1Value(entries + i * c1_entry_size);
+        }
+        return values;
+    }
 
-            sum_stubs += stub;
-            start_bit += stub_size;
-            sum_deltas += deltas[i];
+    // The deltas of a C3 entry, as encoded on disk
+    struct C3Entry {
+        const uint8_t* bit_mask = nullptr;
+        uint16_t encoded_size = 0;
+    };
+
+    // Gets the count C3 entries, starting at the one of C1 entry c1_index. Unless C3 is
+    // resident, they are read at once, buffer must have room for all of them.
+    void GetC3Entries(
+        Reader& disk_file,
+        uint64_t c1_index,
+        uint32_t count,
+        uint8_t* buffer,
+        C3Entry* entries) const
+    {
+        if (!C3_offsets.empty()) {
+            for (uint32_t i = 0; i < count; i++) {
+                if (c1_index + i + 1 >= C3_offsets.size()) {
+                    throw std::runtime_error(
+                        "C3 entry " + std::to_string(c1_index + i) + " is not in the plot");
+                }
+                entries[i].bit_mask = C3.data() + C3_offsets[c1_index + i];
+                entries[i].encoded_size =
+                    C3_offsets[c1_index + i + 1] - C3_offsets[c1_index + i];
+            }
+            return;
+        }
+        uint32_t const c3_entry_size = EntrySizes::CalculateC3Size(k);
+        const uint8_t* c3 = disk_file.Read(
+            table_begin_pointers[10] + c1_index * c3_entry_size, buffer, count * c3_entry_size);
+        for (uint32_t i = 0; i < count; i++) {
+            entries[i].encoded_size = Bits(c3 + i * c3_entry_size, 2, 16).GetValue();
+            entries[i].bit_mask = c3 + i * c3_entry_size + 2;
+        }
+    }
+
+    // Loads the tables asked for by RESIDENT_C1 and RESIDENT_C3
+    void LoadResidentTables(uint8_t const flags)
+    {
+        Reader disk_file(*this);
+        uint64_t const num_c1_entries = GetNumC1Entries();
+        if (flags & RESIDENT_C1) {
+            C1 = ReadC1Entries(disk_file, 0, num_c1_entries);
+        }
+        if (!(flags & RESIDENT_C3) || num_c1_entries == 0) {
+            return;
         }
 
-        uint128_t big_delta = ((uint128_t)sum_deltas << stub_size) + sum_stubs;
-        uint128_t final_line_point = line_point + big_delta;
+        // There is a C3 entry for every C1 entry, but the final one. Only the encoded deltas of
+        // each entry are kept, C3_offsets[i] is where those of entry i start.
+        uint32_t const c3_entry_size = EntrySizes::CalculateC3Size(k);
+        uint64_t const num_c3_entries = num_c1_entries - 1;
+        // The last entry is not written if it has no deltas
+        uint64_t const c3_end = std::min(
+            GetFileSize(), table_begin_pointers[10] + num_c3_entries * c3_entry_size);
+        uint64_t const batch_entries = 1024;
+        std::vector<uint8_t> buf(batch_entries * c3_entry_size);
+
+        C3_offsets.reserve(num_c3_entries + 1);
+        C3_offsets.push_back(0);
+        for (uint64_t first = 0; first < num_c3_entries; first += batch_entries) {
+            uint64_t const begin = table_begin_pointers[10] + first * c3_entry_size;
+            uint64_t const count = std::min(batch_entries, num_c3_entries - first);
+            uint64_t const size =
+                std::min(count * c3_entry_size, c3_end > begin ? c3_end - begin : 0);
+            const uint8_t* c3 = size > 0 ? disk_file.Read(begin, buf.data(), size) : nullptr;
+            for (uint64_t i = 0; i < count; i++) {
+                uint64_t const entry_begin = i * c3_entry_size;
+                uint64_t encoded_size = 0;
+                if (entry_begin + 2 <= size) {
+                    encoded_size = Bits(c3 + entry_begin, 2, 16).GetValue();
+                    // Corrupt sizes fail to decode, like they do from disk
+                    encoded_size = std::min<uint64_t>(
+                        encoded_size, std::min<uint64_t>(c3_entry_size, size - entry_begin) - 2);
+                    C3.insert(
+                        C3.end(),
+                        c3 + entry_begin + 2,
+                        c3 + entry_begin + 2 + encoded_size);
+                }
+                C3_offsets.push_back(C3_offsets.back() + encoded_size);
+            }
+        }
+        C3.shrink_to_fit();
+    }
+
+    uint64_t GetFileSize() const
+    {
+        if (mapping != nullptr) {
+            return mapping_size;
+        }
+        std::ifstream disk_file(filename, std::ios::in | std::ios::binary | std::ios::ate);
+        if (!disk_file.is_open()) {
+            throw std::invalid_argument("Invalid file " + filename);
+        }
+        return disk_file.tellg();
+    }
 
-        delete[] line_point_bin;
-        delete[] stubs_bin;
-        delete[] deltas_bin;
+    // Gets the decoded deltas of count C3 entries, starting at the one of C1 entry c1_index.
+    // Entries that are not in the park cache are read at once, and decoded.
+    std::vector<std::shared_ptr<const DecodedPark>> GetC3Deltas(
+        Reader& disk_file,
+        uint64_t c1_index,
+        uint32_t count) const
+    {
+        std::vector<std::shared_ptr<const DecodedPark>> c3(count);
+        if (park_cache) {
+            bool all_cached = true;
+            for (uint32_t i = 0; i < count; i++) {
+                c3[i] = park_cache->Get(kC3ParkTable, c1_index + i);
+                all_cached = all_cached && c3[i];
+            }
+            if (all_cached) {
+                return c3;
+            }
+        }
 
-        return final_line_point;
+        std::vector<uint8_t> c3_buf(count * EntrySizes::CalculateC3Size(k));
+        std::vector<C3Entry> c3_entries(count);
+        GetC3Entries(disk_file, c1_index, count, c3_buf.data(), c3_entries.data());
+        for (uint32_t i = 0; i < count; i++) {
+            if (c3[i]) {
+                continue;
+            }
+            auto decoded = std::make_shared<DecodedPark>();
+            decoded->deltas = Encoding::ANSDecodeDeltas(
+                c3_entries[i].bit_mask,
+                c3_entries[i].encoded_size,
+                kCheckpoint1Interval,
+                C3_dtable);
+            if (park_cache) {
+                park_cache->Put(kC3ParkTable, c1_index + i, decoded);
+            }
+            c3[i] = std::move(decoded);
+        }
+        return c3;
     }
 
-    // Gets the P7 positions of the target f7 entries. Uses the C3 encoded bitmask read from disk.
-    // A C3 park is a list of deltas between p7 entries, ANS encoded.
+    // Gets the P7 positions of the target f7 entries. Uses the deltas of the C3 entry of C1
+    // entry c1_index. A C3 park is a list of deltas between p7 entries, ANS encoded.
     std::vector<uint64_t> GetP7Positions(
         uint64_t curr_f7,
         uint64_t f7,
         uint64_t curr_p7_pos,
-        uint8_t* bit_mask,
-        uint16_t encoded_size,
+        const std::vector<uint8_t>& deltas,
         uint64_t c1_index) const
     {
-        std::vector<uint8_t> deltas =
-            Encoding::ANSDecodeDeltas(bit_mask, encoded_size, kCheckpoint1Interval, kC3R);
         std::vector<uint64_t> p7_positions;
         bool surpassed_f7 = false;
         for (uint8_t delta : deltas) {
@@ -395,7 +780,7 @@ private:
     }
 
     // Returns P7 table entries (which are positions into table P6), for a given challenge
-    std::vector<uint64_t> GetP7Entries(std::ifstream& disk_file, const uint8_t* challenge)
+    std::vector<uint64_t> GetP7Entries(Reader& disk_file, const uint8_t* challenge) const
     {
         if (C2.empty()) {
             return std::vector<uint64_t>();
@@ -430,19 +815,25 @@ private:
             c1_index -= kCheckpoint2Interval;
         }
 
-        uint32_t c1_entry_size = Util::ByteAlign(k) / 8;
-
-        auto* c1_entry_bytes = new uint8_t[c1_entry_size];
-        SafeSeek(disk_file, table_begin_pointers[8] + c1_index * Util::ByteAlign(k) / 8);
+        // The C1 entries of the C2 checkpoint. The C1 table ends with an entry of zero, so the
+        // loop below stops before the end of them.
+        uint64_t c1_entries =
+            std::min<uint64_t>(kCheckpoint1Interval, GetNumC1Entries() - c1_index);
+        std::vector<uint64_t> c1_read;
+        const uint64_t* c1_values;
+        if (!C1.empty()) {
+            c1_values = C1.data() + c1_index;
+        } else {
+            c1_read = ReadC1Entries(disk_file, c1_index, c1_entries);
+            c1_values = c1_read.data();
+        }
 
         uint64_t curr_f7 = c2_entry_f;
         uint64_t prev_f7 = c2_entry_f;
         broke = false;
         // Goes through C2 entries until we find the correct C1 checkpoint.
-        for (uint64_t start = 0; start < kCheckpoint1Interval; start++) {
-            SafeRead(disk_file, c1_entry_bytes, c1_entry_size);
-            Bits c1_entry = Bits(c1_entry_bytes, Util::ByteAlign(k) / 8, Util::ByteAlign(k));
-            uint64_t read_f7 = c1_entry.Slice(0, k).GetValue();
+        for (uint64_t start = 0; start < c1_entries; start++) {
+            uint64_t read_f7 = c1_values[start];
 
             if (start != 0 && read_f7 == 0) {
                 // We have hit the end of the checkpoint list
@@ -466,96 +857,84 @@ private:
             c1_index -= 1;
         }
 
-        uint32_t c3_entry_size = EntrySizes::CalculateC3Size(k);
-        auto* bit_mask = new uint8_t[c3_entry_size];
-
         // Double entry means that our entries are in more than one checkpoint park.
         bool double_entry = f7 == curr_f7 && c1_index > 0;
 
         uint64_t next_f7;
-        uint8_t encoded_size_buf[2];
-        uint16_t encoded_size;
         std::vector<uint64_t> p7_positions;
         int64_t curr_p7_pos = c1_index * kCheckpoint1Interval;
 
         if (double_entry) {
             // In this case, we read the previous park as well as the current one
             c1_index -= 1;
-            SafeSeek(disk_file, table_begin_pointers[8] + c1_index * Util::ByteAlign(k) / 8);
-            SafeRead(disk_file, c1_entry_bytes, Util::ByteAlign(k) / 8);
-            Bits c1_entry_bits = Bits(c1_entry_bytes, Util::ByteAlign(k) / 8, Util::ByteAlign(k));
             next_f7 = curr_f7;
-            curr_f7 = c1_entry_bits.Slice(0, k).GetValue();
-
-            SafeSeek(disk_file, table_begin_pointers[10] + c1_index * c3_entry_size);
+            curr_f7 = C1.empty() ? ReadC1Entries(disk_file, c1_index, 1)[0] : C1[c1_index];
 
-            SafeRead(disk_file, encoded_size_buf, 2);
-            encoded_size = Bits(encoded_size_buf, 2, 16).GetValue();
-            SafeRead(disk_file, bit_mask, c3_entry_size - 2);
+            auto c3 = GetC3Deltas(disk_file, c1_index, 2);
 
-            p7_positions =
-                GetP7Positions(curr_f7, f7, curr_p7_pos, bit_mask, encoded_size, c1_index);
-
-            SafeRead(disk_file, encoded_size_buf, 2);
-            encoded_size = Bits(encoded_size_buf, 2, 16).GetValue();
-            SafeRead(disk_file, bit_mask, c3_entry_size - 2);
+            p7_positions = GetP7Positions(curr_f7, f7, curr_p7_pos, c3[0]->deltas, c1_index);
 
             c1_index++;
             curr_p7_pos = c1_index * kCheckpoint1Interval;
             auto second_positions =
-                GetP7Positions(next_f7, f7, curr_p7_pos, bit_mask, encoded_size, c1_index);
+                GetP7Positions(next_f7, f7, curr_p7_pos, c3[1]->deltas, c1_index);
             p7_positions.insert(
                 p7_positions.end(), second_positions.begin(), second_positions.end());
 
         } else {
-            SafeSeek(disk_file, table_begin_pointers[10] + c1_index * c3_entry_size);
-            SafeRead(disk_file, encoded_size_buf, 2);
-            encoded_size = Bits(encoded_size_buf, 2, 16).GetValue();
-            SafeRead(disk_file, bit_mask, c3_entry_size - 2);
+            auto c3 = GetC3Deltas(disk_file, c1_index, 1);
 
-            p7_positions =
-                GetP7Positions(curr_f7, f7, curr_p7_pos, bit_mask, encoded_size, c1_index);
+            p7_positions = GetP7Positions(curr_f7, f7, curr_p7_pos, c3[0]->deltas, c1_index);
         }
 
         // p7_positions is a list of all the positions into table P7, where the output is equal to
         // f7. If it's empty, no proofs are present for this f7.
         if (p7_positions.empty()) {
-            delete[] bit_mask;
-            delete[] c1_entry_bytes;
             return std::vector<uint64_t>();
         }
 
-        uint64_t p7_park_size_bytes = Util::ByteAlign((k + 1) * kEntriesPerPark) / 8;
-
-        std::vector<uint64_t> p7_entries;
-
         // Given the p7 positions, which are all adjacent, we can read the pos6 values from table
         // P7.
-        auto* p7_park_buf = new uint8_t[p7_park_size_bytes];
-        uint64_t park_index = (p7_positions[0] == 0 ? 0 : p7_positions[0]) / kEntriesPerPark;
-        SafeSeek(disk_file, table_begin_pointers[7] + park_index * p7_park_size_bytes);
-        SafeRead(disk_file, p7_park_buf, p7_park_size_bytes);
-        ParkBits p7_park = ParkBits(p7_park_buf, p7_park_size_bytes, p7_park_size_bytes * 8);
-        for (uint64_t i = 0; i < p7_positions[p7_positions.size() - 1] - p7_positions[0] + 1; i++) {
-            uint64_t new_park_index = (p7_positions[i]) / kEntriesPerPark;
-            if (new_park_index > park_index) {
-                SafeSeek(disk_file, table_begin_pointers[7] + new_park_index * p7_park_size_bytes);
-                SafeRead(disk_file, p7_park_buf, p7_park_size_bytes);
-                p7_park = ParkBits(p7_park_buf, p7_park_size_bytes, p7_park_size_bytes * 8);
+        std::vector<uint64_t> p7_entries;
+        std::shared_ptr<const DecodedPark> p7_park;
+        uint64_t park_index = 0;
+        for (uint64_t p7_position : p7_positions) {
+            if (!p7_park || p7_position / kEntriesPerPark != park_index) {
+                park_index = p7_position / kEntriesPerPark;
+                p7_park = GetP7Park(disk_file, park_index);
             }
-            uint32_t start_bit_index = (p7_positions[i] % kEntriesPerPark) * (k + 1);
-
-            uint64_t p7_int = p7_park.Slice(start_bit_index, start_bit_index + k + 1).GetValue();
-            p7_entries.push_back(p7_int);
+            uint32_t start_bit_index = (p7_position % kEntriesPerPark) * (k + 1);
+            p7_entries.push_back(
+                Util::SliceInt64FromBytes(p7_park->bits.data(), start_bit_index, k + 1));
         }
-
-        delete[] bit_mask;
-        delete[] c1_entry_bytes;
-        delete[] p7_park_buf;
-
         return p7_entries;
     }
 
+    // Gets a park of table 7, from the park cache or from disk
+    std::shared_ptr<const DecodedPark> GetP7Park(Reader& disk_file, uint64_t park_index) const
+    {
+        if (park_cache) {
+            std::shared_ptr<const DecodedPark> cached = park_cache->Get(7, park_index);
+            if (cached) {
+                return cached;
+            }
+        }
+        uint64_t p7_park_size_bytes = Util::ByteAlign((k + 1) * kEntriesPerPark) / 8;
+        auto park = std::make_shared<DecodedPark>();
+        park->bits.resize(p7_park_size_bytes + 7);
+        const uint8_t* p7_park_bytes = disk_file.Read(
+            table_begin_pointers[7] + park_index * p7_park_size_bytes,
+            park->bits.data(),
+            p7_park_size_bytes);
+        if (p7_park_bytes != park->bits.data()) {
+            memcpy(park->bits.data(), p7_park_bytes, p7_park_size_bytes);
+        }
+        if (park_cache) {
+            park_cache->Put(7, park_index, park);
+        }
+        return park;
+    }
+
     // Changes a proof of space (64 k bit x values) from plot ordering to proof ordering.
     // Proof ordering: x1..x64 s.t.
     //  f1(x1) m= f1(x2) ... f1(x63) m= f1(x64)
@@ -631,31 +1010,30 @@ private:
         return ordered_proof;
     }
 
-    // Recursive function to go through the tables on disk, backpropagating and fetching
-    // all of the leaves (x values). For example, for depth=5, it fetches the position-th
-    // entry in table 5, reading the two back pointers from the line point, and then
-    // recursively calling GetInputs for table 4.
-    std::vector<Bits> GetInputs(uint64_t position, uint8_t depth)
+    // Goes through the tables on disk, backpropagating and fetching all of the leaves (x
+    // values) of the entry at position in table 6. This is done one level at a time: the two
+    // back pointers of every entry of a level are the positions of the next level, in the
+    // table below. The leaves come out in the same order as with a depth first walk.
+    std::vector<Bits> GetInputs(Reader& disk_file, uint64_t position) const
     {
-        // Create individual file handles to allow parallel processing
-        std::ifstream disk_file(filename, std::ios::in | std::ios::binary);
-        uint128_t line_point = ReadLinePoint(disk_file, depth, position);
-        std::pair<uint64_t, uint64_t> xy = Encoding::LinePointToSquare(line_point);
-
-        if (depth == 1) {
-            // For table P1, the line point represents two concatenated x values.
-            std::vector<Bits> ret;
-            ret.emplace_back(xy.second, k);  // y
-            ret.emplace_back(xy.first, k);   // x
-            return ret;
-        } else {
-            auto left_fut=std::async(std::launch::async, &DiskProver::GetInputs,this, (uint64_t)xy.second, (uint8_t)(depth - 1));
-            auto right_fut=std::async(std::launch::async, &DiskProver::GetInputs,this, (uint64_t)xy.first, (uint8_t)(depth - 1));
-            std::vector<Bits> left = left_fut.get();  // y
-            std::vector<Bits> right = right_fut.get();  // x
-            left.insert(left.end(), right.begin(), right.end());
-            return left;
+        std::vector<uint64_t> positions{position};
+        for (uint8_t table_index = 6; table_index > 0; table_index--) {
+            std::vector<uint128_t> line_points = ReadLinePoints(disk_file, table_index, positions);
+            std::vector<uint64_t> next_positions;
+            for (uint128_t line_point : line_points) {
+                std::pair<uint64_t, uint64_t> xy = Encoding::LinePointToSquare(line_point);
+                next_positions.push_back(xy.second);  // y
+                next_positions.push_back(xy.first);   // x
+            }
+            positions.swap(next_positions);
+        }
+
+        // For table P1, the line points represent two concatenated x values.
+        std::vector<Bits> ret;
+        for (uint64_t x : positions) {
+            ret.emplace_back(x, k);
         }
+        return ret;
     }
 };
 
@@ -0,0 +1,128 @@
+// Copyright 2018 Chia Network Inc
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//    http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SRC_CPP_RADIXSORT_HPP_
+#define SRC_CPP_RADIXSORT_HPP_
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "util.hpp"
+
+namespace RadixSort {
+
+    // Bits sorted per pass. The counters of a pass (16KiB) stay in the L1 cache.
+    inline uint32_t const kDigitBits = 11;
+
+    // Number of bits needed to store positions below num_entries
+    inline uint32_t PositionBits(uint64_t const num_entries)
+    {
+        uint32_t bits = 1;
+        while ((1ULL << bits) < num_entries) bits++;
+        return bits;
+    }
+
+    // Sorts the entries of memory at the indices in idx, comparing bits from bits_begin on like
+    // Util::MemCmpBits, and stores the sorted indices back into idx. Entries that compare equal
+    // keep the order they have in idx. scratch must have room for 2 * num_entries values.
+    //
+    // The sort runs LSD passes over a key made of the first bits of each entry, packed into one
+    // 64 bit word with the position of the entry in idx. Entries whose keys are equal are then
+    // put in order by comparing the whole entries.
+    inline void SortIndices(
+        uint8_t *const memory,
+        uint32_t const entry_len,
+        uint32_t *const idx,
+        uint64_t const num_entries,
+        uint32_t const bits_begin,
+        uint64_t *const scratch)
+    {
+        if (num_entries < 2 || bits_begin >= entry_len * 8) {
+            return;
+        }
+        uint32_t const position_bits = PositionBits(num_entries);
+        uint32_t const key_bits = std::min(64 - position_bits, entry_len * 8 - bits_begin);
+        bool const whole_entry_in_key = key_bits == entry_len * 8 - bits_begin;
+        uint32_t const num_passes = (key_bits + kDigitBits - 1) / kDigitBits;
+        uint64_t const position_mask = (1ULL << position_bits) - 1;
+
+        uint64_t *src = scratch;
+        uint64_t *dst = scratch + num_entries;
+
+        // Counts of all passes are collected in a single read over the entries
+        std::vector<uint64_t> counts((uint64_t)num_passes << kDigitBits, 0);
+        for (uint64_t i = 0; i < num_entries; i++) {
+            uint64_t const key =
+                Util::SliceInt64FromBytesFull(memory + idx[i] * entry_len, bits_begin, key_bits);
+            src[i] = (key << position_bits) | i;
+            for (uint32_t pass = 0; pass < num_passes; pass++) {
+                uint64_t const digit =
+                    (src[i] >> (position_bits + pass * kDigitBits)) & ((1U << kDigitBits) - 1);
+                counts[((uint64_t)pass << kDigitBits) + digit]++;
+            }
+        }
+
+        for (uint32_t pass = 0; pass < num_passes; pass++) {
+            uint64_t *const pass_counts = counts.data() + ((uint64_t)pass << kDigitBits);
+            uint32_t const shift = position_bits + pass * kDigitBits;
+            uint64_t const first_digit = (src[0] >> shift) & ((1U << kDigitBits) - 1);
+            if (pass_counts[first_digit] == num_entries) {
+                // All entries have the same digit, so the pass would not move anything
+                continue;
+            }
+            uint64_t sum = 0;
+            for (uint32_t digit = 0; digit < (1U << kDigitBits); digit++) {
+                uint64_t const count = pass_counts[digit];
+                pass_counts[digit] = sum;
+                sum += count;
+            }
+            for (uint64_t i = 0; i < num_entries; i++) {
+                uint64_t const digit = (src[i] >> shift) & ((1U << kDigitBits) - 1);
+                dst[pass_counts[digit]++] = src[i];
+            }
+            std::swap(src, dst);
+        }
+
+        // dst is free now, and keeps the indices in their original order
+        for (uint64_t i = 0; i < num_entries; i++) {
+            dst[i] = idx[i];
+        }
+        for (uint64_t i = 0; i < num_entries; i++) {
+            idx[i] = dst[src[i] & position_mask];
+        }
+
+        if (whole_entry_in_key) {
+            return;
+        }
+        // Runs of equal keys are in their original order, which a stable sort on the whole
+        // entries keeps for entries that compare equal
+        auto const less = [&](uint32_t const a, uint32_t const b) {
+            return Util::MemCmpBits(
+                       memory + a * entry_len, memory + b * entry_len, entry_len, bits_begin) < 0;
+        };
+        uint64_t run_begin = 0;
+        for (uint64_t i = 1; i <= num_entries; i++) {
+            if (i == num_entries || (src[i] >> position_bits) != (src[run_begin] >> position_bits)) {
+                if (i - run_begin > 1) {
+                    std::stable_sort(idx + run_begin, idx + i, less);
+                }
+                run_begin = i;
+            }
+        }
+    }
+
+}
+
+#endif  // SRC_CPP_RADIXSORT_HPP_
@@ -16,9 +16,14 @@
 #define SRC_CPP_FAST_SORT_ON_DISK_HPP_
 
 #include <algorithm>
+#include <atomic>
 #include <fstream>
+#include <future>
 #include <iostream>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include "chia_filesystem.hpp"
@@ -27,6 +32,7 @@
 #include "./calculate_bucket.hpp"
 #include "./disk.hpp"
 #include "./quicksort.hpp"
+#include "./radixsort.hpp"
 #include "./uniformsort.hpp"
 #include "disk.hpp"
 #include "exceptions.hpp"
@@ -40,6 +46,10 @@ enum class strategy_t : uint8_t
     // really poorly on data that isn't actually uniformly distributed. The last
     // buckets are often not uniformly distributed.
     quicksort_last,
+
+    // LSD radix sort on the bits following the bucket bits. Buckets that don't fit into memory
+    // with the radix sort scratch space fall back to the uniform sort, or quicksort.
+    radix,
 };
 
 class SortManager : public Disk {
@@ -53,7 +63,11 @@ public:
         const std::string &filename,
         uint32_t begin_bits,
         uint64_t const stripe_size,
-        strategy_t const sort_strategy = strategy_t::uniform)
+        strategy_t const sort_strategy = strategy_t::uniform,
+        uint32_t const num_threads = 1,
+        bool const presort = false,
+        bool const in_memory = false,
+        uint32_t const packed_entry_bits = 0)
         : memory_size_(memory_size)
         , entry_size_(entry_size)
         , begin_bits_(begin_bits)
@@ -63,7 +77,20 @@ public:
         // 7 bytes head-room for SliceInt64FromBytes()
         , entry_buf_(new uint8_t[entry_size + 7])
         , strategy_(sort_strategy)
+        , bucket_locks_(new std::mutex[num_buckets])
+        , num_threads_(std::max<uint32_t>(num_threads, 1))
+        , presort_enabled_(presort)
+        , packed_entry_bits_(packed_entry_bits)
     {
+        if (packed_entry_bits > entry_size * 8U) {
+            throw InvalidValueException(
+                "Packed entry size " + std::to_string(packed_entry_bits) +
+                " bits exceeds the entry size of " + std::to_string(entry_size) + " bytes");
+        }
+        if (!in_memory) {
+            write_behind_.reset(new WriteBehind(1, kWriteBehindBuffers));
+        }
+
         // Cross platform way to concatenate paths, gulrak library.
         std::vector<fs::path> bucket_filenames = std::vector<fs::path>();
 
@@ -78,7 +105,7 @@ public:
             fs::remove(bucket_filename);
 
             buckets_.emplace_back(
-                FileDisk(bucket_filename));
+                FileDisk(bucket_filename, in_memory), write_behind_.get());
         }
     }
 
@@ -88,18 +115,72 @@ public:
         return AddToCache(entry_buf_.get());
     }
 
+    // Adds a single entry. This is for single producers: it must not be called concurrently
+    // with itself or with a Writer.
     void AddToCache(const uint8_t *entry)
     {
         if (this->done) {
             throw InvalidValueException("Already finished.");
         }
-        uint64_t const bucket_index =
-            Util::ExtractNum(entry, entry_size_, begin_bits_, log_num_buckets_);
-        bucket_t& b = buckets_[bucket_index];
-        b.file.Write(b.write_pointer, entry, entry_size_);
-        b.write_pointer += entry_size_;
+        WriteToBucket(buckets_[BucketIndex(entry)], entry, 1);
     }
 
+    // Entry point for multiple producers. Each producer thread adds entries through its own
+    // Writer, which stages them per bucket and appends them to the bucket in chunks of
+    // kStagingEntries. Only appending a chunk takes a lock, and only the lock of that bucket.
+    // Flush() must be called once the producer is done, before the SortManager is read.
+    class Writer {
+    public:
+        explicit Writer(SortManager& manager)
+            : manager_(manager)
+            , chunk_size_(kStagingEntries * manager.entry_size_)
+            , staging_(new uint8_t[manager.buckets_.size() * chunk_size_])
+            , staged_(manager.buckets_.size(), 0)
+        {
+        }
+
+        // Disable copying
+        Writer(const Writer&) = delete;
+
+        void Add(const uint8_t *entry)
+        {
+            uint64_t const bucket_index = manager_.BucketIndex(entry);
+            uint8_t* const chunk = staging_.get() + bucket_index * chunk_size_;
+            memcpy(chunk + staged_[bucket_index] * manager_.entry_size_, entry, manager_.entry_size_);
+            if (++staged_[bucket_index] == kStagingEntries) {
+                manager_.AppendToBucket(bucket_index, chunk, chunk_size_);
+                staged_[bucket_index] = 0;
+            }
+        }
+
+        // Adds num_entries entries of the SortManager's entry size, stored back to back
+        void Add(const uint8_t *entries, uint64_t num_entries)
+        {
+            for (uint64_t i = 0; i < num_entries; i++) {
+                Add(entries + i * manager_.entry_size_);
+            }
+        }
+
+        void Flush()
+        {
+            for (size_t bucket_index = 0; bucket_index < staged_.size(); bucket_index++) {
+                if (staged_[bucket_index] == 0) continue;
+                manager_.AppendToBucket(
+                    bucket_index,
+                    staging_.get() + bucket_index * chunk_size_,
+                    staged_[bucket_index] * manager_.entry_size_);
+                staged_[bucket_index] = 0;
+            }
+        }
+
+    private:
+        SortManager& manager_;
+        uint64_t const chunk_size_;
+        std::unique_ptr<uint8_t[]> staging_;
+        // Number of entries staged for each bucket
+        std::vector<uint32_t> staged_;
+    };
+
     uint8_t const* Read(uint64_t begin, uint64_t length) override
     {
         assert(length <= entry_size_);
@@ -130,6 +211,7 @@ public:
 
     void FreeMemory() override
     {
+        CancelPresort();
         for (auto& b : buckets_) {
             b.file.FreeMemory();
             // the underlying file will be re-opened again on-demand
@@ -208,40 +290,174 @@ public:
 
     void FlushCache()
     {
+        CancelPresort();
         for (auto& b : buckets_) {
+            WritePendingGroup(b);
             b.file.FlushCache();
         }
+        if (write_behind_) {
+            write_behind_->Wait();
+        }
         final_position_end = 0;
         memory_start_.reset();
     }
 
+    // Statistics of the bucket writes that were handed to the background writer
+    WriteBehind::Stats WriteStats() const
+    {
+        return write_behind_ ? write_behind_->GetStats() : WriteBehind::Stats();
+    }
+
     ~SortManager()
     {
+        CancelPresort();
+        if (write_behind_) {
+            try {
+                write_behind_->Wait();
+            } catch (...) {
+                // The files are deleted anyway
+            }
+        }
         // Close and delete files in case we exit without doing the sort
         for (auto& b : buckets_) {
-            std::string const filename = b.file.GetFileName();
-            b.underlying_file.Close();
-            fs::remove(fs::path(filename));
+            b.underlying_file.Remove();
         }
     }
 
 private:
 
+    // Number of entries a Writer collects per bucket before appending them to the bucket
+    static const uint32_t kStagingEntries = 256;
+
+    // Buckets with fewer entries are sorted on a single thread
+    static const uint64_t kMinParallelSortEntries = 1 << 14;
+
+    // Number of write_cache sized buffers the bucket writes can have in flight
+    static const uint32_t kWriteBehindBuffers = 16;
+
+    // Radix sort scratch space per entry: two 64 bit words of key and position
+    static const uint64_t kRadixScratchBytes = 2 * sizeof(uint64_t);
+
+    // Packed buckets store their entries in groups of this many entries, which take up exactly
+    // packed_entry_bits_ bytes. So every group starts at a whole byte of the bucket file.
+    static const uint32_t kPackGroupEntries = 8;
+
+    // Head-room of the buffer a packed bucket is read into: the packed entries are read into
+    // its end, and unpacked in place
+    static const uint64_t kUnpackHeadroom = 16;
+
+    uint64_t BucketIndex(const uint8_t *entry) const
+    {
+        return Util::ExtractNum(entry, entry_size_, begin_bits_, log_num_buckets_);
+    }
+
+    void AppendToBucket(uint64_t bucket_index, const uint8_t *entries, uint64_t length)
+    {
+        if (this->done) {
+            throw InvalidValueException("Already finished.");
+        }
+        std::lock_guard<std::mutex> l(bucket_locks_[bucket_index]);
+        WriteToBucket(buckets_[bucket_index], entries, length / entry_size_);
+    }
+
     struct bucket_t
     {
-        bucket_t(FileDisk f) : underlying_file(std::move(f)), file(&underlying_file, 0) {}
+        bucket_t(FileDisk f, WriteBehind* write_behind)
+            : underlying_file(std::move(f)), file(&underlying_file, 0, write_behind)
+        {
+        }
 
-        // The amount of data written to the disk bucket
+        // The amount of data written to the disk bucket, as unpacked entries
         uint64_t write_pointer = 0;
 
+        // The entries of the incomplete group of a packed bucket, and the buffer entries are
+        // packed into
+        std::unique_ptr<uint8_t[]> pending;
+        std::unique_ptr<uint8_t[]> packed;
+
         // The file for the bucket
         FileDisk underlying_file;
         BufferedDisk file;
     };
 
+    // Appends num_entries entries to the bucket. Packed buckets collect the entries of a group
+    // until it's complete, and write whole groups packed.
+    void WriteToBucket(bucket_t& b, const uint8_t *entries, uint64_t num_entries)
+    {
+        if (packed_entry_bits_ == 0) {
+            b.file.Write(b.write_pointer, entries, num_entries * entry_size_);
+            b.write_pointer += num_entries * entry_size_;
+            return;
+        }
+        if (!b.pending) {
+            b.pending.reset(new uint8_t[kPackGroupEntries * entry_size_]);
+            b.packed.reset(new uint8_t[kStagingEntries / kPackGroupEntries * packed_entry_bits_]);
+        }
+
+        uint64_t entry_index = b.write_pointer / entry_size_;
+        while (num_entries > 0) {
+            uint32_t const pending = entry_index % kPackGroupEntries;
+            if (pending == 0 && num_entries >= kPackGroupEntries) {
+                // Packs whole groups straight from the entries
+                uint64_t const groups = std::min<uint64_t>(
+                    num_entries / kPackGroupEntries, kStagingEntries / kPackGroupEntries);
+                Util::PackEntries(
+                    entries, entry_size_, packed_entry_bits_, groups * kPackGroupEntries, b.packed.get());
+                b.file.Write(
+                    entry_index / kPackGroupEntries * packed_entry_bits_,
+                    b.packed.get(),
+                    groups * packed_entry_bits_);
+                entries += groups * kPackGroupEntries * entry_size_;
+                num_entries -= groups * kPackGroupEntries;
+                entry_index += groups * kPackGroupEntries;
+                continue;
+            }
+            memcpy(b.pending.get() + pending * entry_size_, entries, entry_size_);
+            entries += entry_size_;
+            num_entries--;
+            entry_index++;
+            if (entry_index % kPackGroupEntries == 0) {
+                Util::PackEntries(
+                    b.pending.get(), entry_size_, packed_entry_bits_, kPackGroupEntries, b.packed.get());
+                b.file.Write(
+                    (entry_index / kPackGroupEntries - 1) * packed_entry_bits_,
+                    b.packed.get(),
+                    packed_entry_bits_);
+            }
+        }
+        b.write_pointer = entry_index * entry_size_;
+    }
+
+    // Writes the incomplete group of a packed bucket, so that the bucket file holds all its
+    // entries. The entries stay pending, and the group is written again once it's complete.
+    void WritePendingGroup(bucket_t& b)
+    {
+        uint64_t const entry_index = b.write_pointer / entry_size_;
+        uint32_t const pending = entry_index % kPackGroupEntries;
+        if (packed_entry_bits_ == 0 || pending == 0) {
+            return;
+        }
+        Util::PackEntries(b.pending.get(), entry_size_, packed_entry_bits_, pending, b.packed.get());
+        b.file.Write(
+            entry_index / kPackGroupEntries * packed_entry_bits_,
+            b.packed.get(),
+            cdiv(pending * packed_entry_bits_, 8));
+    }
+
+    // The size of the bucket file, in bytes
+    uint64_t BucketFileBytes(uint64_t const bucket_i) const
+    {
+        uint64_t const bucket_entries = buckets_[bucket_i].write_pointer / entry_size_;
+        if (packed_entry_bits_ == 0) {
+            return bucket_entries * entry_size_;
+        }
+        return cdiv(bucket_entries * packed_entry_bits_, 8);
+    }
+
     std::unique_ptr<uint32_t[]> idx_arr_;
     // The buffer we use to sort buckets in-memory
-    std::unique_ptr<uint8_t[]> memory_start_;
+    // Aligned, so that O_DIRECT reads of the bucket files go straight into it
+    Util::AlignedBuffer memory_start_;
     // Size of the whole memory array
     uint64_t memory_size_;
     // Size of each entry
@@ -251,6 +467,8 @@ private:
     // Log of the number of buckets; num bits to use to determine bucket
     uint32_t log_num_buckets_;
 
+    // Writes full bucket buffers in the background. Not used for buckets in memory.
+    std::unique_ptr<WriteBehind> write_behind_;
     std::vector<bucket_t> buckets_;
 
     uint64_t prev_bucket_buf_size;
@@ -264,21 +482,147 @@ private:
     uint64_t next_bucket_to_sort = 0;
     std::unique_ptr<uint8_t[]> entry_buf_;
     strategy_t strategy_;
+    // Serializes the appends of Writers to each bucket
+    std::unique_ptr<std::mutex[]> bucket_locks_;
+    // Number of threads to sort a bucket with
+    uint32_t num_threads_;
+    // Whether the next bucket is sorted in the background while the current one is read
+    bool presort_enabled_;
+    // Number of leading bits of each entry the bucket files store, or 0 to store whole entries
+    uint32_t packed_entry_bits_;
+    std::future<void> presort_;
+    Util::AlignedBuffer presort_memory_;
+    std::unique_ptr<uint32_t[]> presort_idx_arr_;
 
     void SortBucket()
     {
-        if (!memory_start_) {
-            // we allocate the memory to sort the bucket in lazily. It'se freed
-            // in FreeMemory() or the destructor
-            memory_start_.reset(new uint8_t[memory_size_ / 2]);
-            idx_arr_.reset(new uint32_t[memory_size_ / 2 / sizeof(uint32_t)]);
-        }
-
         this->done = true;
         if (next_bucket_to_sort >= buckets_.size()) {
             throw InvalidValueException("Trying to sort bucket which does not exist.");
         }
         uint64_t const bucket_i = this->next_bucket_to_sort;
+
+        if (presort_.valid()) {
+            // The background sort is always for the next bucket
+            presort_.get();
+            memory_start_ = std::move(presort_memory_);
+            idx_arr_ = std::move(presort_idx_arr_);
+        } else {
+            if (presort_enabled_ || strategy_ == strategy_t::radix) {
+                // Buffers are sized for each bucket, so that the next bucket can be sorted next
+                // to this one, or so that the radix sort scratch space fits next to them
+                memory_start_.reset();
+                idx_arr_.reset();
+                memory_start_ = Util::AllocateAligned(BucketSortBytes(bucket_i).first);
+                idx_arr_.reset(new uint32_t[BucketSortBytes(bucket_i).second / sizeof(uint32_t)]);
+            } else if (!memory_start_) {
+                // we allocate the memory to sort the bucket in lazily. It'se freed
+                // in FreeMemory() or the destructor
+                memory_start_ = Util::AllocateAligned(
+                    memory_size_ / 2 + (packed_entry_bits_ ? kUnpackHeadroom : 0));
+                idx_arr_.reset(new uint32_t[memory_size_ / 2 / sizeof(uint32_t)]);
+            }
+            SortBucketInto(bucket_i, memory_start_.get(), idx_arr_.get());
+        }
+
+        this->final_position_start = this->final_position_end;
+        this->final_position_end += buckets_[bucket_i].write_pointer;
+        this->next_bucket_to_sort += 1;
+
+        if (presort_enabled_) {
+            StartPresort();
+        }
+    }
+
+    // The algorithm the bucket is sorted with: uniform, quicksort or radix
+    strategy_t SortAlgorithm(uint64_t const bucket_i) const
+    {
+        uint64_t const bucket_entries = buckets_[bucket_i].write_pointer / entry_size_;
+        bool const last_bucket = (bucket_i == buckets_.size() - 1)
+            || buckets_[bucket_i + 1].write_pointer == 0;
+
+        if (strategy_ == strategy_t::radix &&
+            bucket_entries * (entry_size_ + sizeof(uint32_t) + kRadixScratchBytes) <= memory_size_) {
+            return strategy_t::radix;
+        }
+
+        bool const force_quicksort = (strategy_ == strategy_t::quicksort)
+            || (strategy_ == strategy_t::quicksort_last && last_bucket);
+
+        if (!force_quicksort &&
+            Util::RoundSize(bucket_entries) * sizeof(uint32_t) <= memory_size_ / 2) {
+            return strategy_t::uniform;
+        }
+        return strategy_t::quicksort;
+    }
+
+    // The sizes of the entry and index buffers needed to sort the bucket, in bytes
+    std::pair<uint64_t, uint64_t> BucketSortBytes(uint64_t const bucket_i) const
+    {
+        uint64_t const bucket_entries = buckets_[bucket_i].write_pointer / entry_size_;
+        // Uniform sort spreads the indices over RoundSize() slots. Partitioned parallel sorts
+        // need fewer, including the scratch space of the threads.
+        uint64_t const idx_entries = SortAlgorithm(bucket_i) == strategy_t::uniform
+                                         ? Util::RoundSize(bucket_entries)
+                                         : bucket_entries + 1;
+        return {
+            bucket_entries * entry_size_ + (packed_entry_bits_ ? kUnpackHeadroom : 7),
+            idx_entries * sizeof(uint32_t)};
+    }
+
+    // The size of the scratch space the sort of the bucket allocates while it runs, in bytes
+    uint64_t BucketScratchBytes(uint64_t const bucket_i) const
+    {
+        if (SortAlgorithm(bucket_i) != strategy_t::radix) {
+            return 0;
+        }
+        return buckets_[bucket_i].write_pointer / entry_size_ * kRadixScratchBytes;
+    }
+
+    // Starts sorting the next bucket on a background thread, if it fits into memory next to
+    // the current one
+    void StartPresort()
+    {
+        uint64_t const bucket_i = this->next_bucket_to_sort;
+        if (bucket_i >= buckets_.size() || buckets_[bucket_i].write_pointer == 0) {
+            return;
+        }
+        if (buckets_[bucket_i].write_pointer / entry_size_ > memory_size_ / entry_size_) {
+            // Left for SortBucket() to report
+            return;
+        }
+        auto const current = BucketSortBytes(bucket_i - 1);
+        auto const next = BucketSortBytes(bucket_i);
+        if (current.first + current.second + next.first + next.second +
+                BucketScratchBytes(bucket_i) >
+            memory_size_) {
+            return;
+        }
+        presort_memory_ = Util::AllocateAligned(next.first);
+        presort_idx_arr_.reset(new uint32_t[next.second / sizeof(uint32_t)]);
+        presort_ = std::async(std::launch::async, [this, bucket_i]() {
+            SortBucketInto(bucket_i, presort_memory_.get(), presort_idx_arr_.get());
+        });
+    }
+
+    // Waits for a background sort to finish and drops its result
+    void CancelPresort()
+    {
+        if (presort_.valid()) {
+            try {
+                presort_.get();
+            } catch (...) {
+                // Nobody is going to read the bucket anymore
+            }
+        }
+        presort_memory_.reset();
+        presort_idx_arr_.reset();
+    }
+
+    // Reads the bucket into memory, and stores the order of its sorted entries into idx_arr.
+    // The bucket file is deleted afterwards.
+    void SortBucketInto(uint64_t const bucket_i, uint8_t* const memory, uint32_t* const idx_arr)
+    {
         bucket_t& b = buckets_[bucket_i];
         uint64_t bucket_entries = b.write_pointer / entry_size_;
         uint64_t const entries_fit_in_memory = this->memory_size_ / entry_size_;
@@ -287,6 +631,9 @@ private:
         double const qs_ram = entry_size_ * (sizeof(uint32_t) + bucket_entries) / (1024.0 * 1024.0 * 1024.0);
         double const u_ram =
             Util::RoundSize(bucket_entries) * entry_size_ / (1024.0 * 1024.0 * 1024.0);
+        double const radix_ram = bucket_entries *
+                                 (entry_size_ + sizeof(uint32_t) + kRadixScratchBytes) /
+                                 (1024.0 * 1024.0 * 1024.0);
 
  
 
@@ -304,31 +651,56 @@ private:
         bool const force_quicksort = (strategy_ == strategy_t::quicksort)
             || (strategy_ == strategy_t::quicksort_last && last_bucket);
 
-        uint64_t bucket_length = 0;
-        // The number of buckets needed (the smallest power of 2 greater than 2 * num_entries).
-        while ((1ULL << bucket_length) < 2 * bucket_entries) bucket_length++;
-
-        assert(memory_size_ / 2 >= bucket_entries * entry_size_);
-        b.underlying_file.Read(0, memory_start_.get(), bucket_entries * entry_size_);
+        strategy_t const algorithm = SortAlgorithm(bucket_i);
+        assert(algorithm == strategy_t::radix || memory_size_ / 2 >= bucket_entries * entry_size_);
+        if (packed_entry_bits_ == 0) {
+            b.underlying_file.Read(0, memory, bucket_entries * entry_size_);
+        } else {
+            // The packed entries end at the same position or after the unpacked entries, so
+            // each entry is unpacked before it's overwritten
+            uint64_t const packed_bytes = BucketFileBytes(bucket_i);
+            uint8_t* const packed = memory + bucket_entries * entry_size_ + 8 - packed_bytes;
+            b.underlying_file.Read(0, packed, packed_bytes);
+            Util::UnpackEntries(packed, packed_entry_bits_, bucket_entries, memory, entry_size_);
+        }
         auto round_size = Util::RoundSize(bucket_entries);
-        if (!force_quicksort && round_size * sizeof(uint32_t) <= memory_size_ / 2) {
-            // idx_arr_.reset(new uint32_t[round_size]);
-            memset(idx_arr_.get(), 0xFF, sizeof(uint32_t) * round_size);
+        bool const parallel = num_threads_ > 1 && bucket_entries >= kMinParallelSortEntries;
+        if (algorithm == strategy_t::radix) {
+            std::cout << "\tBucket " << bucket_i << " radix sort. Ram: " << std::fixed
+                      << std::setprecision(3) << have_ram << "GiB, radix min: " << radix_ram
+                      << "GiB." << std::endl;
+            if (parallel) {
+                ParallelSortBucket(memory, idx_arr, bucket_entries, algorithm);
+            } else {
+                for (size_t i = 0; i < bucket_entries; ++i) {
+                    idx_arr[i] = i;
+                }
+                std::vector<uint64_t> scratch(2 * bucket_entries);
+                RadixSort::SortIndices(
+                    memory,
+                    entry_size_,
+                    idx_arr,
+                    bucket_entries,
+                    begin_bits_ + log_num_buckets_,
+                    scratch.data());
+            }
+        } else if (algorithm == strategy_t::uniform) {
             std::cout << "\tBucket " << bucket_i << " uniform sort. Ram: " << std::fixed
                       << std::setprecision(3) << have_ram << "GiB, u_sort min: " << u_ram
                       << "GiB, qs min: " << qs_ram << "GiB." << std::endl;
-            UniformSort::SortToMemory(
-                b.underlying_file,
-                0,
-                memory_start_.get(),
-                entry_size_,
-                bucket_entries,
-                begin_bits_ + log_num_buckets_, idx_arr_.get());
-        } else {
-            for(size_t i = 0; i < bucket_entries; ++i) {
-                idx_arr_[i] = i;
+            if (parallel) {
+                ParallelSortBucket(memory, idx_arr, bucket_entries, algorithm);
+            } else {
+                memset(idx_arr, 0xFF, sizeof(uint32_t) * round_size);
+                UniformSort::SortToMemory(
+                    b.underlying_file,
+                    0,
+                    memory,
+                    entry_size_,
+                    bucket_entries,
+                    begin_bits_ + log_num_buckets_, idx_arr);
             }
-      
+        } else {
             // Are we in Compress phrase 1 (quicksort=1) or is it the last bucket (quicksort=2)?
             // Perform quicksort if so (SortInMemory algorithm won't always perform well), or if we
             // don't have enough memory for uniform sort
@@ -336,17 +708,120 @@ private:
                       << std::setprecision(3) << have_ram << "GiB, u_sort min: " << u_ram
                       << "GiB, qs min: " << qs_ram << "GiB. force_qs: " << force_quicksort
                       << std::endl;
-            QuickSort::Sort2(memory_start_.get(), entry_size_, bucket_entries, begin_bits_ + log_num_buckets_, idx_arr_.get());
+            if (parallel) {
+                ParallelSortBucket(memory, idx_arr, bucket_entries, algorithm);
+            } else {
+                for(size_t i = 0; i < bucket_entries; ++i) {
+                    idx_arr[i] = i;
+                }
+                QuickSort::Sort2(memory, entry_size_, bucket_entries, begin_bits_ + log_num_buckets_, idx_arr);
+            }
         }
 
         // Deletes the bucket file
-        std::string filename = b.file.GetFileName();
-        b.underlying_file.Close();
-        fs::remove(fs::path(filename));
+        b.underlying_file.Remove();
+    }
 
-        this->final_position_start = this->final_position_end;
-        this->final_position_end += b.write_pointer;
-        this->next_bucket_to_sort += 1;
+    // Runs func(thread_index) on num_threads_ threads, one of which is the calling thread
+    template <typename Func>
+    void RunOnThreads(Func func)
+    {
+        std::vector<std::thread> threads;
+        for (uint32_t t = 1; t < num_threads_; t++) {
+            threads.emplace_back(func, t);
+        }
+        func(0);
+        for (auto& t : threads) {
+            t.join();
+        }
+    }
+
+    // Sorts the num_entries entries in memory into idx_arr on num_threads_ threads. The
+    // entries are first partitioned by the bits following the bucket bits, keeping the order
+    // they are in within each partition, and then the threads take turns sorting whole
+    // partitions. The partitions are sorted with the same algorithm as a single threaded sort,
+    // so the sorted bucket is the same.
+    void ParallelSortBucket(
+        uint8_t* const memory,
+        uint32_t* const idx_arr,
+        uint64_t const num_entries,
+        strategy_t const algorithm)
+    {
+        uint32_t const bits_begin = begin_bits_ + log_num_buckets_;
+
+        // More partitions than threads, so that uneven partitions still balance out
+        uint32_t partition_bits = 0;
+        while ((1U << partition_bits) < 16 * num_threads_) partition_bits++;
+        uint32_t const num_partitions = 1U << partition_bits;
+
+        auto const chunk_begin = [&](uint32_t t) { return num_entries * t / num_threads_; };
+        auto const partition = [&](uint64_t i) {
+            return Util::ExtractNum(memory + i * entry_size_, entry_size_, bits_begin, partition_bits);
+        };
+
+        // Number of entries per thread chunk and partition, which turn into the positions to
+        // write them to
+        std::vector<uint64_t> offsets(num_threads_ * num_partitions, 0);
+        RunOnThreads([&](uint32_t t) {
+            uint64_t* const thread_offsets = offsets.data() + t * num_partitions;
+            for (uint64_t i = chunk_begin(t); i < chunk_begin(t + 1); i++) {
+                thread_offsets[partition(i)]++;
+            }
+        });
+
+        std::vector<uint64_t> partition_start(num_partitions + 1);
+        uint64_t sum = 0;
+        for (uint32_t p = 0; p < num_partitions; p++) {
+            partition_start[p] = sum;
+            for (uint32_t t = 0; t < num_threads_; t++) {
+                uint64_t const count = offsets[t * num_partitions + p];
+                offsets[t * num_partitions + p] = sum;
+                sum += count;
+            }
+        }
+        partition_start[num_partitions] = sum;
+
+        RunOnThreads([&](uint32_t t) {
+            uint64_t* const thread_offsets = offsets.data() + t * num_partitions;
+            for (uint64_t i = chunk_begin(t); i < chunk_begin(t + 1); i++) {
+                idx_arr[thread_offsets[partition(i)]++] = i;
+            }
+        });
+
+        std::atomic<uint32_t> next_partition(0);
+        RunOnThreads([&](uint32_t) {
+            std::vector<uint32_t> idx_tmp;
+            std::vector<uint64_t> radix_scratch;
+            for (uint32_t p = next_partition++; p < num_partitions; p = next_partition++) {
+                uint32_t* const idx = idx_arr + partition_start[p];
+                uint64_t const partition_entries = partition_start[p + 1] - partition_start[p];
+                if (partition_entries < 2) {
+                    continue;
+                }
+                if (algorithm == strategy_t::radix) {
+                    radix_scratch.resize(std::max<uint64_t>(radix_scratch.size(), 2 * partition_entries));
+                    RadixSort::SortIndices(
+                        memory,
+                        entry_size_,
+                        idx,
+                        partition_entries,
+                        bits_begin + partition_bits,
+                        radix_scratch.data());
+                } else if (algorithm == strategy_t::uniform) {
+                    // All entries of the partition have the same partition bits
+                    idx_tmp.resize(std::max<uint64_t>(idx_tmp.size(), Util::RoundSize(partition_entries)));
+                    UniformSort::SortIndices(
+                        memory,
+                        entry_size_,
+                        idx,
+                        partition_entries,
+                        bits_begin + partition_bits,
+                        idx_tmp.data());
+                } else {
+                    QuickSort::Sort2(memory, entry_size_, partition_entries, bits_begin, idx);
+                }
+            }
+        });
     }
 };
 
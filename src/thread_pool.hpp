@@ -0,0 +1,139 @@
+// Copyright 2018 Chia Network Inc
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//    http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SRC_CPP_THREAD_POOL_HPP_
+#define SRC_CPP_THREAD_POOL_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of threads, that help with the loops passed to ParallelFor(). Any number of
+// threads, including the pool's own, may call ParallelFor() at the same time.
+class ThreadPool {
+public:
+    explicit ThreadPool(uint32_t const num_threads)
+    {
+        for (uint32_t i = 0; i < num_threads; i++) {
+            threads_.emplace_back(&ThreadPool::Run, this);
+        }
+    }
+
+    ThreadPool(ThreadPool const&) = delete;
+    ThreadPool& operator=(ThreadPool const&) = delete;
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> l(mutex_);
+            stop_ = true;
+        }
+        work_.notify_all();
+        for (auto& t : threads_) {
+            t.join();
+        }
+    }
+
+    uint32_t size() const { return threads_.size(); }
+
+    // Calls func(i) for every i in [0, count), on the calling thread and the pool's threads,
+    // and returns once all calls have returned. If calls throw, the first exception is
+    // rethrown here.
+    template <typename Func>
+    void ParallelFor(uint64_t const count, Func const& func)
+    {
+        if (count == 0) {
+            return;
+        }
+        // The pool's threads may only get to their task after this call returned, so the
+        // loop state lives on the heap. They don't call func then, as no index is left.
+        auto loop = std::make_shared<Loop>();
+        auto run = [loop, &func, count] {
+            for (uint64_t i = loop->next++; i < count; i = loop->next++) {
+                try {
+                    func(i);
+                } catch (...) {
+                    std::lock_guard<std::mutex> l(loop->mutex);
+                    if (!loop->error) {
+                        loop->error = std::current_exception();
+                    }
+                }
+                if (++loop->done == count) {
+                    std::lock_guard<std::mutex> l(loop->mutex);
+                    loop->finished.notify_all();
+                }
+            }
+        };
+
+        uint64_t const helpers = std::min<uint64_t>(threads_.size(), count - 1);
+        if (helpers > 0) {
+            {
+                std::lock_guard<std::mutex> l(mutex_);
+                for (uint64_t i = 0; i < helpers; i++) {
+                    tasks_.emplace_back(run);
+                }
+            }
+            work_.notify_all();
+        }
+        run();
+
+        std::unique_lock<std::mutex> l(loop->mutex);
+        loop->finished.wait(l, [&] { return loop->done == count; });
+        if (loop->error) {
+            std::rethrow_exception(loop->error);
+        }
+    }
+
+private:
+    struct Loop {
+        std::atomic<uint64_t> next{0};
+        std::atomic<uint64_t> done{0};
+        std::mutex mutex;
+        std::condition_variable finished;
+        std::exception_ptr error;
+    };
+
+    void Run()
+    {
+        for (;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> l(mutex_);
+                work_.wait(l, [this] { return stop_ || !tasks_.empty(); });
+                if (tasks_.empty()) {
+                    return;
+                }
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable work_;
+    std::deque<std::function<void()>> tasks_;
+    bool stop_ = false;
+};
+
+#endif  // SRC_CPP_THREAD_POOL_HPP_
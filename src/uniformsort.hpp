@@ -108,6 +108,45 @@ private:
         assert(entries_written == num_entries);
     }
 
+    // Sorts the entries of memory at the indices in idx, and stores the sorted indices back into
+    // idx. Entries that compare equal keep the order they have in idx, as in SortToMemory.
+    // idx_tmp must have room for Util::RoundSize(num_entries) indices.
+    inline void SortIndices(
+        uint8_t *const memory,
+        uint32_t const entry_len,
+        uint32_t *const idx,
+        uint64_t const num_entries,
+        uint32_t const bits_begin,
+        uint32_t *const idx_tmp)
+    {
+        uint64_t bucket_length = 0;
+        // The number of buckets needed (the smallest power of 2 greater than 2 * num_entries).
+        while ((1ULL << bucket_length) < 2 * num_entries) bucket_length++;
+
+        auto round_size = Util::RoundSize(num_entries);
+        memset(idx_tmp, 0xFF, sizeof(uint32_t) * round_size);
+
+        for (uint64_t i = 0; i < num_entries; i++) {
+            uint32_t swap = idx[i];
+            uint64_t position =
+                Util::ExtractNum(memory + swap * entry_len, entry_len, bits_begin, bucket_length);
+            while (idx_tmp[position] != 0xFFFFFFFF && position < round_size) {
+                if (Util::MemCmpBits(memory + idx_tmp[position] * entry_len, memory + swap * entry_len, entry_len, bits_begin) > 0) {
+                    std::swap(idx_tmp[position], swap);
+                }
+                ++position;
+            }
+            idx_tmp[position] = swap;
+        }
+        uint64_t entries_written = 0;
+        for (size_t i = 0; entries_written < num_entries; ++i) {
+            if (idx_tmp[i] != 0xFFFFFFFF) {
+                idx[entries_written++] = idx_tmp[i];
+            }
+        }
+        assert(entries_written == num_entries);
+    }
+
 }
 
 #endif  // SRC_CPP_UNIFORMSORT_HPP_
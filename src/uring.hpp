@@ -0,0 +1,431 @@
+// Copyright 2018 Chia Network Inc
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//    http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SRC_CPP_URING_HPP_
+#define SRC_CPP_URING_HPP_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "exceptions.hpp"
+#include "util.hpp"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define CHIAPOS_HAVE_IO_URING 1
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#else
+#define CHIAPOS_HAVE_IO_URING 0
+#endif
+
+#if CHIAPOS_HAVE_IO_URING
+
+// A process wide io_uring for the reads and writes of FileDisks. Writes are copied into one of
+// kSlots staging buffers, which are registered with the kernel, and are queued without waiting
+// for them. Queued writes are submitted in batches of kSubmitBatch, or when the caller needs
+// them to be done, so that up to kSlots writes are in flight at a time. Reads wait for the
+// writes to their file first, and are done synchronously. A write waits for the writes in
+// flight it overlaps with, since the kernel may complete them in any order. The staging buffers
+// are aligned, so that files opened with O_DIRECT can be written through them too.
+//
+// All methods are thread safe. Files are plain file descriptors, and must not be closed while
+// writes to them are pending.
+class IoUring {
+public:
+    // Returns the ring, or nullptr if io_uring is not supported by the kernel
+    static IoUring* Get()
+    {
+        static std::unique_ptr<IoUring> ring = [] {
+            std::unique_ptr<IoUring> r(new IoUring());
+            if (!r->Setup()) {
+                r.reset();
+            }
+            return r;
+        }();
+        return ring.get();
+    }
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    ~IoUring()
+    {
+        try {
+            std::lock_guard<std::mutex> l(mutex_);
+            DrainLocked([](int) { return true; });
+        } catch (...) {
+        }
+        if (sqes_ != MAP_FAILED) ::munmap(sqes_, sqes_size_);
+        if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) ::munmap(cq_ring_, cq_ring_size_);
+        if (sq_ring_ != MAP_FAILED) ::munmap(sq_ring_, sq_ring_size_);
+        if (ring_fd_ >= 0) ::close(ring_fd_);
+    }
+
+    void Write(int const fd, uint64_t offset, const uint8_t* data, uint64_t length)
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        while (length > 0) {
+            uint32_t const amount = std::min<uint64_t>(length, kSlotSize);
+            WaitForOverlaps(fd, offset, amount);
+            uint32_t const slot = AcquireSlot();
+            ::memcpy(slots_[slot].buffer, data, amount);
+            slots_[slot].fd = fd;
+            slots_[slot].offset = offset;
+            slots_[slot].length = amount;
+            slots_[slot].done = 0;
+            slots_[slot].busy = true;
+            pending_[fd]++;
+            QueueWrite(slot);
+            offset += amount;
+            data += amount;
+            length -= amount;
+        }
+        if (unsubmitted_ >= kSubmitBatch) {
+            Enter(0);
+        }
+    }
+
+    // Returns the number of bytes read, which is less than length only at the end of the file
+    uint64_t Read(int const fd, uint64_t offset, uint8_t* data, uint64_t length)
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        DrainLocked([fd](int pending_fd) { return pending_fd == fd; });
+        uint64_t total = 0;
+        while (length > 0) {
+            uint32_t const amount = std::min<uint64_t>(length, kMaxReadSize);
+            io_uring_sqe* sqe = NextSqe();
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = fd;
+            sqe->off = offset;
+            sqe->addr = reinterpret_cast<uint64_t>(data);
+            sqe->len = amount;
+            sqe->user_data = kReadTag;
+            read_result_ = kNoResult;
+            while (read_result_ == kNoResult) {
+                Enter(1);
+                ReapCompletions();
+            }
+            if (read_result_ == -EINTR || read_result_ == -EAGAIN) {
+                continue;
+            }
+            if (read_result_ < 0) {
+                throw InvalidValueException(
+                    "Read of " + std::to_string(length) + " bytes at offset " +
+                    std::to_string(offset) + " failed: " + ::strerror(-read_result_));
+            }
+            if (read_result_ == 0) {
+                break;
+            }
+            offset += read_result_;
+            data += read_result_;
+            length -= read_result_;
+            total += read_result_;
+        }
+        return total;
+    }
+
+    // Waits until all writes to fd are done
+    void Drain(int const fd)
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        DrainLocked([fd](int pending_fd) { return pending_fd == fd; });
+    }
+
+    bool RegisteredBuffers() const noexcept { return registered_; }
+
+private:
+    // Number of staging buffers, which is also the queue depth of the writes
+    static constexpr uint32_t kSlots = 64;
+    static constexpr uint32_t kSlotSize = 256 * 1024;
+    static constexpr uint32_t kSubmitBatch = 16;
+    static constexpr uint32_t kMaxReadSize = 1 << 30;
+    static constexpr uint64_t kReadTag = UINT64_MAX;
+    static constexpr int64_t kNoResult = INT64_MIN;
+
+    struct Slot {
+        uint8_t* buffer;
+        int fd = -1;
+        uint64_t offset = 0;
+        uint32_t length = 0;
+        // Bytes written so far, if the kernel did a short write
+        uint32_t done = 0;
+        bool busy = false;
+    };
+
+    IoUring() = default;
+
+    bool Setup()
+    {
+        io_uring_params params;
+        ::memset(&params, 0, sizeof(params));
+        ring_fd_ = ::syscall(__NR_io_uring_setup, 2 * kSlots, &params);
+        if (ring_fd_ < 0) {
+            return false;
+        }
+
+        sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool const single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+        }
+        sq_ring_ = ::mmap(
+            nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_,
+            IORING_OFF_SQ_RING);
+        if (sq_ring_ == MAP_FAILED) {
+            return false;
+        }
+        cq_ring_ = single_mmap ? sq_ring_
+                               : ::mmap(
+                                     nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+        if (cq_ring_ == MAP_FAILED) {
+            return false;
+        }
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = ::mmap(
+            nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_,
+            IORING_OFF_SQES);
+        if (sqes_ == MAP_FAILED) {
+            return false;
+        }
+
+        auto* sq = static_cast<uint8_t*>(sq_ring_);
+        sq_tail_ = reinterpret_cast<uint32_t*>(sq + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<uint32_t*>(sq + params.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<uint32_t*>(sq + params.sq_off.array);
+        auto* cq = static_cast<uint8_t*>(cq_ring_);
+        cq_head_ = reinterpret_cast<uint32_t*>(cq + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<uint32_t*>(cq + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<uint32_t*>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        staging_ = Util::AllocateAligned(uint64_t(kSlots) * kSlotSize);
+        std::vector<iovec> iovecs(kSlots);
+        for (uint32_t i = 0; i < kSlots; i++) {
+            slots_[i].buffer = staging_.get() + uint64_t(i) * kSlotSize;
+            iovecs[i].iov_base = slots_[i].buffer;
+            iovecs[i].iov_len = kSlotSize;
+            free_slots_.push_back(i);
+        }
+        // Registering fails if the buffers exceed RLIMIT_MEMLOCK. Plain writes work then too.
+        registered_ = ::syscall(
+                          __NR_io_uring_register,
+                          ring_fd_,
+                          IORING_REGISTER_BUFFERS,
+                          iovecs.data(),
+                          kSlots) == 0;
+        return true;
+    }
+
+    io_uring_sqe* NextSqe()
+    {
+        uint32_t const tail = *sq_tail_;
+        uint32_t const index = tail & sq_mask_;
+        io_uring_sqe* sqe = static_cast<io_uring_sqe*>(sqes_) + index;
+        ::memset(sqe, 0, sizeof(*sqe));
+        sq_array_[index] = index;
+        __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+        unsubmitted_++;
+        return sqe;
+    }
+
+    void QueueWrite(uint32_t const slot)
+    {
+        Slot const& s = slots_[slot];
+        io_uring_sqe* sqe = NextSqe();
+        sqe->opcode = registered_ ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        sqe->fd = s.fd;
+        sqe->off = s.offset + s.done;
+        sqe->addr = reinterpret_cast<uint64_t>(s.buffer + s.done);
+        sqe->len = s.length - s.done;
+        sqe->buf_index = registered_ ? slot : 0;
+        sqe->user_data = slot;
+    }
+
+    // Submits the queued entries, and waits for min_complete completions
+    void Enter(uint32_t const min_complete)
+    {
+        while (true) {
+            int const ret = ::syscall(
+                __NR_io_uring_enter,
+                ring_fd_,
+                unsubmitted_,
+                min_complete,
+                min_complete > 0 ? IORING_ENTER_GETEVENTS : 0,
+                nullptr,
+                0);
+            if (ret >= 0) {
+                unsubmitted_ -= std::min<uint32_t>(ret, unsubmitted_);
+                if (unsubmitted_ == 0 || min_complete > 0) {
+                    return;
+                }
+            } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                throw InvalidValueException(
+                    std::string("io_uring_enter failed: ") + ::strerror(errno));
+            } else if (errno != EINTR) {
+                // The completion queue is full, make room
+                ReapCompletions();
+            }
+        }
+    }
+
+    void ReapCompletions()
+    {
+        uint32_t head = *cq_head_;
+        uint32_t const tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        std::string error;
+        for (; head != tail; head++) {
+            io_uring_cqe const& cqe = cqes_[head & cq_mask_];
+            if (cqe.user_data == kReadTag) {
+                read_result_ = cqe.res;
+                continue;
+            }
+            uint32_t const slot = cqe.user_data;
+            Slot& s = slots_[slot];
+            if (cqe.res == -EINTR || cqe.res == -EAGAIN) {
+                QueueWrite(slot);
+                continue;
+            }
+            if (cqe.res <= 0) {
+                // Finishes the write the way the stdio backend would have
+                error = WriteFallback(s);
+            } else if (s.done + cqe.res < s.length) {
+                s.done += cqe.res;
+                QueueWrite(slot);
+                continue;
+            }
+            if (--pending_[s.fd] == 0) {
+                pending_.erase(s.fd);
+            }
+            s.busy = false;
+            free_slots_.push_back(slot);
+        }
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+        if (!error.empty()) {
+            throw InvalidValueException(error);
+        }
+    }
+
+    std::string WriteFallback(Slot& s)
+    {
+        while (s.done < s.length) {
+            ssize_t const ret =
+                ::pwrite(s.fd, s.buffer + s.done, s.length - s.done, s.offset + s.done);
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ret <= 0) {
+                return "Only wrote " + std::to_string(s.done) + " of " +
+                       std::to_string(s.length) + " bytes at offset " + std::to_string(s.offset) +
+                       (ret < 0 ? std::string(": ") + ::strerror(errno) : ".");
+            }
+            s.done += ret;
+        }
+        return std::string();
+    }
+
+    uint32_t AcquireSlot()
+    {
+        while (free_slots_.empty()) {
+            Enter(1);
+            ReapCompletions();
+        }
+        uint32_t const slot = free_slots_.back();
+        free_slots_.pop_back();
+        return slot;
+    }
+
+    void WaitForOverlaps(int const fd, uint64_t const offset, uint64_t const length)
+    {
+        auto const overlaps = [&] {
+            for (Slot const& s : slots_) {
+                if (s.busy && s.fd == fd && s.offset < offset + length &&
+                    offset < s.offset + s.length) {
+                    return true;
+                }
+            }
+            return false;
+        };
+        while (overlaps()) {
+            Enter(1);
+            ReapCompletions();
+        }
+    }
+
+    // Waits until no write is pending for the files pending_fd matches
+    template <typename Match>
+    void DrainLocked(Match match)
+    {
+        while (std::any_of(
+            pending_.begin(), pending_.end(), [&](auto const& p) { return match(p.first); })) {
+            Enter(1);
+            ReapCompletions();
+        }
+    }
+
+    std::mutex mutex_;
+    int ring_fd_ = -1;
+    void* sq_ring_ = MAP_FAILED;
+    void* cq_ring_ = MAP_FAILED;
+    void* sqes_ = MAP_FAILED;
+    size_t sq_ring_size_ = 0;
+    size_t cq_ring_size_ = 0;
+    size_t sqes_size_ = 0;
+
+    uint32_t* sq_tail_ = nullptr;
+    uint32_t sq_mask_ = 0;
+    uint32_t* sq_array_ = nullptr;
+    uint32_t* cq_head_ = nullptr;
+    uint32_t* cq_tail_ = nullptr;
+    uint32_t cq_mask_ = 0;
+    io_uring_cqe* cqes_ = nullptr;
+    // Entries added to the submission queue since the last io_uring_enter()
+    uint32_t unsubmitted_ = 0;
+
+    bool registered_ = false;
+    Util::AlignedBuffer staging_;
+    Slot slots_[kSlots];
+    std::vector<uint32_t> free_slots_;
+    // Number of unfinished writes for each file
+    std::unordered_map<int, uint64_t> pending_;
+    int64_t read_result_ = kNoResult;
+};
+
+#else
+
+// io_uring is only available on Linux
+class IoUring {
+public:
+    static IoUring* Get() { return nullptr; }
+    void Write(int, uint64_t, const uint8_t*, uint64_t) {}
+    uint64_t Read(int, uint64_t, uint8_t*, uint64_t) { return 0; }
+    void Drain(int) {}
+    bool RegisteredBuffers() const noexcept { return false; }
+};
+
+#endif
+
+#endif  // SRC_CPP_URING_HPP_
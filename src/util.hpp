@@ -15,6 +15,7 @@
 #ifndef SRC_CPP_UTIL_HPP_
 #define SRC_CPP_UTIL_HPP_
 
+#include <algorithm>
 #include <cassert>
 #include <chrono>
 #include <cstring>
@@ -22,6 +23,8 @@
 #include <iomanip>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <new>
 #include <numeric>
 #include <queue>
 #include <random>
@@ -144,6 +147,22 @@ private:
 
 namespace Util {
 
+    // Alignment of the buffers, file offsets and lengths of O_DIRECT reads and writes
+    constexpr uint64_t kIoAlignment = 4096;
+
+    // Frees the buffers of AllocateAligned()
+    struct AlignedDeleter {
+        void operator()(uint8_t *p) const { ::operator delete[](p, std::align_val_t(kIoAlignment)); }
+    };
+
+    using AlignedBuffer = std::unique_ptr<uint8_t[], AlignedDeleter>;
+
+    // Allocates a buffer that starts at a multiple of kIoAlignment
+    inline AlignedBuffer AllocateAligned(uint64_t size)
+    {
+        return AlignedBuffer(new (std::align_val_t(kIoAlignment)) uint8_t[size]);
+    }
+
     template <typename X>
     inline X Mod(X i, X n)
     {
@@ -273,6 +292,118 @@ namespace Util {
         return ((uint128_t)high << 64) | low;
     }
 
+    // Writes the low 'num_bits' bits of 'value' into the big-endian bit stream 'bytes', starting
+    // at 'start_bit', and advances 'start_bit' past them. The destination bits must be zero.
+    //
+    // Note: like SliceInt64FromBytes, requires that 8 bytes after the last written byte are
+    // addressable.
+    inline void AppendBits(uint8_t *bytes, uint32_t &start_bit, uint128_t value, uint32_t num_bits)
+    {
+        while (num_bits > 0) {
+            // At most 56 bits at a time, so that the chunk fits in one 64 bit word
+            uint32_t take = std::min<uint32_t>(num_bits, 56);
+            num_bits -= take;
+            uint64_t chunk = (uint64_t)(value >> num_bits) & ((1ULL << take) - 1);
+            uint8_t *dst = bytes + start_bit / 8;
+            uint32_t shift = 64 - start_bit % 8 - take;
+            IntToEightBytes(dst, EightBytesToInt(dst) | (chunk << shift));
+            start_bit += take;
+        }
+    }
+
+    // Packs num_entries entries of entry_len bytes, stored back to back in src, into a
+    // big-endian bit stream of entry_bits bits per entry, dropping the trailing
+    // entry_len * 8 - entry_bits bits of each entry. Writes cdiv(num_entries * entry_bits, 8)
+    // bytes to dst, the unused bits of the last byte are zero.
+    inline void PackEntries(
+        const uint8_t *src,
+        uint32_t const entry_len,
+        uint32_t const entry_bits,
+        uint64_t const num_entries,
+        uint8_t *dst)
+    {
+        uint32_t const full_bytes = entry_bits / 8;
+        uint32_t const rem_bits = entry_bits % 8;
+        // The bits that don't make up a whole output byte yet, in the low acc_bits bits
+        uint64_t acc = 0;
+        uint32_t acc_bits = 0;
+        for (uint64_t i = 0; i < num_entries; i++) {
+            const uint8_t *entry = src + i * entry_len;
+            uint32_t j = 0;
+            for (; j + 8 <= full_bytes; j += 8) {
+                uint64_t const word = EightBytesToInt(entry + j);
+                IntToEightBytes(dst, acc_bits ? (acc << (64 - acc_bits)) | (word >> acc_bits) : word);
+                dst += 8;
+                acc = word & ((1ULL << acc_bits) - 1);
+            }
+            for (; j < full_bytes; j++) {
+                acc = (acc << 8) | entry[j];
+                *dst++ = acc >> acc_bits;
+                acc &= (1ULL << acc_bits) - 1;
+            }
+            if (rem_bits) {
+                acc = (acc << rem_bits) | (entry[full_bytes] >> (8 - rem_bits));
+                acc_bits += rem_bits;
+                if (acc_bits >= 8) {
+                    acc_bits -= 8;
+                    *dst++ = acc >> acc_bits;
+                    acc &= (1ULL << acc_bits) - 1;
+                }
+            }
+        }
+        if (acc_bits) {
+            *dst = acc << (8 - acc_bits);
+        }
+    }
+
+    // The inverse of PackEntries(). Unpacks num_entries entries of entry_bits bits from src into
+    // entries of entry_len bytes in dst, with the trailing bits of each entry set to zero.
+    // dst may overlap src, as long as each unpacked entry ends before the packed entries that
+    // follow it start.
+    inline void UnpackEntries(
+        const uint8_t *src,
+        uint32_t const entry_bits,
+        uint64_t const num_entries,
+        uint8_t *dst,
+        uint32_t const entry_len)
+    {
+        uint32_t const full_bytes = entry_bits / 8;
+        uint32_t const rem_bits = entry_bits % 8;
+        uint32_t const pad_bytes = entry_len - cdiv(entry_bits, 8);
+        // Bit offset of the next entry into *src
+        uint32_t shift = 0;
+        for (uint64_t i = 0; i < num_entries; i++) {
+            uint8_t *entry = dst + i * entry_len;
+            uint32_t j = 0;
+            for (; j + 8 <= full_bytes; j += 8) {
+                uint64_t word = EightBytesToInt(src);
+                if (shift) {
+                    word = (word << shift) | (src[8] >> (8 - shift));
+                }
+                src += 8;
+                IntToEightBytes(entry + j, word);
+            }
+            for (; j < full_bytes; j++) {
+                entry[j] = shift ? (src[0] << shift) | (src[1] >> (8 - shift)) : src[0];
+                src++;
+            }
+            if (rem_bits) {
+                uint32_t window = src[0] << 8;
+                if (shift + rem_bits > 8) {
+                    window |= src[1];
+                }
+                entry[full_bytes] = (((window << shift) & 0xFFFF) >> (16 - rem_bits)) << (8 - rem_bits);
+                shift += rem_bits;
+                if (shift >= 8) {
+                    shift -= 8;
+                    src++;
+                }
+                j++;
+            }
+            memset(entry + j, 0, pad_bytes);
+        }
+    }
+
     inline void GetRandomBytes(uint8_t *buf, uint32_t num_bytes)
     {
         std::random_device rd;
@@ -343,12 +474,74 @@ namespace Util {
     void CpuID(uint32_t leaf, uint32_t *regs)
     {
 #if defined(_WIN32)
-        __cpuid((int *)regs, (int)leaf);
+        __cpuidex((int *)regs, (int)leaf, 0);
+#else
+        __get_cpuid_count(leaf, 0, &regs[0], &regs[1], &regs[2], &regs[3]);
+#endif /* defined(_WIN32) */
+    }
+
+    // Returns XCR0, which tells which register states the OS saves on context switches.
+    uint64_t XGetBV(void)
+    {
+#if defined(_WIN32)
+        return _xgetbv(0);
 #else
-        __get_cpuid(leaf, &regs[0], &regs[1], &regs[2], &regs[3]);
+        uint32_t eax, edx;
+        __asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+        return ((uint64_t)edx << 32) | eax;
 #endif /* defined(_WIN32) */
     }
 
+    // Whether the OS saves the register states in 'mask' (checked through XCR0).
+    bool HaveOSRegisterSupport(uint64_t mask)
+    {
+        uint32_t regs[4] = {0};
+
+        CpuID(1, regs);
+        // Bit 27 of ECX indicates that the OS has enabled XGETBV
+        if (!((regs[2] >> 27) & 1))
+            return false;
+        return (XGetBV() & mask) == mask;
+    }
+
+    bool HaveAVX2(void)
+    {
+        // EAX, EBX, ECX, EDX
+        uint32_t regs[4] = {0};
+
+        // The OS must save the SSE and AVX states
+        if (!HaveOSRegisterSupport(0x6))
+            return false;
+        CpuID(7, regs);
+        // Bit 5 of EBX indicates AVX2 instruction support
+        return (regs[1] >> 5) & 1;
+    }
+
+    bool HaveAVX512F(void)
+    {
+        // EAX, EBX, ECX, EDX
+        uint32_t regs[4] = {0};
+
+        // The OS must save the SSE, AVX, opmask and ZMM states
+        if (!HaveOSRegisterSupport(0xe6))
+            return false;
+        CpuID(7, regs);
+        // Bit 16 of EBX indicates AVX-512 Foundation instruction support
+        return (regs[1] >> 16) & 1;
+    }
+
+    bool HaveAVX512VPOPCNTDQ(void)
+    {
+        // EAX, EBX, ECX, EDX
+        uint32_t regs[4] = {0};
+
+        if (!HaveAVX512F())
+            return false;
+        CpuID(7, regs);
+        // Bit 14 of ECX indicates VPOPCNTD/VPOPCNTQ instruction support
+        return (regs[2] >> 14) & 1;
+    }
+
     bool HavePopcnt(void)
     {
         // EAX, EBX, ECX, EDX
@@ -372,6 +565,18 @@ namespace Util {
         return __builtin_popcountl(n);
 #endif /* defined(_WIN32) ... defined(__x86_64__) */
     }
+
+    // Index of the lowest set bit. n must not be zero.
+    inline uint32_t CountTrailingZeros(uint64_t n)
+    {
+#if defined(_WIN32)
+        unsigned long index;
+        _BitScanForward64(&index, n);
+        return index;
+#else
+        return __builtin_ctzll(n);
+#endif /* defined(_WIN32) */
+    }
 }
 
 #endif  // SRC_CPP_UTIL_HPP_
@@ -21,8 +21,10 @@
 #include "calculate_bucket.hpp"
 #include "disk.hpp"
 #include "plotter_disk.hpp"
+#include "park_cache.hpp"
 #include "prover_disk.hpp"
 #include "sort_manager.hpp"
+#include "thread_pool.hpp"
 #include "verifier.hpp"
 
 using namespace std;
@@ -386,6 +388,27 @@ TEST_CASE("F functions")
         REQUIRE(result4.first.GetValue() == results[max_batch - 1]);
     }
 
+    SECTION("ChaCha8 keystream")
+    {
+        uint8_t test_key[] = {0, 2, 3, 4,  5, 5, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
+                              1, 2, 3, 41, 5, 6, 7, 8, 9, 10, 11, 12, 13, 11, 15, 16};
+        struct chacha8_ctx ctx;
+        chacha8_keysetup(&ctx, test_key, 256, NULL);
+
+        // Multi-block requests take the SIMD kernels, single blocks the portable code. The
+        // counter starts below 2^32 so that the carry into the high word is exercised.
+        uint32_t const n_blocks = 61;
+        for (uint64_t pos : {0ULL, 12345ULL, (1ULL << 32) - 20}) {
+            vector<uint8_t> batch(n_blocks * 64);
+            chacha8_get_keystream(&ctx, pos, n_blocks, batch.data());
+            for (uint32_t i = 0; i < n_blocks; i++) {
+                uint8_t block[64];
+                chacha8_get_keystream(&ctx, pos + i, 1, block);
+                REQUIRE(memcmp(block, batch.data() + i * 64, 64) == 0);
+            }
+        }
+    }
+
     SECTION("F2")
     {
         uint8_t test_key_2[] = {20,  2,  5,  4,   51, 52,  23,  84,  91, 10, 111,
@@ -477,6 +500,90 @@ TEST_CASE("F functions")
         VerifyFC(7, 16, 0x5fec898f, 0x82283d15, 0x14f410, 0x24c3c2, 0x0);
         VerifyFC(7, 16, 0x64ac5db9, 0x7923986, 0x590fd, 0x1c74a2, 0x0);
     }
+
+    SECTION("FindMatches kernels")
+    {
+        std::vector<MatchKernel> kernels = {MatchKernel::scalar};
+        if (Util::HaveAVX2()) {
+            kernels.push_back(MatchKernel::avx2);
+        }
+        if (Util::HaveAVX512F()) {
+            kernels.push_back(MatchKernel::avx512);
+        }
+
+        std::mt19937_64 rng(7);
+        FxCalculator fx(20, 2);
+        for (uint64_t group = 10; group < 30; group++) {
+            // Dense buckets with some repeated y values, so that rmap counts above one occur
+            vector<uint64_t> y_L(300), y_R(300);
+            for (uint64_t& y : y_L) y = group * kBC + rng() % kBC;
+            for (uint64_t& y : y_R) y = (group + 1) * kBC + rng() % (kBC / 8);
+
+            vector<uint16_t> expected_L(10000), expected_R(10000);
+            fx.SetMatchKernel(MatchKernel::scalar);
+            int32_t expected_count = fx.FindMatches(
+                y_L.data(), y_L.size(), y_R.data(), y_R.size(), expected_L.data(), expected_R.data());
+            REQUIRE(expected_count > 0);
+
+            for (MatchKernel kernel : kernels) {
+                vector<uint16_t> idx_L(10000), idx_R(10000);
+                fx.SetMatchKernel(kernel);
+                int32_t count = fx.FindMatches(
+                    y_L.data(), y_L.size(), y_R.data(), y_R.size(), idx_L.data(), idx_R.data());
+                REQUIRE(count == expected_count);
+                REQUIRE(idx_L == expected_L);
+                REQUIRE(idx_R == expected_R);
+                REQUIRE(
+                    fx.FindMatches(y_L.data(), y_L.size(), y_R.data(), y_R.size(), nullptr, nullptr) ==
+                    expected_count);
+            }
+        }
+    }
+
+    SECTION("Fx batch")
+    {
+        std::mt19937_64 rng(42);
+        auto random_bits = [&rng](uint32_t num_bits) -> uint128_t {
+            uint128_t value = ((uint128_t)rng() << 64) | rng();
+            return num_bits < 128 ? value & (((uint128_t)1 << num_bits) - 1) : value;
+        };
+        auto metadata_to_bits = [](const FxMetadata& m, uint32_t size) -> Bits {
+            if (size > 128) {
+                return Bits(m.left, 128) + Bits(m.right, size - 128);
+            }
+            return size ? Bits(m.left, size) : Bits();
+        };
+
+        // 37 inputs exercise both full SIMD batches and the tail
+        const uint32_t n = 37;
+        for (uint8_t k : {16, 32, 49}) {
+            for (uint8_t t = 2; t <= 7; t++) {
+                FxCalculator fx(k, t);
+                uint32_t metadata_size = kVectorLens[t] * k;
+                uint32_t c_size = t < 7 ? kVectorLens[t + 1] * k : 0;
+
+                vector<uint64_t> y1(n), f(n);
+                vector<FxMetadata> L(n), R(n), c(n);
+                for (uint32_t i = 0; i < n; i++) {
+                    y1[i] = (uint64_t)random_bits(k + kExtraBits);
+                    for (FxMetadata* m : {&L[i], &R[i]}) {
+                        m->left = random_bits(std::min(metadata_size, 128U));
+                        m->right = metadata_size > 128 ? random_bits(metadata_size - 128) : 0;
+                    }
+                }
+                fx.CalculateBuckets(n, y1.data(), L.data(), R.data(), f.data(), c.data());
+
+                for (uint32_t i = 0; i < n; i++) {
+                    std::pair<Bits, Bits> expected = fx.CalculateBucket(
+                        Bits(y1[i], k + kExtraBits),
+                        metadata_to_bits(L[i], metadata_size),
+                        metadata_to_bits(R[i], metadata_size));
+                    REQUIRE(expected.first.GetValue() == f[i]);
+                    REQUIRE(expected.second == metadata_to_bits(c[i], c_size));
+                }
+            }
+        }
+    }
 }
 
 void HexToBytes(const string& hex, uint8_t* result)
@@ -493,9 +600,11 @@ void TestProofOfSpace(
     uint32_t iterations,
     uint8_t k,
     uint8_t* plot_id,
-    uint32_t num_proofs)
+    uint32_t num_proofs,
+    uint8_t prover_flags = 0,
+    uint64_t park_cache_size = 0)
 {
-    DiskProver prover(filename);
+    DiskProver prover(filename, prover_flags, park_cache_size);
     uint8_t* proof_data = new uint8_t[8 * k];
     uint32_t success = 0;
     // Tries an edge case challenge with many 1s in the front, and ensures there is no segfault
@@ -531,6 +640,49 @@ void TestProofOfSpace(
     REQUIRE(success > 0.5 * iterations);
     REQUIRE(success < 1.5 * iterations);
     delete[] proof_data;
+    if (park_cache_size > 0) {
+        // A full proof reads the C3 entry, the P7 park and the parks of tables 6 to 1 that
+        // its quality was read from
+        REQUIRE(prover.GetParkCacheHits() >= 8 * success);
+    }
+
+    // Lookups from several threads at once give the same results
+    uint32_t const concurrent_iterations = std::min<uint32_t>(iterations, 100);
+    std::vector<vector<LargeBits>> expected(concurrent_iterations);
+    std::vector<vector<LargeBits>> expected_proofs(concurrent_iterations);
+    for (uint32_t i = 0; i < concurrent_iterations; i++) {
+        vector<unsigned char> hash_input = intToBytes(i, 4);
+        vector<unsigned char> hash(picosha2::k_digest_size);
+        picosha2::hash256(hash_input.begin(), hash_input.end(), hash.begin(), hash.end());
+        expected[i] = prover.GetQualitiesForChallenge(hash.data());
+        for (uint32_t index = 0; index < expected[i].size(); index++) {
+            expected_proofs[i].push_back(prover.GetFullProof(hash.data(), index));
+        }
+    }
+    std::atomic<uint32_t> mismatches{0};
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t < 4; t++) {
+        threads.emplace_back([&, t] {
+            for (uint32_t n = 0; n < concurrent_iterations; n++) {
+                uint32_t const i = (n + t * 7) % concurrent_iterations;
+                vector<unsigned char> hash_input = intToBytes(i, 4);
+                vector<unsigned char> hash(picosha2::k_digest_size);
+                picosha2::hash256(hash_input.begin(), hash_input.end(), hash.begin(), hash.end());
+                if (prover.GetQualitiesForChallenge(hash.data()) != expected[i]) {
+                    mismatches++;
+                }
+                for (uint32_t index = 0; index < expected_proofs[i].size(); index++) {
+                    if (!(prover.GetFullProof(hash.data(), index) == expected_proofs[i][index])) {
+                        mismatches++;
+                    }
+                }
+            }
+        });
+    }
+    for (auto& th : threads) {
+        th.join();
+    }
+    REQUIRE(mismatches == 0);
 }
 
 void PlotAndTestProofOfSpace(
@@ -541,13 +693,15 @@ void PlotAndTestProofOfSpace(
     uint32_t buffer,
     uint32_t num_proofs,
     uint32_t stripe_size,
-    uint8_t num_threads)
+    uint8_t num_threads,
+    uint8_t prover_flags = 0,
+    uint64_t park_cache_size = 0)
 {
     DiskPlotter plotter = DiskPlotter();
     uint8_t memo[5] = {1, 2, 3, 4, 5};
     plotter.CreatePlotDisk(
         ".", ".", ".", filename, k, memo, 5, plot_id, 32, buffer, 0, stripe_size, num_threads);
-    TestProofOfSpace(filename, iterations, k, plot_id, num_proofs);
+    TestProofOfSpace(filename, iterations, k, plot_id, num_proofs, prover_flags, park_cache_size);
     REQUIRE(remove(filename.c_str()) == 0);
 }
 
@@ -557,6 +711,21 @@ TEST_CASE("Plotting")
     {
         PlotAndTestProofOfSpace("cpp-test-plot.dat", 100, 18, plot_id_1, 11, 95, 4000, 2);
     }
+    SECTION("Disk plot k18 mmap prover")
+    {
+        PlotAndTestProofOfSpace(
+            "cpp-test-plot.dat", 100, 18, plot_id_1, 11, 95, 4000, 2, MMAP_PLOT);
+    }
+    SECTION("Disk plot k18 resident C1 and C3 prover")
+    {
+        PlotAndTestProofOfSpace(
+            "cpp-test-plot.dat", 100, 18, plot_id_1, 11, 95, 4000, 2, RESIDENT_C1 | RESIDENT_C3);
+    }
+    SECTION("Disk plot k18 park cache prover")
+    {
+        PlotAndTestProofOfSpace(
+            "cpp-test-plot.dat", 100, 18, plot_id_1, 11, 95, 4000, 2, 0, 64 << 20);
+    }
     SECTION("Disk plot k19")
     {
         PlotAndTestProofOfSpace("cpp-test-plot.dat", 100, 19, plot_id_1, 100, 71, 8192, 2);
@@ -699,6 +868,146 @@ TEST_CASE("Sort on disk")
         remove("test_file.bin");
     }
 
+    SECTION("Io uring file disk")
+    {
+        // Without kernel support, this runs with stdio
+        FileDisk::UseIoUring(true);
+        {
+            FileDisk d("test_io_uring.bin");
+            FileDisk::UseIoUring(false);
+
+            // More and larger writes than the ring has staging buffers
+            vector<uint8_t> buf(40 << 20);
+            for (size_t i = 0; i < buf.size(); i++) {
+                buf[i] = i * 11 + 3;
+            }
+            for (size_t i = 0; i < buf.size(); i += 100000) {
+                d.Write(i, buf.data() + i, std::min<size_t>(100000, buf.size() - i));
+            }
+            REQUIRE(d.GetWriteMax() == buf.size());
+
+            vector<uint8_t> read_buf(buf.size());
+            d.Read(0, read_buf.data(), read_buf.size());
+            REQUIRE(read_buf == buf);
+
+            d.Write(5, buf.data(), 1000);
+            d.Close();
+            d.Truncate(2000);
+            d.Read(0, read_buf.data(), 1005);
+            REQUIRE(memcmp(read_buf.data() + 5, buf.data(), 1000) == 0);
+            REQUIRE(memcmp(read_buf.data(), buf.data(), 5) == 0);
+            d.Remove();
+        }
+        REQUIRE(!fs::exists("test_io_uring.bin"));
+    }
+
+    SECTION("Direct file disk")
+    {
+        for (bool io_uring : {false, true}) {
+            FileDisk::UseDirectIo(true);
+            FileDisk::UseIoUring(io_uring);
+            FileDisk d("test_direct.bin");
+            FileDisk::UseDirectIo(false);
+            FileDisk::UseIoUring(false);
+
+            // Sequential writes of odd sizes, some larger than the bounce buffer, and a few
+            // overwrites in between
+            vector<uint8_t> expected(12 << 20);
+            for (size_t i = 0; i < expected.size(); i++) {
+                expected[i] = i * 7 + 11;
+            }
+            uint64_t pos = 0;
+            for (uint64_t size : {1ULL, 4095ULL, 12289ULL, 5000000ULL, 333ULL, 4567891ULL}) {
+                d.Write(pos, expected.data() + pos, size);
+                pos += size;
+                if (pos > 3000) {
+                    expected[pos - 3000] = 42;
+                    d.Write(pos - 3000, expected.data() + pos - 3000, 1);
+                }
+            }
+            expected.resize(pos);
+
+            vector<uint8_t> read_buf(expected.size());
+            d.Read(0, read_buf.data(), read_buf.size());
+            REQUIRE(read_buf == expected);
+            d.Read(12345, read_buf.data(), 54321);
+            REQUIRE(memcmp(read_buf.data(), expected.data() + 12345, 54321) == 0);
+
+            Util::AlignedBuffer aligned = Util::AllocateAligned(1 << 20);
+            d.Read(Util::kIoAlignment, aligned.get(), (1 << 20) - 5);
+            REQUIRE(memcmp(aligned.get(), expected.data() + Util::kIoAlignment, (1 << 20) - 5) == 0);
+
+            // The padding of the last block is cut off
+            d.Close();
+            REQUIRE(fs::file_size("test_direct.bin") == expected.size());
+            d.Read(expected.size() - 10, read_buf.data(), 10);
+            REQUIRE(memcmp(read_buf.data(), expected.data() + expected.size() - 10, 10) == 0);
+            d.Remove();
+        }
+    }
+
+    SECTION("Write behind disk")
+    {
+        vector<uint8_t> buf(5 * write_cache + 123);
+        for (size_t i = 0; i < buf.size(); i++) {
+            buf[i] = i * 13 + 5;
+        }
+        {
+            // Fewer buffers than writes, so that the writes wait for buffers
+            WriteBehind write_behind(2, 2);
+            FileDisk d("test_write_behind.bin");
+            BufferedDisk disk(&d, buf.size(), &write_behind);
+            for (size_t i = 0; i < buf.size(); i += 1000) {
+                disk.Write(i, buf.data() + i, std::min<size_t>(1000, buf.size() - i));
+            }
+            disk.FlushCache();
+            write_behind.Wait(&d);
+
+            WriteBehind::Stats const stats = write_behind.GetStats();
+            REQUIRE(stats.bytes_submitted == buf.size());
+            REQUIRE(stats.bytes_written == buf.size());
+
+            vector<uint8_t> read_buf(buf.size());
+            d.Read(0, read_buf.data(), read_buf.size());
+            REQUIRE(read_buf == buf);
+            for (size_t i = 0; i + 100 < buf.size(); i += 100000) {
+                REQUIRE(memcmp(disk.Read(i, 100), buf.data() + i, 100) == 0);
+            }
+        }
+        remove("test_write_behind.bin");
+    }
+
+    SECTION("Memory file disk")
+    {
+        FileDisk d = FileDisk("test_memory_file.bin", true);
+        REQUIRE(!fs::exists("test_memory_file.bin"));
+
+        // Crosses a block boundary, and leaves a gap in front that reads as zeros
+        vector<uint8_t> buf(3 << 20);
+        for (size_t i = 0; i < buf.size(); i++) {
+            buf[i] = i * 7 + 1;
+        }
+        d.Write(3 << 20, buf.data(), buf.size());
+        REQUIRE(d.GetWriteMax() == 6 << 20);
+
+        vector<uint8_t> read_buf(buf.size());
+        d.Read(3 << 20, read_buf.data(), read_buf.size());
+        REQUIRE(read_buf == buf);
+        d.Read(0, read_buf.data(), 100);
+        REQUIRE(std::all_of(read_buf.begin(), read_buf.begin() + 100, [](uint8_t v) { return v == 0; }));
+        REQUIRE_THROWS_AS(d.Read((6 << 20) - 2, read_buf.data(), 5), InvalidValueException);
+
+        // Shrinking and growing again exposes zeros
+        d.Truncate(5 << 20);
+        d.Write((6 << 20) - 1, buf.data(), 1);
+        d.Read((5 << 20) - 1, read_buf.data(), 2);
+        REQUIRE(read_buf[0] == buf[(2 << 20) - 1]);
+        REQUIRE(read_buf[1] == 0);
+
+        d.Remove();
+        REQUIRE(d.GetWriteMax() == 0);
+    }
+
     SECTION("Lazy Sort Manager QS")
     {
         uint32_t iters = 250000;
@@ -755,6 +1064,183 @@ TEST_CASE("Sort on disk")
         }
     }
 
+    SECTION("Lazy Sort Manager concurrent writers")
+    {
+        uint32_t const iters = 120000;
+        uint32_t const size = 32;
+        uint32_t const num_threads = 4;
+        const uint32_t memory_len = 1000000;
+        SortManager manager(memory_len, 16, 4, size, ".", "test-files", 0, 1);
+
+        vector<vector<uint8_t>> input(iters);
+        for (uint32_t i = 0; i < iters; i++) {
+            vector<unsigned char> hash_input = intToBytes(i, 4);
+            input[i].resize(picosha2::k_digest_size);
+            picosha2::hash256(hash_input.begin(), hash_input.end(), input[i].begin(), input[i].end());
+        }
+
+        vector<thread> threads;
+        for (uint32_t t = 0; t < num_threads; t++) {
+            threads.emplace_back([&, t]() {
+                SortManager::Writer writer(manager);
+                for (uint32_t i = t; i < iters; i += num_threads) {
+                    writer.Add(input[i].data());
+                }
+                writer.Flush();
+            });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        manager.FlushCache();
+
+        sort(input.begin(), input.end());
+        for (uint32_t i = 0; i < iters; i++) {
+            REQUIRE(memcmp(input[i].data(), manager.ReadEntry(i * size), size) == 0);
+        }
+    }
+
+    SECTION("Lazy Sort Manager parallel sort")
+    {
+        uint32_t const iters = 120000;
+        uint32_t const size = 32;
+        const uint32_t memory_len = 5000000;
+
+        vector<vector<uint8_t>> input(iters);
+        for (uint32_t i = 0; i < iters; i++) {
+            vector<unsigned char> hash_input = intToBytes(i, 4);
+            input[i].resize(picosha2::k_digest_size);
+            picosha2::hash256(hash_input.begin(), hash_input.end(), input[i].begin(), input[i].end());
+        }
+        sort(input.begin(), input.end());
+
+        for (strategy_t strategy : {strategy_t::uniform, strategy_t::quicksort}) {
+            SortManager manager(memory_len, 2, 1, size, ".", "test-files", 0, 1, strategy, 4);
+            for (uint32_t i = 0; i < iters; i++) {
+                manager.AddToCache(input[(i * 7919) % iters].data());
+            }
+            manager.FlushCache();
+            for (uint32_t i = 0; i < iters; i++) {
+                REQUIRE(memcmp(input[i].data(), manager.ReadEntry(i * size), size) == 0);
+            }
+        }
+    }
+
+    SECTION("Lazy Sort Manager background sort")
+    {
+        uint32_t const iters = 120000;
+        uint32_t const size = 32;
+        const uint32_t memory_len = 5000000;
+
+        vector<vector<uint8_t>> input(iters);
+        for (uint32_t i = 0; i < iters; i++) {
+            vector<unsigned char> hash_input = intToBytes(i, 4);
+            input[i].resize(picosha2::k_digest_size);
+            picosha2::hash256(hash_input.begin(), hash_input.end(), input[i].begin(), input[i].end());
+        }
+        sort(input.begin(), input.end());
+
+        for (strategy_t strategy : {strategy_t::uniform, strategy_t::quicksort_last}) {
+            SortManager manager(
+                memory_len, 16, 4, size, ".", "test-files", 0, 1, strategy, 2, true);
+            for (uint32_t i = 0; i < iters; i++) {
+                manager.AddToCache(input[(i * 7919) % iters].data());
+            }
+            manager.FlushCache();
+            for (uint32_t i = 0; i < iters; i++) {
+                REQUIRE(memcmp(input[i].data(), manager.ReadEntry(i * size), size) == 0);
+            }
+        }
+    }
+
+    SECTION("Lazy Sort Manager radix sort")
+    {
+        uint32_t const iters = 100000;
+        uint32_t const size = 12;
+        const uint32_t memory_len = 5000000;
+
+        // The zero bytes make many entries share the bits that fit into the radix sort key,
+        // and the small id range adds duplicates
+        vector<vector<uint8_t>> input(iters);
+        for (uint32_t i = 0; i < iters; i++) {
+            vector<unsigned char> hash_input = intToBytes(i % 90000, 4);
+            vector<unsigned char> hash(picosha2::k_digest_size);
+            picosha2::hash256(hash_input.begin(), hash_input.end(), hash.begin(), hash.end());
+            input[i].assign(hash.begin(), hash.begin() + size);
+            memset(input[i].data() + 1, 0, 6);
+        }
+        sort(input.begin(), input.end());
+
+        for (uint32_t num_threads : {1, 3}) {
+            for (bool presort : {false, true}) {
+                SortManager manager(
+                    memory_len, 16, 4, size, ".", "test-files", 0, 1, strategy_t::radix,
+                    num_threads, presort);
+                for (uint32_t i = 0; i < iters; i++) {
+                    manager.AddToCache(input[(i * 7919) % iters].data());
+                }
+                manager.FlushCache();
+                for (uint32_t i = 0; i < iters; i++) {
+                    REQUIRE(memcmp(input[i].data(), manager.ReadEntry(i * size), size) == 0);
+                }
+            }
+        }
+    }
+
+    SECTION("Packed Sort Manager")
+    {
+        uint32_t const iters = 50001;
+        const uint32_t memory_len = 5000000;
+
+        for (uint32_t entry_bits : {64, 70, 93}) {
+            uint32_t const size = cdiv(entry_bits, 8) + (entry_bits == 93 ? 1 : 0);
+            vector<vector<uint8_t>> input(iters);
+            for (uint32_t i = 0; i < iters; i++) {
+                vector<unsigned char> hash_input = intToBytes(i, 4);
+                vector<unsigned char> hash(picosha2::k_digest_size);
+                picosha2::hash256(hash_input.begin(), hash_input.end(), hash.begin(), hash.end());
+                input[i].assign(size + 7, 0);
+                uint32_t bit_pos = 0;
+                uint128_t const value = Util::SliceInt128FromBytes(hash.data(), 0, entry_bits);
+                Util::AppendBits(input[i].data(), bit_pos, value, entry_bits);
+            }
+
+            // The kernels round trip, also when unpacking in place
+            vector<uint8_t> packed(iters * size + 8);
+            vector<uint8_t> entries(iters * size);
+            for (uint32_t i = 0; i < iters; i++) {
+                memcpy(entries.data() + i * size, input[i].data(), size);
+            }
+            Util::PackEntries(entries.data(), size, entry_bits, iters, packed.data());
+            uint64_t const packed_bytes = cdiv(uint64_t(iters) * entry_bits, 8);
+            memmove(packed.data() + iters * size + 8 - packed_bytes, packed.data(), packed_bytes);
+            Util::UnpackEntries(
+                packed.data() + iters * size + 8 - packed_bytes, entry_bits, iters, packed.data(), size);
+            REQUIRE(memcmp(entries.data(), packed.data(), iters * size) == 0);
+
+            sort(input.begin(), input.end());
+            for (strategy_t strategy : {strategy_t::uniform, strategy_t::radix}) {
+                SortManager manager(
+                    memory_len, 16, 4, size, ".", "test-files", 0, 1, strategy, 1, false, false,
+                    entry_bits);
+                {
+                    SortManager::Writer writer(manager);
+                    for (uint32_t i = 0; i < iters; i += 2) {
+                        writer.Add(input[(i * 7919) % iters].data());
+                    }
+                    writer.Flush();
+                }
+                for (uint32_t i = 1; i < iters; i += 2) {
+                    manager.AddToCache(input[(i * 7919) % iters].data());
+                }
+                manager.FlushCache();
+                for (uint32_t i = 0; i < iters; i++) {
+                    REQUIRE(memcmp(input[i].data(), manager.ReadEntry(i * size), size) == 0);
+                }
+            }
+        }
+    }
+
     SECTION("Sort in Memory")
     {
         uint32_t iters = 100000;
@@ -838,6 +1324,30 @@ TEST_CASE("bitfield-count-unaligned")
     }
 }
 
+TEST_CASE("bitfield-set-atomic")
+{
+    bitfield b(4096);
+
+    // The threads set interleaved bits, so they keep setting bits in the same words
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&b, t]() {
+            for (int i = t; i < 4096; i += 8) {
+                b.set_atomic(i);
+                b.set_atomic(i);
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    for (int i = 0; i < 4096; ++i) {
+        CHECK(b.get(i) == (i % 8 < 4));
+    }
+    CHECK(b.count(0, 4096) == 2048);
+}
+
 TEST_CASE("bitfield_index-simple")
 {
     bitfield b(64);
@@ -909,6 +1419,46 @@ TEST_CASE("bitfield_index edge-sizes")
     test_bitfield_size(bitfield_index::kIndexBucket + 1);
 }
 
+TEST_CASE("bitfield_index rank")
+{
+    int64_t const size = 100000;
+    bitfield b(size);
+    std::mt19937 rng(42);
+    for (int64_t i = 0; i < size; ++i) {
+        // Runs of set bits, so that some words are full
+        if (rng() % 3 != 0 || (i / 4096) % 2 == 0) b.set(i);
+    }
+
+    std::vector<popcount_kernel> kernels = {popcount_kernel::scalar};
+    if (Util::HaveAVX2()) kernels.push_back(popcount_kernel::avx2);
+    if (Util::HaveAVX512VPOPCNTDQ()) kernels.push_back(popcount_kernel::avx512);
+
+    for (popcount_kernel kernel : kernels) {
+        bitfield_index const idx(b, kernel);
+        for (int64_t i = 0; i < size; ++i) {
+            REQUIRE(idx.rank(i) == uint64_t(b.count(0, i)));
+        }
+
+        std::vector<uint64_t> pos;
+        std::vector<uint64_t> offset;
+        for (int64_t i = 0; i + 100 < size; i += 7) {
+            if (!b.get(i)) continue;
+            for (int64_t j = 0; j < 100; ++j) {
+                if (!b.get(i + j)) continue;
+                pos.push_back(i);
+                offset.push_back(j);
+                break;
+            }
+        }
+        std::vector<uint64_t> new_pos = pos;
+        std::vector<uint64_t> new_offset = offset;
+        idx.lookup(new_pos.data(), new_offset.data(), new_pos.size());
+        for (size_t i = 0; i < pos.size(); ++i) {
+            CHECK(idx.lookup(pos[i], offset[i]) == std::pair<uint64_t, uint64_t>{new_pos[i], new_offset[i]});
+        }
+    }
+}
+
 namespace {
 
 constexpr int num_test_entries = 2000000;
@@ -1025,3 +1575,114 @@ TEST_CASE("FilteredDisk")
 */
     remove("test_file.bin");
 }
+
+TEST_CASE("ThreadPool")
+{
+    ThreadPool pool(3);
+
+    SECTION("parallel for")
+    {
+        std::vector<std::atomic<int>> calls(1000);
+        pool.ParallelFor(calls.size(), [&](uint64_t i) { calls[i]++; });
+        for (auto& c : calls) {
+            CHECK(c == 1);
+        }
+        pool.ParallelFor(0, [&](uint64_t) { FAIL("no calls expected"); });
+    }
+
+    SECTION("nested")
+    {
+        std::atomic<uint64_t> sum{0};
+        pool.ParallelFor(8, [&](uint64_t i) {
+            pool.ParallelFor(100, [&](uint64_t j) { sum += i * 100 + j; });
+        });
+        CHECK(sum == 800 * 799 / 2);
+    }
+
+    SECTION("exception")
+    {
+        std::atomic<int> calls{0};
+        CHECK_THROWS_WITH(
+            pool.ParallelFor(
+                100,
+                [&](uint64_t i) {
+                    calls++;
+                    if (i == 42) throw std::runtime_error("failed");
+                }),
+            "failed");
+        CHECK(calls == 100);
+    }
+}
+
+TEST_CASE("ParkCache")
+{
+    auto make_park = [](uint8_t value) {
+        auto park = std::make_shared<DecodedPark>();
+        park->deltas.assign(1000, value);
+        return park;
+    };
+
+    SECTION("hits and misses")
+    {
+        ParkCache cache(1 << 20);
+        CHECK(cache.Get(1, 5) == nullptr);
+        cache.Put(1, 5, make_park(1));
+        cache.Put(2, 5, make_park(2));
+        REQUIRE(cache.Get(1, 5) != nullptr);
+        CHECK(cache.Get(1, 5)->deltas[0] == 1);
+        CHECK(cache.Get(2, 5)->deltas[0] == 2);
+        CHECK(cache.Get(1, 6) == nullptr);
+        CHECK(cache.GetHits() == 3);
+        CHECK(cache.GetMisses() == 2);
+
+        // The first park put in stays
+        cache.Put(1, 5, make_park(3));
+        CHECK(cache.Get(1, 5)->deltas[0] == 1);
+        CHECK(cache.GetSize() == 2 * make_park(0)->Size());
+    }
+
+    SECTION("bounded")
+    {
+        uint64_t const park_size = make_park(0)->Size();
+        ParkCache cache(64 * park_size);
+        for (uint64_t i = 0; i < 1000; i++) {
+            cache.Put(7, i, make_park(i));
+            // Keeps the first park in use, so it is never the least recently used one
+            REQUIRE(cache.Get(7, 0) != nullptr);
+        }
+        CHECK(cache.GetSize() <= 64 * park_size);
+        CHECK(cache.GetSize() > 0);
+        CHECK(cache.Get(7, 999) != nullptr);
+
+        // Parks larger than the cache are not kept
+        ParkCache small_cache(park_size);
+        small_cache.Put(1, 1, make_park(1));
+        CHECK(small_cache.Get(1, 1) == nullptr);
+    }
+
+    SECTION("concurrent")
+    {
+        ParkCache cache(1 << 20);
+        std::atomic<uint32_t> wrong{0};
+        std::vector<std::thread> threads;
+        for (uint32_t t = 0; t < 4; t++) {
+            threads.emplace_back([&] {
+                for (uint32_t i = 0; i < 10000; i++) {
+                    uint8_t const value = i % 200;
+                    auto park = cache.Get(3, value);
+                    if (!park) {
+                        cache.Put(3, value, make_park(value));
+                    } else if (park->deltas[0] != value) {
+                        wrong++;
+                    }
+                }
+            });
+        }
+        for (auto& th : threads) {
+            th.join();
+        }
+        CHECK(wrong == 0);
+        CHECK(cache.GetHits() + cache.GetMisses() == 40000);
+        CHECK(cache.GetSize() <= 1 << 20);
+    }
+}